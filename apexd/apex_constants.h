@@ -27,6 +27,8 @@ static constexpr const char* kApexDataDir = "/data/apex";
 static constexpr const char* kActiveApexPackagesDataDir = "/data/apex/active";
 static constexpr const char* kApexBackupDir = "/data/apex/backup";
 static constexpr const char* kApexHashTreeDir = "/data/apex/hashtree";
+// Name of the consolidated hashtree image inside kApexHashTreeDir.
+static constexpr const char* kApexHashTreeImageName = "hashtrees.img";
 static constexpr const char* kApexDecompressedDir = "/data/apex/decompressed";
 static constexpr const char* kOtaReservedDir = "/data/apex/ota_reserved";
 static constexpr const char* kApexPackageSystemDir = "/system/apex";
@@ -40,6 +42,8 @@ static const std::vector<std::string> kApexPackageBuiltinDirs = {
 };
 static constexpr const char* kApexRoot = "/apex";
 static constexpr const char* kStagedSessionsDir = "/data/app-staging";
+// Name of the APEX written into a session directory by stageApexFromFd.
+static constexpr const char* kStreamedApexFileName = "base.apex";
 
 static constexpr const char* kApexDataSubDir = "apexdata";
 static constexpr const char* kApexSharedLibsSubDir = "sharedlibs";
@@ -55,11 +59,18 @@ static constexpr const char* kCompressedApexPackageSuffix = ".capex";
 static constexpr const char* kDecompressedApexPackageSuffix =
     ".decompressed.apex";
 static constexpr const char* kOtaApexPackageSuffix = ".ota.apex";
+// Suffix of the files reserving space for the decompression of a package.
+static constexpr const char* kReservedSpaceSuffix = ".reserved";
 
 static constexpr const char* kManifestFilenameJson = "apex_manifest.json";
 static constexpr const char* kManifestFilenamePb = "apex_manifest.pb";
 
 static constexpr const char* kApexInfoList = "apex-info-list.xml";
+// Under kApexRoot, where apexd persists its database of mounted apexes.
+static constexpr const char* kMountDatabaseSnapshot = ".apexd-mounts.pb";
+// Under kApexRoot, where apexd --bootstrap leaves the pre-installed apexes it
+// found for the main apexd.
+static constexpr const char* kPreInstalledApexCache = ".apexd-preinstalled.pb";
 
 // These should be in-sync with system/sepolicy/private/property_contexts
 static constexpr const char* kApexStatusSysprop = "apexd.status";
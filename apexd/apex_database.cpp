@@ -20,6 +20,7 @@
 #include "apex_constants.h"
 #include "apex_file.h"
 #include "apexd_utils.h"
+#include "mount_database.pb.h"
 #include "string_log.h"
 
 #include <android-base/file.h>
@@ -28,11 +29,20 @@
 #include <android-base/result.h>
 #include <android-base/strings.h>
 
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
 #include <filesystem>
-#include <fstream>
+#include <future>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <tuple>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 using android::base::ConsumeSuffix;
 using android::base::EndsWith;
@@ -44,6 +54,8 @@ using android::base::Result;
 using android::base::Split;
 using android::base::StartsWith;
 using android::base::Trim;
+using android::base::WriteStringToFile;
+using ::apex::proto::MountDatabaseSnapshot;
 
 namespace fs = std::filesystem;
 
@@ -61,12 +73,17 @@ enum BlockDeviceType {
 };
 
 const fs::path kDevBlock = "/dev/block";
-const fs::path kSysBlock = "/sys/block";
+// Upper bound on the threads resolving mounts in PopulateFromMounts.
+constexpr size_t kMaxMountResolutionWorkers = 4;
+// Version of the persisted snapshots, to bump on incompatible changes.
+constexpr int32_t kMountDatabaseSnapshotVersion = 2;
 
 class BlockDevice {
   std::string name;  // loopN, dm-N, ...
+  fs::path sys_path;  // Directory of the device in sysfs.
  public:
-  explicit BlockDevice(const fs::path& path) { name = path.filename(); }
+  BlockDevice(const fs::path& path, const fs::path& sys_path)
+      : name(path.filename()), sys_path(sys_path) {}
 
   BlockDeviceType GetType() const {
     if (StartsWith(name, "loop")) return LoopDevice;
@@ -74,7 +91,7 @@ class BlockDevice {
     return UnknownDevice;
   }
 
-  fs::path SysPath() const { return kSysBlock / name; }
+  fs::path SysPath() const { return sys_path; }
 
   fs::path DevPath() const { return kDevBlock / name; }
 
@@ -89,12 +106,9 @@ class BlockDevice {
 
   std::vector<BlockDevice> GetSlaves() const {
     std::vector<BlockDevice> slaves;
-    std::error_code ec;
+    // Entries of slaves/ are links to the sysfs directories of the devices.
     auto status = WalkDir(SysPath() / "slaves", [&](const auto& entry) {
-      BlockDevice dev(entry);
-      if (fs::is_block_file(dev.DevPath(), ec)) {
-        slaves.push_back(dev);
-      }
+      slaves.emplace_back(entry.path().filename(), entry.path());
     });
     if (!status.ok()) {
       LOG(WARNING) << status.error();
@@ -103,12 +117,71 @@ class BlockDevice {
   }
 };
 
-std::pair<fs::path, fs::path> ParseMountInfo(const std::string& mount_info) {
-  const auto& tokens = Split(mount_info, " ");
-  if (tokens.size() < 2) {
-    return std::make_pair("", "");
+bool IsActiveMountPoint(const std::string& mount_point) {
+  return (mount_point.find('@') == std::string::npos);
+}
+
+// An APEX mount listed in mountinfo.
+struct ApexMount {
+  std::string source;     // Block device or backing file.
+  std::string device_id;  // <major>:<minor> of the mounted device.
+  std::string mount_point;
+};
+
+// Undoes the octal escaping of spaces and other special characters in
+// mountinfo fields, e.g. "\040".
+std::string UnescapeMountInfoField(const std::string& field) {
+  std::string ret;
+  ret.reserve(field.size());
+  for (size_t i = 0; i < field.size(); i++) {
+    if (field[i] == '\\' && i + 3 < field.size() &&
+        std::all_of(field.begin() + i + 1, field.begin() + i + 4,
+                    [](char c) { return c >= '0' && c <= '7'; })) {
+      ret += static_cast<char>(std::stoi(field.substr(i + 1, 3), nullptr, 8));
+      i += 3;
+    } else {
+      ret += field[i];
+    }
+  }
+  return ret;
+}
+
+// Returns the /apex/<package>@<version> mounts listed in |mountinfo_path|, in
+// the order they were mounted.
+std::vector<ApexMount> ReadApexMounts(const std::string& mountinfo_path) {
+  std::string mountinfo;
+  if (!ReadFileToString(mountinfo_path, &mountinfo)) {
+    PLOG(ERROR) << "Failed to read " << mountinfo_path;
+    return {};
+  }
+  std::vector<ApexMount> mounts;
+  for (const auto& line : Split(mountinfo, "\n")) {
+    // Most mounts aren't under /apex, don't bother splitting them.
+    if (line.find(" /apex/") == std::string::npos) {
+      continue;
+    }
+    // <id> <parent id> <major>:<minor> <root> <mount point> <options>
+    //     [<optional field>...] - <fs type> <source> <super options>
+    auto fields = Split(line, " ");
+    if (fields.size() < 6) {
+      continue;
+    }
+    auto separator = std::find(fields.begin() + 6, fields.end(), "-");
+    if (fields.end() - separator < 3) {
+      continue;
+    }
+    auto mount_point = UnescapeMountInfoField(fields[4]);
+    // TODO(b/158469914): distinguish between temp and non-temp mounts
+    if (fs::path(mount_point).parent_path() != kApexRoot) {
+      continue;
+    }
+    if (IsActiveMountPoint(mount_point)) {
+      continue;
+    }
+    mounts.push_back({UnescapeMountInfoField(separator[2]), fields[2],
+                      std::move(mount_point)});
   }
-  return std::make_pair(tokens[0], tokens[1]);
+  return mounts;
 }
 
 std::pair<std::string, int> ParseMountPoint(const std::string& mount_point) {
@@ -124,10 +197,6 @@ std::pair<std::string, int> ParseMountPoint(const std::string& mount_point) {
   return std::make_pair(package_id, -1);
 }
 
-bool IsActiveMountPoint(const std::string& mount_point) {
-  return (mount_point.find('@') == std::string::npos);
-}
-
 Result<void> PopulateLoopInfo(const BlockDevice& top_device,
                               const std::string& active_apex_dir,
                               const std::string& decompression_dir,
@@ -172,7 +241,12 @@ Result<void> PopulateLoopInfo(const BlockDevice& top_device,
       return Error() << "Hashtree loop device " << slaves[1].DevPath()
                      << " has unexpected backing file " << backing_files[1];
     }
-    apex_data->hashtree_loop_name = slaves[1].DevPath();
+    // The consolidated hashtree image is shared by all dm-verity devices, so
+    // it isn't owned by any of them.
+    if (!StartsWith(backing_files[1],
+                    apex_hash_tree_dir + "/" + kApexHashTreeImageName)) {
+      apex_data->hashtree_loop_name = slaves[1].DevPath();
+    }
   }
   apex_data->loop_name = slaves[0].DevPath();
   apex_data->full_path = backing_files[0];
@@ -240,71 +314,265 @@ Result<MountedApexData> ResolveMountInfo(
   }
 }
 
+// APEX payloads mounted without a loop device show up in /proc/mounts with
+// their backing file as the source.
+Result<MountedApexData> ResolveFileBackedMountInfo(
+    const std::string& backing_file, const std::string& mount_point) {
+  bool temp_mount = EndsWith(mount_point, ".tmp");
+  auto result = MountedApexData(/* loop_name= */ "", backing_file, mount_point,
+                                /* device_name= */ "",
+                                /* hashtree_loop_name= */ "",
+                                /* is_temp_mount */ temp_mount);
+  NormalizeIfDeleted(&result);
+  return result;
+}
+
+Result<MountedApexData> ResolveApexMount(
+    const ApexMount& mount, const std::string& sys_root,
+    const std::string& active_apex_dir, const std::string& decompression_dir,
+    const std::string& apex_hash_tree_dir) {
+  fs::path source = mount.source;
+  auto mount_data =
+      source.parent_path() == kDevBlock
+          ? ResolveMountInfo(
+                BlockDevice(source,
+                            fs::path(sys_root) / "dev/block" / mount.device_id),
+                mount.mount_point, active_apex_dir, decompression_dir,
+                apex_hash_tree_dir)
+          : ResolveFileBackedMountInfo(mount.source, mount.mount_point);
+  if (mount_data.ok() && !mount_data->deleted) {
+    if (auto apex_file = ApexFile::Open(mount_data->full_path);
+        apex_file.ok()) {
+      mount_data->apex_file =
+          std::make_shared<const ApexFile>(std::move(*apex_file));
+    }
+  }
+  return mount_data;
+}
+
 }  // namespace
 
-// On startup, APEX database is populated from /proc/mounts.
+Result<void> MountedApexDatabase::WriteSnapshot(const Snapshot& snapshot,
+                                                const std::string& path,
+                                                const std::string& proc_root) {
+  std::map<std::string, ApexMount> mounts;
+  for (auto& mount : ReadApexMounts(proc_root + "/self/mountinfo")) {
+    mounts[mount.mount_point] = std::move(mount);
+  }
+  MountDatabaseSnapshot proto;
+  proto.set_version(kMountDatabaseSnapshotVersion);
+  for (const auto& [package, apexes] : snapshot.mounted_apexes) {
+    for (const auto& [data, latest] : apexes) {
+      auto* apex = proto.add_mounted_apexes();
+      apex->set_package(package);
+      apex->set_loop_name(data.loop_name);
+      apex->set_full_path(data.full_path);
+      apex->set_mount_point(data.mount_point);
+      apex->set_device_name(data.device_name);
+      apex->set_hashtree_loop_name(data.hashtree_loop_name);
+      apex->set_deleted(data.deleted);
+      apex->set_is_temp_mount(data.is_temp_mount);
+      apex->set_latest(latest);
+      if (auto it = mounts.find(data.mount_point); it != mounts.end()) {
+        apex->set_source(it->second.source);
+        apex->set_device_id(it->second.device_id);
+      }
+      if (data.apex_file != nullptr) {
+        ApexFileToProto(*data.apex_file, apex->mutable_apex_file());
+      }
+    }
+  }
+  // Readers must never see a partially written snapshot.
+  std::string tmp_path = path + ".tmp";
+  if (!WriteStringToFile(proto.SerializeAsString(), tmp_path)) {
+    return ErrnoError() << "Failed to write " << tmp_path;
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << tmp_path << " to " << path;
+  }
+  return {};
+}
+
+void MountedApexDatabase::PersistTo(const std::string& path,
+                                    const std::string& proc_root)
+    REQUIRES(!mounted_apexes_mutex_, !snapshot_mutex_, !persist_mutex_) {
+  {
+    std::lock_guard lock(persist_mutex_);
+    persist_path_ = path;
+    persist_proc_root_ = proc_root;
+    persisted_generation_.reset();
+  }
+  Persist();
+}
+
+void MountedApexDatabase::Persist()
+    REQUIRES(!mounted_apexes_mutex_, !snapshot_mutex_, !persist_mutex_) {
+  std::lock_guard lock(persist_mutex_);
+  if (persist_path_.empty()) {
+    return;
+  }
+  // Concurrent writers may publish in one order and get here in another, so
+  // always write the latest snapshot and skip it if it is already on disk.
+  auto snapshot = GetSnapshot();
+  if (persisted_generation_ && *persisted_generation_ >= snapshot->generation) {
+    return;
+  }
+  if (auto st = WriteSnapshot(*snapshot, persist_path_, persist_proc_root_);
+      !st.ok()) {
+    LOG(ERROR) << "Failed to persist APEX database: " << st.error();
+    return;
+  }
+  persisted_generation_ = snapshot->generation;
+}
+
+Result<void> MountedApexDatabase::LoadFromSnapshot(
+    const std::string& path, const std::string& proc_root)
+    REQUIRES(!mounted_apexes_mutex_, !snapshot_mutex_, !persist_mutex_) {
+  std::string content;
+  if (!ReadFileToString(path, &content)) {
+    return ErrnoError() << "Failed to read " << path;
+  }
+  MountDatabaseSnapshot proto;
+  if (!proto.ParseFromString(content)) {
+    return Error() << "Failed to parse " << path;
+  }
+  if (proto.version() != kMountDatabaseSnapshotVersion) {
+    return Error() << path << " has version " << proto.version()
+                   << " instead of " << kMountDatabaseSnapshotVersion;
+  }
+
+  // The snapshot is stale if anything was mounted or unmounted after it was
+  // written, e.g. because apexd died in between. A mount point that was
+  // remounted in the meantime shows up with another source or device.
+  using MountKey = std::tuple<std::string, std::string, std::string>;
+  std::multiset<MountKey> mounts;
+  for (auto& mount : ReadApexMounts(proc_root + "/self/mountinfo")) {
+    mounts.emplace(std::move(mount.mount_point), std::move(mount.source),
+                   std::move(mount.device_id));
+  }
+  std::multiset<MountKey> snapshot_mounts;
+  for (const auto& apex : proto.mounted_apexes()) {
+    snapshot_mounts.emplace(apex.mount_point(), apex.source(),
+                            apex.device_id());
+  }
+  if (mounts != snapshot_mounts) {
+    return Error() << path << " doesn't match the current mounts";
+  }
+
+  PackageMap mounted_apexes;
+  for (const auto& apex : proto.mounted_apexes()) {
+    MountedApexData data(apex.loop_name(), apex.full_path(),
+                         apex.mount_point(), apex.device_name(),
+                         apex.hashtree_loop_name(), apex.is_temp_mount());
+    data.deleted = apex.deleted();
+    if (apex.has_apex_file()) {
+      auto apex_file = ApexFileFromProto(apex.apex_file());
+      if (!apex_file.ok()) {
+        return apex_file.error();
+      }
+      data.apex_file = std::make_shared<const ApexFile>(std::move(*apex_file));
+    }
+    if (!mounted_apexes[apex.package()]
+             .emplace(std::move(data), apex.latest())
+             .second) {
+      return Error() << path << " lists " << apex.mount_point() << " twice";
+    }
+  }
+
+  size_t restored;
+  {
+    std::lock_guard lock(mounted_apexes_mutex_);
+    mounted_apexes_ = std::move(mounted_apexes);
+    restored = mounted_apexes_.size();
+    PublishLocked();
+  }
+  Persist();
+  LOG(INFO) << restored << " packages restored from " << path;
+  return {};
+}
+
+// On startup, APEX database is populated from /proc/self/mountinfo.
 
 // /apex/<package-id> can be mounted from
 // - /dev/block/loopX : loop device
 // - /dev/block/dm-X : dm-verity
+// - the APEX file itself : loop-free EROFS mount
 
 // In case of loop device, it is from a non-flattened
 // APEX file. This original APEX file can be tracked
-// by /sys/block/loopX/loop/backing_file.
+// by /sys/dev/block/<major>:<minor>/loop/backing_file.
 
 // In case of dm-verity, it is mapped to a loop device.
 // This mapped loop device can be traced by
-// /sys/block/dm-X/slaves/ directory which contains
-// a symlink to /sys/block/loopY, which leads to
+// /sys/dev/block/<major>:<minor>/slaves/ directory which
+// contains a symlink to /sys/block/loopY, which leads to
 // the original APEX file.
 // Device name can be retrieved from
-// /sys/block/dm-Y/dm/name.
+// /sys/dev/block/<major>:<minor>/dm/name.
+
+// Mounts are resolved in parallel, since that means reading a few sysfs
+// files and opening the APEX file for each of them.
 
 // By synchronizing the mounts info with Database on startup,
 // Apexd serves the correct package list even on the devices
 // which are not ro.apex.updatable.
 void MountedApexDatabase::PopulateFromMounts(
     const std::string& active_apex_dir, const std::string& decompression_dir,
-    const std::string& apex_hash_tree_dir) REQUIRES(!mounted_apexes_mutex_) {
+    const std::string& apex_hash_tree_dir, const std::string& proc_root,
+    const std::string& sys_root)
+    REQUIRES(!mounted_apexes_mutex_, !snapshot_mutex_, !persist_mutex_) {
   LOG(INFO) << "Populating APEX database from mounts...";
 
-  std::unordered_map<std::string, int> active_versions;
-
-  std::ifstream mounts("/proc/mounts");
-  std::string line;
-  std::lock_guard lock(mounted_apexes_mutex_);
-  while (std::getline(mounts, line)) {
-    auto [block, mount_point] = ParseMountInfo(line);
-    // TODO(b/158469914): distinguish between temp and non-temp mounts
-    if (fs::path(mount_point).parent_path() != kApexRoot) {
-      continue;
-    }
-    if (IsActiveMountPoint(mount_point)) {
-      continue;
+  const std::vector<ApexMount> mounts =
+      ReadApexMounts(proc_root + "/self/mountinfo");
+  std::vector<Result<MountedApexData>> results(mounts.size());
+  std::atomic<size_t> next_mount = 0;
+  auto worker = [&]() {
+    for (size_t i = next_mount++; i < mounts.size(); i = next_mount++) {
+      results[i] = ResolveApexMount(mounts[i], sys_root, active_apex_dir,
+                                    decompression_dir, apex_hash_tree_dir);
     }
+  };
+  size_t worker_num = std::min(mounts.size(), kMaxMountResolutionWorkers);
+  std::vector<std::future<void>> futures;
+  for (size_t i = 1; i < worker_num; i++) {
+    futures.push_back(std::async(std::launch::async, worker));
+  }
+  worker();
+  for (auto& future : futures) {
+    future.get();
+  }
 
-    auto mount_data =
-        ResolveMountInfo(BlockDevice(block), mount_point, active_apex_dir,
-                         decompression_dir, apex_hash_tree_dir);
-    if (!mount_data.ok()) {
-      LOG(WARNING) << "Can't resolve mount info " << mount_data.error();
-      continue;
-    }
+  std::unordered_map<std::string, int> active_versions;
+  size_t restored;
+  {
+    std::lock_guard lock(mounted_apexes_mutex_);
+    for (size_t i = 0; i < mounts.size(); i++) {
+      const std::string& mount_point = mounts[i].mount_point;
+      auto& mount_data = results[i];
+      if (!mount_data.ok()) {
+        LOG(WARNING) << "Can't resolve mount info " << mount_data.error();
+        continue;
+      }
 
-    auto [package, version] = ParseMountPoint(mount_point);
-    AddMountedApexLocked(package, false, *mount_data);
+      auto [package, version] = ParseMountPoint(mount_point);
+      AddMountedApexLocked(package, false, *mount_data);
 
-    auto active = active_versions[package] < version;
-    if (active) {
-      active_versions[package] = version;
-      SetLatestLocked(package, mount_data->full_path);
+      auto active = active_versions[package] < version;
+      if (active) {
+        active_versions[package] = version;
+        SetLatestLocked(package, mount_data->full_path);
+      }
+      LOG(INFO) << "Found " << mount_point << " backed by"
+                << (mount_data->deleted ? " deleted " : " ") << "file "
+                << mount_data->full_path;
     }
-    LOG(INFO) << "Found " << mount_point << " backed by"
-              << (mount_data->deleted ? " deleted " : " ") << "file "
-              << mount_data->full_path;
+    restored = mounted_apexes_.size();
+    PublishLocked();
   }
+  Persist();
 
-  LOG(INFO) << mounted_apexes_.size() << " packages restored.";
+  LOG(INFO) << restored << " packages restored.";
 }
 
 }  // namespace apex
@@ -18,22 +18,27 @@
 #define ANDROID_APEXD_APEX_DATABASE_H_
 
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
 
 #include <android-base/logging.h>
 #include <android-base/result.h>
 #include <android-base/thread_annotations.h>
 
+#include "apex_file.h"
+
 namespace android {
 namespace apex {
 
 class MountedApexDatabase {
  public:
-  // Stores associated low-level data for a mounted APEX. To conserve memory,
-  // the APEX file isn't stored, but must be opened to retrieve specific data.
+  // Stores associated low-level data for a mounted APEX, along with the APEX
+  // file it was mounted from when that is available, see |apex_file|.
   struct MountedApexData {
     std::string loop_name;  // Loop device used (fs path).
     std::string full_path;  // Full path to the apex file.
@@ -46,6 +51,10 @@ class MountedApexDatabase {
     bool deleted;
     // Whether the mount is a temp mount or not.
     bool is_temp_mount;
+    // The apex as it was opened when mounted, so that queries don't need to
+    // open it again. Null if it wasn't available, e.g. because it's deleted.
+    // Not part of the ordering.
+    std::shared_ptr<const ApexFile> apex_file;
 
     MountedApexData() {}
     MountedApexData(const std::string& loop_name, const std::string& full_path,
@@ -104,44 +113,58 @@ class MountedApexDatabase {
     auto check_it = it->second.emplace(
         MountedApexData(std::forward<Args>(args)...), latest);
     CHECK(check_it.second);
-
-    CheckAtMostOneLatest();
-    CheckUniqueLoopDm();
   }
 
   template <typename... Args>
   inline void AddMountedApex(const std::string& package, bool latest,
-                             Args&&... args) REQUIRES(!mounted_apexes_mutex_) {
-    std::lock_guard lock(mounted_apexes_mutex_);
-    AddMountedApexLocked(package, latest, args...);
+                             Args&&... args)
+      REQUIRES(!mounted_apexes_mutex_, !snapshot_mutex_, !persist_mutex_) {
+    {
+      std::lock_guard lock(mounted_apexes_mutex_);
+      AddMountedApexLocked(package, latest, args...);
+      PublishLocked();
+    }
+    Persist();
   }
 
   inline void RemoveMountedApex(const std::string& package,
                                 const std::string& full_path,
                                 bool match_temp_mounts = false)
-      REQUIRES(!mounted_apexes_mutex_) {
-    std::lock_guard lock(mounted_apexes_mutex_);
-    auto it = mounted_apexes_.find(package);
-    if (it == mounted_apexes_.end()) {
-      return;
-    }
+      REQUIRES(!mounted_apexes_mutex_, !snapshot_mutex_, !persist_mutex_) {
+    {
+      std::lock_guard lock(mounted_apexes_mutex_);
+      auto it = mounted_apexes_.find(package);
+      if (it == mounted_apexes_.end()) {
+        return;
+      }
 
-    auto& pkg_map = it->second;
+      auto& pkg_map = it->second;
 
-    for (auto pkg_it = pkg_map.begin(); pkg_it != pkg_map.end(); ++pkg_it) {
-      if (pkg_it->first.full_path == full_path &&
-          pkg_it->first.is_temp_mount == match_temp_mounts) {
-        pkg_map.erase(pkg_it);
+      auto pkg_it = pkg_map.begin();
+      for (; pkg_it != pkg_map.end(); ++pkg_it) {
+        if (pkg_it->first.full_path == full_path &&
+            pkg_it->first.is_temp_mount == match_temp_mounts) {
+          break;
+        }
+      }
+      if (pkg_it == pkg_map.end()) {
         return;
       }
+      pkg_map.erase(pkg_it);
+      PublishLocked();
     }
+    Persist();
   }
 
   inline void SetLatest(const std::string& package,
                         const std::string& full_path)
-      REQUIRES(!mounted_apexes_mutex_) {
-    std::lock_guard lock(mounted_apexes_mutex_);
-    SetLatestLocked(package, full_path);
+      REQUIRES(!mounted_apexes_mutex_, !snapshot_mutex_, !persist_mutex_) {
+    {
+      std::lock_guard lock(mounted_apexes_mutex_);
+      SetLatestLocked(package, full_path);
+      PublishLocked();
+    }
+    Persist();
   }
 
   inline void SetLatestLocked(const std::string& package,
@@ -168,13 +191,15 @@ class MountedApexDatabase {
     LOG(FATAL) << "Did not find " << package << " " << full_path;
   }
 
+  // Handlers run on a snapshot of the database taken when the call starts, so
+  // they may do I/O (or even modify the database) without blocking others.
   template <typename T>
   inline void ForallMountedApexes(const std::string& package, const T& handler,
                                   bool match_temp_mounts = false) const
-      REQUIRES(!mounted_apexes_mutex_) {
-    std::lock_guard lock(mounted_apexes_mutex_);
-    auto it = mounted_apexes_.find(package);
-    if (it == mounted_apexes_.end()) {
+      REQUIRES(!snapshot_mutex_) {
+    auto snapshot = GetSnapshot();
+    auto it = snapshot->mounted_apexes.find(package);
+    if (it == snapshot->mounted_apexes.end()) {
       return;
     }
     for (auto& pair : it->second) {
@@ -187,9 +212,9 @@ class MountedApexDatabase {
   template <typename T>
   inline void ForallMountedApexes(const T& handler,
                                   bool match_temp_mounts = false) const
-      REQUIRES(!mounted_apexes_mutex_) {
-    std::lock_guard lock(mounted_apexes_mutex_);
-    for (const auto& pkg : mounted_apexes_) {
+      REQUIRES(!snapshot_mutex_) {
+    auto snapshot = GetSnapshot();
+    for (const auto& pkg : snapshot->mounted_apexes) {
       for (const auto& pair : pkg.second) {
         if (pair.first.is_temp_mount == match_temp_mounts) {
           handler(pkg.first, pair.first, pair.second);
@@ -199,7 +224,7 @@ class MountedApexDatabase {
   }
 
   inline std::optional<MountedApexData> GetLatestMountedApex(
-      const std::string& package) REQUIRES(!mounted_apexes_mutex_) {
+      const std::string& package) REQUIRES(!snapshot_mutex_) {
     std::optional<MountedApexData> ret;
     ForallMountedApexes(package,
                         [&ret](const MountedApexData& data, bool latest) {
@@ -210,25 +235,72 @@ class MountedApexDatabase {
     return ret;
   }
 
+  // Returns whether |full_path| is mounted, ignoring temp mounts.
+  inline bool IsMounted(const std::string& full_path) const
+      REQUIRES(!snapshot_mutex_) {
+    return GetSnapshot()->mounted_paths.count(full_path) > 0;
+  }
+
+  // Returns the package using |device| as its loop device, hashtree loop
+  // device or dm device, if any.
+  inline std::optional<std::string> GetPackageByDevice(
+      const std::string& device) const REQUIRES(!snapshot_mutex_) {
+    auto snapshot = GetSnapshot();
+    auto it = snapshot->packages_by_device.find(device);
+    if (it == snapshot->packages_by_device.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  // Adds the apexes mounted under /apex, as listed in the mountinfo of
+  // |proc_root| and resolved through |sys_root|.
   void PopulateFromMounts(const std::string& active_apex_dir,
                           const std::string& decompression_dir,
-                          const std::string& apex_hash_tree_dir);
+                          const std::string& apex_hash_tree_dir,
+                          const std::string& proc_root = "/proc",
+                          const std::string& sys_root = "/sys");
+
+  // Writes the database to |path| now and from then on whenever it changes, so
+  // that it can be restored by LoadFromSnapshot if apexd restarts. What each
+  // apex is mounted from is taken from the mountinfo of |proc_root|. Writes
+  // happen after the change is published, so they don't block other writers.
+  void PersistTo(const std::string& path,
+                 const std::string& proc_root = "/proc")
+      REQUIRES(!mounted_apexes_mutex_, !snapshot_mutex_, !persist_mutex_);
+
+  // Restores the database persisted at |path|, provided that the apexes it
+  // lists are exactly those mounted according to the mountinfo of |proc_root|,
+  // from the same sources and devices.
+  android::base::Result<void> LoadFromSnapshot(
+      const std::string& path, const std::string& proc_root = "/proc")
+      REQUIRES(!mounted_apexes_mutex_, !snapshot_mutex_, !persist_mutex_);
 
   // Resets state of the database. Should only be used in testing.
-  inline void Reset() REQUIRES(!mounted_apexes_mutex_) {
-    std::lock_guard lock(mounted_apexes_mutex_);
-    mounted_apexes_.clear();
+  inline void Reset()
+      REQUIRES(!mounted_apexes_mutex_, !snapshot_mutex_, !persist_mutex_) {
+    {
+      std::lock_guard lock(mounted_apexes_mutex_);
+      mounted_apexes_.clear();
+      PublishLocked();
+    }
+    Persist();
   }
 
  private:
-  // A map from package name to mounted apexes.
-  // Note: using std::maps to
-  //         a) so we do not have to worry about iterator invalidation.
-  //         b) do not have to const_cast (over std::set)
-  // TODO(b/158467745): This structure (and functions) need to be guarded by
-  //   locks.
-  std::map<std::string, std::map<MountedApexData, bool>> mounted_apexes_
-      GUARDED_BY(mounted_apexes_mutex_);
+  using PackageMap = std::map<std::string, std::map<MountedApexData, bool>>;
+
+  // Immutable view of the database handed out to readers.
+  struct Snapshot {
+    // Incremented with every publish, so that persisting can skip snapshots
+    // that were already written or superseded.
+    uint64_t generation = 0;
+    PackageMap mounted_apexes;
+    // Full paths of all mounted apexes, excluding temp mounts.
+    std::unordered_set<std::string> mounted_paths;
+    // A map from loop and dm device names to the package using them.
+    std::unordered_map<std::string, std::string> packages_by_device;
+  };
 
   // To fix thread safety negative capability warning
   class Mutex : public std::mutex {
@@ -236,10 +308,64 @@ class MountedApexDatabase {
     // for negative capabilities
     const Mutex& operator!() const { return *this; }
   };
+
+  // A map from package name to mounted apexes.
+  // Note: using std::maps to
+  //         a) so we do not have to worry about iterator invalidation.
+  //         b) do not have to const_cast (over std::set)
+  // This is the copy modified by writers, which is serialized by
+  // |mounted_apexes_mutex_| and becomes visible to readers once published.
+  PackageMap mounted_apexes_ GUARDED_BY(mounted_apexes_mutex_);
   mutable Mutex mounted_apexes_mutex_;
+  uint64_t generation_ GUARDED_BY(mounted_apexes_mutex_) = 0;
 
-  inline void CheckAtMostOneLatest() REQUIRES(mounted_apexes_mutex_) {
-    for (const auto& apex_set : mounted_apexes_) {
+  // Where published snapshots are persisted, if anywhere. |persist_mutex_|
+  // serializes the writes, and is never held with |mounted_apexes_mutex_|.
+  std::string persist_path_ GUARDED_BY(persist_mutex_);
+  std::string persist_proc_root_ GUARDED_BY(persist_mutex_);
+  std::optional<uint64_t> persisted_generation_ GUARDED_BY(persist_mutex_);
+  mutable Mutex persist_mutex_;
+
+  // The latest published snapshot. |snapshot_mutex_| is only held to copy or
+  // swap the pointer, never while reading or building a snapshot.
+  std::shared_ptr<const Snapshot> snapshot_ GUARDED_BY(snapshot_mutex_) =
+      std::make_shared<const Snapshot>();
+  mutable Mutex snapshot_mutex_;
+
+  inline std::shared_ptr<const Snapshot> GetSnapshot() const
+      REQUIRES(!snapshot_mutex_) {
+    std::lock_guard lock(snapshot_mutex_);
+    return snapshot_;
+  }
+
+  // Makes the current state of |mounted_apexes_| visible to readers.
+  inline void PublishLocked()
+      REQUIRES(mounted_apexes_mutex_, !snapshot_mutex_) {
+    auto snapshot = std::make_shared<Snapshot>();
+    snapshot->generation = ++generation_;
+    snapshot->mounted_apexes = mounted_apexes_;
+    CheckAtMostOneLatest(snapshot->mounted_apexes);
+    IndexSnapshot(*snapshot);
+
+    std::shared_ptr<const Snapshot> old_snapshot;
+    {
+      std::lock_guard lock(snapshot_mutex_);
+      old_snapshot = std::exchange(snapshot_, std::move(snapshot));
+    }
+    // |old_snapshot| is released here, outside of |snapshot_mutex_|.
+  }
+
+  // Writes the latest published snapshot to |persist_path_|, unless it was
+  // written already. Called once |mounted_apexes_mutex_| is released.
+  void Persist()
+      REQUIRES(!mounted_apexes_mutex_, !snapshot_mutex_, !persist_mutex_);
+
+  static android::base::Result<void> WriteSnapshot(
+      const Snapshot& snapshot, const std::string& path,
+      const std::string& proc_root);
+
+  static inline void CheckAtMostOneLatest(const PackageMap& mounted_apexes) {
+    for (const auto& apex_set : mounted_apexes) {
       size_t count = 0;
       for (const auto& pair : apex_set.second) {
         if (pair.second) {
@@ -250,21 +376,31 @@ class MountedApexDatabase {
     }
   }
 
-  inline void CheckUniqueLoopDm() REQUIRES(mounted_apexes_mutex_) {
-    std::unordered_set<std::string> loop_devices;
+  // Fills in the indices of |snapshot|, checking that no loop or dm device is
+  // used twice.
+  static inline void IndexSnapshot(Snapshot& snapshot) {
     std::unordered_set<std::string> dm_devices;
-    for (const auto& apex_set : mounted_apexes_) {
+    for (const auto& apex_set : snapshot.mounted_apexes) {
       for (const auto& pair : apex_set.second) {
+        if (!pair.first.is_temp_mount) {
+          snapshot.mounted_paths.insert(pair.first.full_path);
+        }
         if (pair.first.loop_name != "") {
-          CHECK(loop_devices.insert(pair.first.loop_name).second)
+          CHECK(snapshot.packages_by_device
+                    .emplace(pair.first.loop_name, apex_set.first)
+                    .second)
               << "Duplicate loop device: " << pair.first.loop_name;
         }
         if (pair.first.device_name != "") {
           CHECK(dm_devices.insert(pair.first.device_name).second)
               << "Duplicate dm device: " << pair.first.device_name;
+          snapshot.packages_by_device.emplace(pair.first.device_name,
+                                              apex_set.first);
         }
         if (pair.first.hashtree_loop_name != "") {
-          CHECK(loop_devices.insert(pair.first.hashtree_loop_name).second)
+          CHECK(snapshot.packages_by_device
+                    .emplace(pair.first.hashtree_loop_name, apex_set.first)
+                    .second)
               << "Duplicate loop device: " << pair.first.hashtree_loop_name;
         }
       }
@@ -14,10 +14,14 @@
  * limitations under the License.
  */
 
+#include <filesystem>
+#include <optional>
 #include <string>
 #include <tuple>
 
+#include <android-base/file.h>
 #include <android-base/macros.h>
+#include <android-base/stringprintf.h>
 #include <gtest/gtest.h>
 
 #include "apex_database.h"
@@ -26,6 +30,10 @@ namespace android {
 namespace apex {
 namespace {
 
+namespace fs = std::filesystem;
+
+using android::base::StringPrintf;
+using android::base::WriteStringToFile;
 using MountedApexData = MountedApexDatabase::MountedApexData;
 
 TEST(MountedApexDataTest, LinearOrder) {
@@ -232,6 +240,163 @@ TEST(ApexDatabaseTest, GetLatestMountedApexReturnsNullopt) {
   ASSERT_FALSE(ret.has_value());
 }
 
+TEST(ApexDatabaseTest, IsMounted) {
+  MountedApexDatabase db;
+  db.AddMountedApex("package", true, "loop", "path", "mount", "dm",
+                    "hash-loop");
+  db.AddMountedApex("package", false, "loop2", "temp-path", "mount.tmp", "dm2",
+                    "hash-loop2", /* is_temp_mount= */ true);
+
+  ASSERT_TRUE(db.IsMounted("path"));
+  // Temp mounts are not taken into account.
+  ASSERT_FALSE(db.IsMounted("temp-path"));
+  ASSERT_FALSE(db.IsMounted("no-such-path"));
+
+  db.RemoveMountedApex("package", "path");
+  ASSERT_FALSE(db.IsMounted("path"));
+}
+
+TEST(ApexDatabaseTest, GetPackageByDevice) {
+  MountedApexDatabase db;
+  db.AddMountedApex("package", true, "loop", "path", "mount", "dm",
+                    "hash-loop");
+
+  ASSERT_EQ(db.GetPackageByDevice("loop"), "package");
+  ASSERT_EQ(db.GetPackageByDevice("dm"), "package");
+  ASSERT_EQ(db.GetPackageByDevice("hash-loop"), "package");
+  ASSERT_EQ(db.GetPackageByDevice("loop2"), std::nullopt);
+
+  db.RemoveMountedApex("package", "path");
+  ASSERT_EQ(db.GetPackageByDevice("loop"), std::nullopt);
+}
+
+TEST(ApexDatabaseTest, ForallMountedApexesIteratesOverSnapshot) {
+  MountedApexDatabase db;
+  db.AddMountedApex("package", true, "loop", "path", "mount", "dm", "");
+  db.AddMountedApex("package2", true, "loop2", "path2", "mount2", "dm2", "");
+
+  // The database can be modified from a handler, which keeps on seeing the
+  // state from before the modification.
+  size_t count = 0;
+  db.ForallMountedApexes([&](const std::string& package,
+                             const MountedApexData& data,
+                             bool latest ATTRIBUTE_UNUSED) {
+    db.RemoveMountedApex(package, data.full_path);
+    ++count;
+  });
+  ASSERT_EQ(count, 2u);
+  ASSERT_EQ(CountPackages(db), 0u);
+}
+
+TEST(ApexDatabaseTest, PopulateFromMounts) {
+  constexpr size_t kLoopMountCount = 1000;
+  const std::string kActiveDir = "/data/apex/active";
+  TemporaryDir proc_root;
+  TemporaryDir sys_root;
+  auto write_file = [](const fs::path& path, const std::string& content) {
+    fs::create_directories(path.parent_path());
+    ASSERT_TRUE(WriteStringToFile(content, path));
+  };
+
+  std::string mountinfo =
+      "20 1 254:3 / / ro,relatime shared:1 - ext4 /dev/block/dm-3 ro\n";
+  for (size_t i = 0; i < kLoopMountCount; i++) {
+    std::string package = StringPrintf("com.android.apex.test%zu", i);
+    mountinfo += StringPrintf(
+        "%zu 20 7:%zu / /apex/%s@1 ro,nodev - ext4 /dev/block/loop%zu ro\n",
+        100 + 2 * i, i, package.c_str(), i);
+    // Bind mounts of the active version are skipped.
+    mountinfo += StringPrintf(
+        "%zu 20 7:%zu / /apex/%s ro,nodev - ext4 /dev/block/loop%zu ro\n",
+        101 + 2 * i, i, package.c_str(), i);
+    write_file(fs::path(sys_root.path) / StringPrintf("dev/block/7:%zu", i) /
+                   "loop/backing_file",
+               kActiveDir + "/" + package + "@1.apex\n");
+  }
+  // A dm-verity device on top of a loop device, whose backing file has been
+  // deleted.
+  mountinfo +=
+      "5000 20 253:0 / /apex/com.android.apex.verity@2 ro - ext4 "
+      "/dev/block/dm-0 ro\n";
+  fs::path dm_path = fs::path(sys_root.path) / "dev/block/253:0";
+  write_file(dm_path / "dm/name", "com.android.apex.verity@2\n");
+  write_file(dm_path / "slaves/loop5000/loop/backing_file",
+             kActiveDir + "/com.android.apex.verity@2.apex (deleted)\n");
+  write_file(fs::path(proc_root.path) / "self/mountinfo", mountinfo);
+
+  MountedApexDatabase db;
+  db.PopulateFromMounts(kActiveDir, "/data/apex/decompressed",
+                        "/data/apex/hashtree", proc_root.path, sys_root.path);
+
+  ASSERT_EQ(CountPackages(db), kLoopMountCount + 1);
+  ASSERT_TRUE(ContainsPackage(db, "com.android.apex.test42",
+                              "/dev/block/loop42",
+                              kActiveDir + "/com.android.apex.test42@1.apex",
+                              /* dm= */ "", /* hashtree_loop_name= */ ""));
+  ASSERT_TRUE(ContainsPackage(db, "com.android.apex.verity",
+                              "/dev/block/loop5000",
+                              kActiveDir + "/com.android.apex.verity@2.apex",
+                              "com.android.apex.verity@2",
+                              /* hashtree_loop_name= */ ""));
+  auto latest = db.GetLatestMountedApex("com.android.apex.verity");
+  ASSERT_TRUE(latest.has_value());
+  ASSERT_TRUE(latest->deleted);
+}
+
+TEST(ApexDatabaseTest, LoadFromSnapshot) {
+  TemporaryDir td;
+  TemporaryDir proc_root;
+  std::string snapshot_path = std::string(td.path) + "/snapshot.pb";
+  std::string mountinfo =
+      "20 1 7:0 / /apex/package@1 ro - ext4 /dev/block/dm-0 ro\n"
+      "21 1 7:1 / /apex/package@2 ro - ext4 /dev/block/dm-1 ro\n"
+      "22 1 0:30 / /apex/package2@1 ro - erofs path3 ro\n";
+  std::string mountinfo_path = std::string(proc_root.path) + "/self/mountinfo";
+  fs::create_directories(fs::path(mountinfo_path).parent_path());
+  ASSERT_TRUE(WriteStringToFile(mountinfo, mountinfo_path));
+  {
+    MountedApexDatabase db;
+    // Both what is mounted before persisting and the changes after are kept.
+    db.AddMountedApex("package", false, "loop", "path", "/apex/package@1", "dm",
+                      "hash-loop");
+    db.PersistTo(snapshot_path, proc_root.path);
+    db.AddMountedApex("package", true, "loop2", "path2", "/apex/package@2",
+                      "dm2", "");
+    db.AddMountedApex("package2", true, "", "path3", "/apex/package2@1", "",
+                      "");
+  }
+
+  MountedApexDatabase db;
+  ASSERT_TRUE(db.LoadFromSnapshot(snapshot_path, proc_root.path).ok());
+  ASSERT_EQ(CountPackages(db), 3u);
+  ASSERT_TRUE(Contains(db, "package", "loop", "path", "/apex/package@1", "dm",
+                       "hash-loop"));
+  ASSERT_TRUE(Contains(db, "package2", "", "path3", "/apex/package2@1", "",
+                       ""));
+  auto latest = db.GetLatestMountedApex("package");
+  ASSERT_TRUE(latest.has_value());
+  ASSERT_EQ(latest->full_path, "path2");
+
+  // Snapshots are ignored once a mount point is remounted from another device.
+  ASSERT_TRUE(WriteStringToFile(
+      "20 1 7:0 / /apex/package@1 ro - ext4 /dev/block/dm-0 ro\n"
+      "21 1 7:2 / /apex/package@2 ro - ext4 /dev/block/dm-2 ro\n"
+      "22 1 0:30 / /apex/package2@1 ro - erofs path3 ro\n",
+      mountinfo_path));
+  MountedApexDatabase remounted_db;
+  ASSERT_FALSE(
+      remounted_db.LoadFromSnapshot(snapshot_path, proc_root.path).ok());
+  ASSERT_EQ(CountPackages(remounted_db), 0u);
+
+  // Or once mounts have changed.
+  ASSERT_TRUE(WriteStringToFile(
+      "20 1 7:0 / /apex/package@1 ro - ext4 /dev/block/dm-0 ro\n",
+      mountinfo_path));
+  MountedApexDatabase stale_db;
+  ASSERT_FALSE(stale_db.LoadFromSnapshot(snapshot_path, proc_root.path).ok());
+  ASSERT_EQ(CountPackages(stale_db), 0u);
+}
+
 #pragma clang diagnostic push
 // error: 'ReturnSentinel' was marked unused but was used
 // [-Werror,-Wused-but-marked-unused]
@@ -17,21 +17,36 @@
 #include "apex_file.h"
 
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <filesystem>
 #include <fstream>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
 #include <span>
+#include <unordered_map>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/scopeguard.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <libavb/libavb.h>
+#include <openssl/sha.h>
 #include <ziparchive/zip_archive.h>
+#include <zstd.h>
 
 #include "apex_constants.h"
 #include "apexd_utils.h"
@@ -44,6 +59,7 @@ using android::base::RemoveFileIfExists;
 using android::base::Result;
 using android::base::unique_fd;
 using ::apex::proto::ApexManifest;
+using ::apex::proto::MountDatabaseSnapshot;
 
 namespace android {
 namespace apex {
@@ -51,7 +67,13 @@ namespace {
 
 constexpr const char* kImageFilename = "apex_payload.img";
 constexpr const char* kCompressedApexFilename = "original_apex";
+// original_apex compressed with zstd, stored in the zip without compression.
+constexpr const char* kCompressedApexZstdFilename = "original_apex.zst";
 constexpr const char* kBundledPublicKeyFilename = "apex_pubkey";
+// ZSTD_FRAMEHEADERSIZE_MAX, which zstd.h only exposes for static linking.
+constexpr size_t kZstdFrameHeaderSizeMax = 18;
+// Upper bound on the threads decompressing the chunks of a single CAPEX.
+constexpr size_t kMaxChunkDecompressionWorkers = 4;
 
 struct FsMagic {
   const char* type;
@@ -60,7 +82,8 @@ struct FsMagic {
   const char* magic;
 };
 constexpr const FsMagic kFsType[] = {{"f2fs", 1024, 4, "\x10\x20\xf5\xf2"},
-                                     {"ext4", 1024 + 0x38, 2, "\123\357"}};
+                                     {"ext4", 1024 + 0x38, 2, "\123\357"},
+                                     {"erofs", 1024, 4, "\xe2\xe1\xf5\xe0"}};
 
 Result<std::string> RetrieveFsType(borrowed_fd fd, int32_t image_offset) {
   for (const auto& fs : kFsType) {
@@ -100,11 +123,9 @@ Result<ApexFile> ApexFile::Open(const std::string& path) {
                    << ErrorCodeString(ret);
   }
 
-  bool is_compressed = true;
-  ret = FindEntry(handle, kCompressedApexFilename, &entry);
-  if (ret < 0) {
-    is_compressed = false;
-  }
+  bool is_compressed =
+      FindEntry(handle, kCompressedApexFilename, &entry) >= 0 ||
+      FindEntry(handle, kCompressedApexZstdFilename, &entry) >= 0;
 
   if (!is_compressed) {
     // Locate the mountable image within the zipfile and store offset and size.
@@ -206,6 +227,161 @@ std::string GetDigest(const AvbHashtreeDescriptor& desc,
   return BytesToHex(desc_digest, desc.root_digest_len);
 }
 
+constexpr size_t kHashBlockSize = 4096;
+
+// A verity hashtree, laid out the way dm-verity reads it: from the top level
+// down to the level holding the digests of the data blocks.
+struct PayloadHashTree {
+  std::string root_digest;
+  std::vector<uint8_t> tree;
+};
+
+// Hashes kHashBlockSize blocks of decompressed data with a salted SHA-256, the
+// same way avbtool hashes the first level of a verity hashtree. Once the
+// payload offset is known, the hashtree of the payload can be built from these
+// hashes, without reading the output back.
+class PayloadHasher {
+ public:
+  explicit PayloadHasher(std::vector<uint8_t> salt) : salt_(std::move(salt)) {}
+
+  // Makes room for the digests of |block_count| blocks. Once reserved,
+  // disjoint ranges of blocks can be hashed concurrently.
+  void Reserve(uint64_t block_count) {
+    digests_.resize(block_count * SHA256_DIGEST_LENGTH);
+  }
+
+  // Hashes the |block_count| full blocks at |data|, the first of which is
+  // block |first_block| of the output.
+  void HashBlocks(uint64_t first_block, const uint8_t* data,
+                  uint64_t block_count) {
+    if ((first_block + block_count) * SHA256_DIGEST_LENGTH > digests_.size()) {
+      Reserve(first_block + block_count);
+    }
+    for (uint64_t i = 0; i < block_count; i++) {
+      Digest(data + i * kHashBlockSize,
+             &digests_[(first_block + i) * SHA256_DIGEST_LENGTH]);
+    }
+  }
+
+  // Returns the hashtree of the |image_size| bytes at |image_offset| of the
+  // hashed data, along with its hex encoded root digest.
+  Result<PayloadHashTree> BuildHashTree(uint64_t image_offset,
+                                        uint64_t image_size) const {
+    if (image_offset % kHashBlockSize != 0 ||
+        image_size % kHashBlockSize != 0) {
+      return Error() << "Payload is not aligned to " << kHashBlockSize;
+    }
+    uint64_t first_block = image_offset / kHashBlockSize;
+    uint64_t block_count = image_size / kHashBlockSize;
+    if (block_count <= 1 ||
+        (first_block + block_count) * SHA256_DIGEST_LENGTH > digests_.size()) {
+      return Error() << "Unexpected payload size " << image_size;
+    }
+    std::vector<uint8_t> level(
+        digests_.begin() + first_block * SHA256_DIGEST_LENGTH,
+        digests_.begin() + (first_block + block_count) * SHA256_DIGEST_LENGTH);
+    PadToBlockSize(&level);
+    std::vector<std::vector<uint8_t>> levels;
+    levels.push_back(std::move(level));
+    while (levels.back().size() > kHashBlockSize) {
+      const std::vector<uint8_t>& prev_level = levels.back();
+      std::vector<uint8_t> next_level(prev_level.size() / kHashBlockSize *
+                                      SHA256_DIGEST_LENGTH);
+      for (size_t i = 0; i < prev_level.size() / kHashBlockSize; i++) {
+        Digest(&prev_level[i * kHashBlockSize],
+               &next_level[i * SHA256_DIGEST_LENGTH]);
+      }
+      PadToBlockSize(&next_level);
+      levels.push_back(std::move(next_level));
+    }
+    uint8_t root_digest[SHA256_DIGEST_LENGTH];
+    Digest(levels.back().data(), root_digest);
+
+    PayloadHashTree result;
+    result.root_digest = BytesToHex(root_digest, sizeof(root_digest));
+    for (auto it = levels.rbegin(); it != levels.rend(); ++it) {
+      result.tree.insert(result.tree.end(), it->begin(), it->end());
+    }
+    return result;
+  }
+
+ private:
+  // Stores the salted digest of the kHashBlockSize bytes at |block| in |out|.
+  void Digest(const uint8_t* block, uint8_t* out) const {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, salt_.data(), salt_.size());
+    SHA256_Update(&ctx, block, kHashBlockSize);
+    SHA256_Final(out, &ctx);
+  }
+
+  static void PadToBlockSize(std::vector<uint8_t>* level) {
+    size_t remainder = level->size() % kHashBlockSize;
+    if (remainder != 0) {
+      level->resize(level->size() + kHashBlockSize - remainder, 0);
+    }
+  }
+
+  std::vector<uint8_t> salt_;
+  // Digests of the hashed blocks, indexed by block.
+  std::vector<uint8_t> digests_;
+};
+
+// Writes decompressed data sequentially to a file, passing every complete
+// block to |hasher| if one is given.
+class DecompressionSink {
+ public:
+  DecompressionSink(borrowed_fd fd, PayloadHasher* hasher)
+      : fd_(fd), hasher_(hasher) {
+    if (hasher_ != nullptr) {
+      block_.reserve(kHashBlockSize);
+    }
+  }
+
+  static bool Write(const uint8_t* buf, size_t buf_size, void* cookie) {
+    return static_cast<DecompressionSink*>(cookie)->Append(buf, buf_size);
+  }
+
+  // Truncates the file to the written data, in case it was preallocated.
+  Result<void> Finish() {
+    if (ftruncate(fd_.get(), size_) != 0) {
+      return ErrnoError() << "Failed to truncate decompressed APEX";
+    }
+    return {};
+  }
+
+ private:
+  bool Append(const uint8_t* buf, size_t buf_size) {
+    if (!android::base::WriteFully(fd_, buf, buf_size)) {
+      return false;
+    }
+    size_ += buf_size;
+    if (hasher_ == nullptr) {
+      return true;
+    }
+    while (buf_size > 0) {
+      size_t to_copy = std::min(buf_size, kHashBlockSize - block_.size());
+      block_.insert(block_.end(), buf, buf + to_copy);
+      buf += to_copy;
+      buf_size -= to_copy;
+      if (block_.size() == kHashBlockSize) {
+        hasher_->HashBlocks(next_block_++, block_.data(), 1);
+        block_.clear();
+      }
+    }
+    return true;
+  }
+
+  borrowed_fd fd_;
+  PayloadHasher* hasher_;
+  // Data of the block currently being written.
+  std::vector<uint8_t> block_;
+  // Index of the block currently being written.
+  uint64_t next_block_ = 0;
+  // Number of bytes written so far.
+  uint64_t size_ = 0;
+};
+
 Result<std::unique_ptr<AvbFooter>> GetAvbFooter(const ApexFile& apex,
                                                 const unique_fd& fd) {
   std::array<uint8_t, AVB_FOOTER_SIZE> footer_data;
@@ -401,7 +577,485 @@ Result<ApexVerityData> ApexFile::VerifyApexVerity(
   return verity_data;
 }
 
-Result<void> ApexFile::Decompress(const std::string& dest_path) const {
+namespace {
+
+// Checks that the payload of the decompressed APEX at |path|, hashed by
+// |hasher| while it was written, matches |expected_root_digest|. If
+// |hashtree_path| is given and the APEX doesn't embed its hashtree, the
+// hashtree is written there, where it is picked up when the APEX is mounted.
+Result<void> VerifyDecompressedPayload(const std::string& path,
+                                       const PayloadHasher& hasher,
+                                       const std::string& expected_salt,
+                                       const std::string& expected_root_digest,
+                                       const std::string& hashtree_path) {
+  auto apex = ApexFile::Open(path);
+  if (!apex.ok()) {
+    return apex.error();
+  }
+  auto verity_data = apex->VerifyApexVerity(apex->GetBundledPublicKey());
+  if (!verity_data.ok()) {
+    return verity_data.error();
+  }
+  const AvbHashtreeDescriptor& desc = *verity_data->desc;
+  if (verity_data->hash_algorithm != "sha256" ||
+      desc.data_block_size != kHashBlockSize ||
+      desc.hash_block_size != kHashBlockSize ||
+      verity_data->salt != expected_salt) {
+    return Error() << "Hashtree parameters of " << path
+                   << " don't match the CAPEX metadata";
+  }
+  auto hash_tree =
+      hasher.BuildHashTree(*apex->GetImageOffset(), desc.image_size);
+  if (!hash_tree.ok()) {
+    return Error() << "Can't calculate root digest of " << path << ": "
+                   << hash_tree.error();
+  }
+  if (hash_tree->root_digest != expected_root_digest) {
+    return Error() << "Root digest of decompressed payload "
+                   << hash_tree->root_digest << " does not match "
+                   << expected_root_digest;
+  }
+  if (hashtree_path.empty() || desc.tree_size != 0) {
+    return {};
+  }
+  // Written to a temporary file first, so that a partial hashtree is never
+  // found at |hashtree_path|.
+  if (auto st = CreateDirIfNeeded(android::base::Dirname(hashtree_path), 0700);
+      !st.ok()) {
+    return st.error();
+  }
+  const std::string tmp_path = hashtree_path + ".tmp";
+  unique_fd fd(open(tmp_path.c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << tmp_path;
+  }
+  auto tmp_guard = android::base::make_scope_guard(
+      [&tmp_path]() { RemoveFileIfExists(tmp_path); });
+  if (!android::base::WriteFully(fd, hash_tree->tree.data(),
+                                 hash_tree->tree.size()) ||
+      fsync(fd.get()) != 0) {
+    return ErrnoError() << "Failed to write " << tmp_path;
+  }
+  if (rename(tmp_path.c_str(), hashtree_path.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << tmp_path << " to "
+                        << hashtree_path;
+  }
+  tmp_guard.Disable();
+  return {};
+}
+
+// Decompresses the zstd frame stored uncompressed in |entry| of the zip opened
+// on |src_fd| into |sink|.
+Result<void> DecompressZstdEntry(borrowed_fd src_fd, const ZipEntry& entry,
+                                 DecompressionSink* sink) {
+  if (entry.method != kCompressStored) {
+    return Error() << kCompressedApexZstdFilename << " must be stored";
+  }
+  std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(),
+                                                             ZSTD_freeDCtx);
+  if (dctx == nullptr) {
+    return Error() << "Failed to create zstd context";
+  }
+
+  std::vector<uint8_t> in_buf(ZSTD_DStreamInSize());
+  std::vector<uint8_t> out_buf(ZSTD_DStreamOutSize());
+  uint64_t offset = entry.offset;
+  uint64_t remaining = entry.compressed_length;
+  size_t last_ret = 0;
+  while (remaining > 0) {
+    size_t to_read = std::min<uint64_t>(remaining, in_buf.size());
+    if (!ReadFullyAtOffset(src_fd, in_buf.data(), to_read, offset)) {
+      return ErrnoError() << "Failed to read " << kCompressedApexZstdFilename;
+    }
+    offset += to_read;
+    remaining -= to_read;
+
+    ZSTD_inBuffer input = {in_buf.data(), to_read, 0};
+    while (input.pos < input.size) {
+      ZSTD_outBuffer output = {out_buf.data(), out_buf.size(), 0};
+      last_ret = ZSTD_decompressStream(dctx.get(), &output, &input);
+      if (ZSTD_isError(last_ret)) {
+        return Error() << "Failed to decompress "
+                       << kCompressedApexZstdFilename << ": "
+                       << ZSTD_getErrorName(last_ret);
+      }
+      if (!DecompressionSink::Write(out_buf.data(), output.pos, sink)) {
+        return ErrnoError() << "Failed to write decompressed data";
+      }
+    }
+  }
+  if (last_ret != 0) {
+    return Error() << kCompressedApexZstdFilename << " is truncated";
+  }
+  return {};
+}
+
+// An independently compressed zstd frame of a chunked CAPEX.
+struct ZstdChunk {
+  // Location of the frame in the CAPEX.
+  uint64_t offset;
+  uint64_t compressed_size;
+  // Location of the decompressed data in the original APEX.
+  uint64_t output_offset;
+  uint64_t size;
+  // SHA-256 of the decompressed data, empty if unknown.
+  std::string digest;
+};
+
+// Splits |entry| into the chunks listed in the chunk index of |metadata|.
+Result<std::vector<ZstdChunk>> GetZstdChunks(
+    borrowed_fd src_fd, const ZipEntry& entry,
+    const ApexManifest::CompressedApexMetadata& metadata) {
+  if (entry.method != kCompressStored) {
+    return Error() << kCompressedApexZstdFilename << " must be stored";
+  }
+  const uint64_t chunk_size = metadata.chunksize();
+  if (chunk_size == 0 || chunk_size % kHashBlockSize != 0) {
+    return Error() << "Chunk size " << chunk_size << " is not a multiple of "
+                   << kHashBlockSize;
+  }
+  std::vector<ZstdChunk> chunks;
+  uint64_t offset = entry.offset;
+  const uint64_t end = entry.offset + entry.compressed_length;
+  for (uint64_t compressed_size : metadata.chunkcompressedsizes()) {
+    if (compressed_size == 0 || compressed_size > end - offset) {
+      return Error() << "Chunk index doesn't match "
+                     << kCompressedApexZstdFilename;
+    }
+    chunks.push_back({.offset = offset,
+                      .compressed_size = compressed_size,
+                      .output_offset = chunks.size() * chunk_size,
+                      .size = chunk_size});
+    offset += compressed_size;
+  }
+  if (chunks.empty() || offset != end) {
+    return Error() << "Chunk index doesn't match "
+                   << kCompressedApexZstdFilename;
+  }
+  if (!metadata.chunkdigests().empty()) {
+    if (static_cast<size_t>(metadata.chunkdigests_size()) != chunks.size()) {
+      return Error() << "Chunk digests don't match the chunk index";
+    }
+    for (size_t i = 0; i < chunks.size(); i++) {
+      chunks[i].digest = metadata.chunkdigests(i);
+    }
+  }
+
+  // Only the last chunk can be shorter. Its size is in the frame header.
+  ZstdChunk& last = chunks.back();
+  uint8_t header[kZstdFrameHeaderSizeMax];
+  size_t header_size = std::min<uint64_t>(sizeof(header), last.compressed_size);
+  if (!ReadFullyAtOffset(src_fd, header, header_size, last.offset)) {
+    return ErrnoError() << "Failed to read " << kCompressedApexZstdFilename;
+  }
+  unsigned long long size = ZSTD_getFrameContentSize(header, header_size);
+  if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+      size == 0 || size > chunk_size) {
+    return Error() << "Invalid size of the last chunk of "
+                   << kCompressedApexZstdFilename;
+  }
+  last.size = size;
+  return chunks;
+}
+
+// Maps the SHA-256 digests of the |chunk_size| chunks of |base_fd| to their
+// offsets, so that chunks which didn't change can be reused.
+Result<std::unordered_map<std::string, uint64_t>> IndexBaseChunks(
+    borrowed_fd base_fd, uint64_t chunk_size) {
+  struct stat st;
+  if (fstat(base_fd.get(), &st) != 0) {
+    return ErrnoError() << "Failed to stat";
+  }
+  std::unordered_map<std::string, uint64_t> index;
+  std::vector<uint8_t> buf(chunk_size);
+  for (uint64_t offset = 0; offset + chunk_size <= (uint64_t)st.st_size;
+       offset += chunk_size) {
+    if (!ReadFullyAtOffset(base_fd, buf.data(), chunk_size, offset)) {
+      return ErrnoError() << "Failed to read";
+    }
+    std::string digest(SHA256_DIGEST_LENGTH, '\0');
+    SHA256(buf.data(), chunk_size, reinterpret_cast<uint8_t*>(digest.data()));
+    index.emplace(std::move(digest), offset);
+  }
+  return index;
+}
+
+// Returns whether the decompressed data of |chunk| at |data| has the expected
+// digest.
+bool ChunkDigestMatches(const ZstdChunk& chunk, const uint8_t* data) {
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(data, chunk.size, digest);
+  return chunk.digest.size() == sizeof(digest) &&
+         memcmp(chunk.digest.data(), digest, sizeof(digest)) == 0;
+}
+
+// Fills |chunk| of |dest_fd| with the data at |base_offset| of |base_fd|,
+// which is read into |buf|. The blocks are cloned if the filesystem supports
+// it, and written otherwise. Returns false if the data isn't the expected one.
+Result<bool> ReuseChunk(borrowed_fd base_fd, uint64_t base_offset,
+                        borrowed_fd dest_fd, const ZstdChunk& chunk,
+                        std::vector<uint8_t>* buf) {
+  if (!ReadFullyAtOffset(base_fd, buf->data(), chunk.size, base_offset)) {
+    return ErrnoError() << "Failed to read base APEX";
+  }
+  if (!ChunkDigestMatches(chunk, buf->data())) {
+    return false;
+  }
+  struct file_clone_range range = {.src_fd = base_fd.get(),
+                                   .src_offset = base_offset,
+                                   .src_length = chunk.size,
+                                   .dest_offset = chunk.output_offset};
+  if (ioctl(dest_fd.get(), FICLONERANGE, &range) == 0) {
+    return true;
+  }
+  // The data is at hand already, so write it rather than letting
+  // copy_file_range read it again.
+  if (!android::base::WriteFullyAtOffset(dest_fd, buf->data(), chunk.size,
+                                         chunk.output_offset)) {
+    return ErrnoError() << "Failed to write reused chunk";
+  }
+  return true;
+}
+
+// Returns which of |chunk_count| chunks are recorded as complete in the
+// progress file |path|, provided that it was written for |progress_id|. Only
+// lines terminated by a newline are trusted, since the last one might have
+// been cut short by a crash.
+std::vector<bool> ReadChunkProgress(const std::string& path,
+                                    const std::string& progress_id,
+                                    size_t chunk_count) {
+  std::vector<bool> done(chunk_count, false);
+  std::string content;
+  if (!android::base::ReadFileToString(path, &content)) {
+    return done;
+  }
+  auto lines = android::base::Split(content, "\n");
+  if (lines.size() < 2 || lines[0] != progress_id) {
+    return done;
+  }
+  for (size_t i = 1; i < lines.size() - 1; i++) {
+    size_t index;
+    if (android::base::ParseUint(lines[i], &index) && index < chunk_count) {
+      done[index] = true;
+    }
+  }
+  return done;
+}
+
+// Decompresses |chunks| read from |src_fd| to |dest_path| on a pool of
+// workers, each writing its chunks at their final offset. The data is staged
+// in a ".partial" file and every chunk that reaches the disk is recorded in a
+// ".progress" file, so that a decompression interrupted by a crash resumes
+// from the completed chunks. |dest_path| must exist, and becomes the
+// ".partial" file unless a decompression is resumed. |progress_id| identifies
+// the CAPEX layout the progress belongs to. Completed chunks are read back and
+// checked against their digest, and are decompressed again if they don't match.
+// Without chunk digests they are only trusted if |hasher| is given, which
+// checks the whole payload afterwards. Chunks found in |base_fd|, if it is
+// valid, are taken from there instead of being decompressed. Blocks are passed
+// to |hasher| if one is given.
+Result<void> DecompressZstdChunks(borrowed_fd src_fd,
+                                  const std::vector<ZstdChunk>& chunks,
+                                  const std::string& progress_id,
+                                  const std::string& dest_path,
+                                  borrowed_fd base_fd, PayloadHasher* hasher) {
+  const std::string partial_path = dest_path + ".partial";
+  const std::string progress_path = dest_path + ".progress";
+
+  std::vector<bool> done(chunks.size(), false);
+  const bool can_check_done = hasher != nullptr || !chunks[0].digest.empty();
+  if (can_check_done && access(partial_path.c_str(), F_OK) == 0) {
+    done = ReadChunkProgress(progress_path, progress_id, chunks.size());
+  }
+  const size_t done_count = std::count(done.begin(), done.end(), true);
+  const int trunc_flag = done_count > 0 ? 0 : O_TRUNC;
+  if (done_count > 0) {
+    LOG(INFO) << "Resuming decompression of " << dest_path << ": "
+              << done_count << " of " << chunks.size()
+              << " chunks already done";
+  } else {
+    // Starting over. Keep the blocks |dest_path| might have preallocated.
+    if (rename(dest_path.c_str(), partial_path.c_str()) != 0) {
+      return ErrnoError() << "Failed to rename " << dest_path << " to "
+                          << partial_path;
+    }
+  }
+
+  unique_fd partial_fd(open(partial_path.c_str(), O_RDWR | O_CLOEXEC));
+  if (partial_fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << partial_path;
+  }
+  unique_fd progress_fd(
+      open(progress_path.c_str(),
+           O_WRONLY | O_CLOEXEC | O_CREAT | O_APPEND | trunc_flag, 0644));
+  if (progress_fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << progress_path;
+  }
+  if (done_count == 0) {
+    if (!android::base::WriteStringToFd(progress_id + "\n", progress_fd) ||
+        fdatasync(progress_fd.get()) != 0) {
+      return ErrnoError() << "Failed to write " << progress_path;
+    }
+  }
+  const uint64_t total_size = chunks.back().output_offset + chunks.back().size;
+  if (ftruncate(partial_fd.get(), total_size) != 0) {
+    return ErrnoError() << "Failed to resize " << partial_path;
+  }
+  if (hasher != nullptr) {
+    hasher->Reserve(total_size / kHashBlockSize);
+  }
+
+  std::unordered_map<std::string, uint64_t> base_index;
+  if (base_fd.get() != -1 && !chunks[0].digest.empty()) {
+    auto index = IndexBaseChunks(base_fd, chunks[0].size);
+    if (index.ok()) {
+      base_index = std::move(*index);
+    } else {
+      LOG(WARNING) << "Can't reuse chunks of base APEX: " << index.error();
+    }
+  }
+  std::atomic<size_t> reused_count = 0;
+
+  std::queue<size_t> chunk_queue;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    chunk_queue.push(i);
+  }
+  std::mutex mutex;
+  auto decompress_chunks = [&]() -> Result<void> {
+    std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(),
+                                                               ZSTD_freeDCtx);
+    if (dctx == nullptr) {
+      return Error() << "Failed to create zstd context";
+    }
+    std::vector<uint8_t> in_buf;
+    std::vector<uint8_t> out_buf;
+    while (true) {
+      size_t index;
+      {
+        std::lock_guard lock(mutex);
+        if (chunk_queue.empty()) {
+          return {};
+        }
+        index = chunk_queue.front();
+        chunk_queue.pop();
+      }
+      const ZstdChunk& chunk = chunks[index];
+      out_buf.resize(chunk.size);
+      bool restored = false;
+      if (done[index]) {
+        if (!ReadFullyAtOffset(partial_fd, out_buf.data(), chunk.size,
+                               chunk.output_offset)) {
+          return ErrnoError() << "Failed to read " << partial_path;
+        }
+        restored =
+            chunk.digest.empty() || ChunkDigestMatches(chunk, out_buf.data());
+        if (!restored) {
+          LOG(WARNING) << "Chunk " << index << " of " << partial_path
+                       << " is corrupted; decompressing it again";
+        }
+      }
+      if (!restored) {
+        bool reused = false;
+        if (auto it = base_index.find(chunk.digest); it != base_index.end()) {
+          auto ret =
+              ReuseChunk(base_fd, it->second, partial_fd, chunk, &out_buf);
+          if (!ret.ok()) {
+            return ret.error();
+          }
+          reused = *ret;
+        }
+        if (reused) {
+          reused_count++;
+        } else {
+          in_buf.resize(chunk.compressed_size);
+          if (!ReadFullyAtOffset(src_fd, in_buf.data(), chunk.compressed_size,
+                                 chunk.offset)) {
+            return ErrnoError() << "Failed to read chunk " << index << " of "
+                                << kCompressedApexZstdFilename;
+          }
+          size_t ret =
+              ZSTD_decompressDCtx(dctx.get(), out_buf.data(), chunk.size,
+                                  in_buf.data(), chunk.compressed_size);
+          if (ZSTD_isError(ret)) {
+            return Error() << "Failed to decompress chunk " << index << ": "
+                           << ZSTD_getErrorName(ret);
+          }
+          if (ret != chunk.size) {
+            return Error() << "Chunk " << index << " decompressed to " << ret
+                           << " bytes instead of " << chunk.size;
+          }
+          if (!android::base::WriteFullyAtOffset(partial_fd, out_buf.data(),
+                                                 chunk.size,
+                                                 chunk.output_offset)) {
+            return ErrnoError() << "Failed to write " << partial_path;
+          }
+        }
+        if (fdatasync(partial_fd.get()) != 0) {
+          return ErrnoError() << "Failed to sync " << partial_path;
+        }
+        std::lock_guard lock(mutex);
+        if (!android::base::WriteStringToFd(std::to_string(index) + "\n",
+                                            progress_fd) ||
+            fdatasync(progress_fd.get()) != 0) {
+          return ErrnoError() << "Failed to write " << progress_path;
+        }
+      }
+      if (hasher != nullptr) {
+        hasher->HashBlocks(chunk.output_offset / kHashBlockSize,
+                           out_buf.data(), chunk.size / kHashBlockSize);
+      }
+    }
+  };
+  // Stops the other workers as soon as one of them fails.
+  auto worker = [&]() -> Result<void> {
+    auto ret = decompress_chunks();
+    if (!ret.ok()) {
+      std::lock_guard lock(mutex);
+      chunk_queue = {};
+    }
+    return ret;
+  };
+
+  size_t worker_num = std::max(get_nprocs_conf() >> 1, 1);
+  worker_num = std::min(
+      {chunks.size(), worker_num, kMaxChunkDecompressionWorkers});
+  std::vector<std::future<Result<void>>> futures;
+  for (size_t i = 0; i < worker_num; i++) {
+    futures.push_back(std::async(std::launch::async, worker));
+  }
+  Result<void> result;
+  for (auto& future : futures) {
+    if (auto ret = future.get(); !ret.ok() && result.ok()) {
+      result = ret.error();
+    }
+  }
+  if (!result.ok()) {
+    // Completed chunks are kept, so that the next attempt can resume.
+    return result;
+  }
+  if (reused_count > 0) {
+    LOG(INFO) << "Reused " << reused_count << " of " << chunks.size()
+              << " chunks for " << dest_path;
+  }
+
+  if (fsync(partial_fd.get()) != 0) {
+    return ErrnoError() << "Failed to sync " << partial_path;
+  }
+  if (rename(partial_path.c_str(), dest_path.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << partial_path << " to "
+                        << dest_path;
+  }
+  RemoveFileIfExists(progress_path);
+  return {};
+}
+
+}  // namespace
+
+Result<void> ApexFile::Decompress(const std::string& dest_path,
+                                  const std::string& reserved_path,
+                                  const std::string& base_path,
+                                  const std::string& hashtree_path) const {
   const std::string& src_path = GetPath();
 
   LOG(INFO) << "Decompressing" << src_path << " to " << dest_path;
@@ -429,9 +1083,15 @@ Result<void> ApexFile::Decompress(const std::string& dest_path) const {
 
   // Find the original apex file inside the zip and extract to dest
   ZipEntry entry;
+  bool is_zstd = false;
   ret = FindEntry(handle, kCompressedApexFilename, &entry);
+  if (ret < 0) {
+    is_zstd = true;
+    ret = FindEntry(handle, kCompressedApexZstdFilename, &entry);
+  }
   if (ret < 0) {
     return Error() << "Could not find entry \"" << kCompressedApexFilename
+                   << "\" or \"" << kCompressedApexZstdFilename
                    << "\" in package " << src_path << ": "
                    << ErrorCodeString(ret);
   }
@@ -448,11 +1108,90 @@ Result<void> ApexFile::Decompress(const std::string& dest_path) const {
   auto decompressed_guard = android::base::make_scope_guard(
       [&dest_path] { RemoveFileIfExists(dest_path); });
 
-  // Extract the original_apex to dest_path
-  ret = ExtractEntryToFile(handle, &entry, dest_fd.get());
-  if (ret < 0) {
-    return Error() << "Could not decompress to file " << dest_path << " "
-                   << ErrorCodeString(ret);
+  // Write into the blocks preallocated for the decompressed APEX, if any.
+  if (!reserved_path.empty()) {
+    if (rename(reserved_path.c_str(), dest_path.c_str()) != 0) {
+      return ErrnoError() << "Failed to move " << reserved_path << " to "
+                          << dest_path;
+    }
+    dest_fd.reset(open(dest_path.c_str(), O_WRONLY | O_CLOEXEC));
+    if (dest_fd.get() == -1) {
+      return ErrnoError() << "Failed to open decompression destination "
+                          << dest_path;
+    }
+  }
+
+  // Extract the original_apex to dest_path. If the CAPEX knows the salt of the
+  // original payload, hash it on the way so that the payload can be checked
+  // against the expected root digest, and its hashtree written, without
+  // reading it back.
+  const auto& capex_metadata = GetManifest().capexmetadata();
+  std::optional<PayloadHasher> hasher;
+  if (!capex_metadata.originalapexsalt().empty()) {
+    if (auto salt = HexToBin(capex_metadata.originalapexsalt()); salt.ok()) {
+      hasher.emplace(std::move(*salt));
+    }
+  }
+  const bool verify_payload = hasher.has_value();
+  DecompressionSink sink(dest_fd, verify_payload ? &*hasher : nullptr);
+  const bool is_chunked =
+      is_zstd && !capex_metadata.chunkcompressedsizes().empty();
+  if (is_chunked) {
+    auto chunks = GetZstdChunks(src_fd, entry, capex_metadata);
+    if (!chunks.ok()) {
+      return Error() << "Could not decompress to file " << dest_path << " "
+                     << chunks.error();
+    }
+    const std::string progress_id =
+        capex_metadata.originalapexdigest() + " " +
+        std::to_string(capex_metadata.chunksize());
+    unique_fd base_fd;
+    if (!base_path.empty()) {
+      base_fd.reset(open(base_path.c_str(), O_RDONLY | O_CLOEXEC));
+      if (base_fd.get() == -1) {
+        PLOG(WARNING) << "Can't reuse " << base_path;
+      }
+    }
+    if (auto st =
+            DecompressZstdChunks(src_fd, *chunks, progress_id, dest_path,
+                                 base_fd, verify_payload ? &*hasher : nullptr);
+        !st.ok()) {
+      return Error() << "Could not decompress to file " << dest_path << " "
+                     << st.error();
+    }
+  } else if (is_zstd) {
+    if (auto st = DecompressZstdEntry(src_fd, entry, &sink); !st.ok()) {
+      return Error() << "Could not decompress to file " << dest_path << " "
+                     << st.error();
+    }
+    if (auto st = sink.Finish(); !st.ok()) {
+      return st.error();
+    }
+  } else if (!verify_payload) {
+    // This also sizes the file to the entry, dropping any preallocated excess.
+    ret = ExtractEntryToFile(handle, &entry, dest_fd.get());
+    if (ret < 0) {
+      return Error() << "Could not decompress to file " << dest_path << " "
+                     << ErrorCodeString(ret);
+    }
+  } else {
+    ret = ProcessZipEntryContents(handle, &entry, DecompressionSink::Write,
+                                  &sink);
+    if (ret < 0) {
+      return Error() << "Could not decompress to file " << dest_path << " "
+                     << ErrorCodeString(ret);
+    }
+    if (auto st = sink.Finish(); !st.ok()) {
+      return st.error();
+    }
+  }
+  if (verify_payload) {
+    if (auto st = VerifyDecompressedPayload(
+            dest_path, *hasher, capex_metadata.originalapexsalt(),
+            capex_metadata.originalapexdigest(), hashtree_path);
+        !st.ok()) {
+      return Error() << "Failed to verify " << dest_path << ": " << st.error();
+    }
   }
 
   // Verification complete. Accept the decompressed file
@@ -462,5 +1201,36 @@ Result<void> ApexFile::Decompress(const std::string& dest_path) const {
   return {};
 }
 
+void ApexFileToProto(const ApexFile& apex,
+                     MountDatabaseSnapshot::ApexFileInfo* info) {
+  info->set_path(apex.GetPath());
+  info->set_image_offset(apex.GetImageOffset().value_or(0));
+  info->set_image_size(apex.GetImageSize().value_or(0));
+  info->set_manifest(apex.GetManifest().SerializeAsString());
+  info->set_public_key(apex.GetBundledPublicKey());
+  info->set_fs_type(apex.GetFsType().value_or(""));
+  info->set_is_compressed(apex.IsCompressed());
+}
+
+Result<ApexFile> ApexFileFromProto(
+    const MountDatabaseSnapshot::ApexFileInfo& info) {
+  ApexManifest manifest;
+  if (!manifest.ParseFromString(info.manifest())) {
+    return Error() << "Can't parse manifest of " << info.path();
+  }
+  // Compressed apexes don't have an image of their own.
+  std::optional<int32_t> image_offset;
+  std::optional<size_t> image_size;
+  std::optional<std::string> fs_type;
+  if (!info.is_compressed()) {
+    image_offset = info.image_offset();
+    image_size = info.image_size();
+    fs_type = info.fs_type();
+  }
+  return ApexFile::FromParts(info.path(), image_offset, image_size,
+                             std::move(manifest), info.public_key(), fs_type,
+                             info.is_compressed());
+}
+
 }  // namespace apex
 }  // namespace android
@@ -25,6 +25,7 @@
 #include <libavb/libavb.h>
 
 #include "apex_manifest.h"
+#include "mount_database.pb.h"
 
 namespace android {
 namespace apex {
@@ -42,7 +43,21 @@ struct ApexVerityData {
 class ApexFile {
  public:
   static android::base::Result<ApexFile> Open(const std::string& path);
+  // Recreates an ApexFile from values that Open() read earlier, without
+  // accessing |apex_path| again.
+  static ApexFile FromParts(const std::string& apex_path,
+                            const std::optional<int32_t>& image_offset,
+                            const std::optional<size_t>& image_size,
+                            ::apex::proto::ApexManifest manifest,
+                            const std::string& apex_pubkey,
+                            const std::optional<std::string>& fs_type,
+                            bool is_compressed) {
+    return ApexFile(apex_path, image_offset, image_size, std::move(manifest),
+                    apex_pubkey, fs_type, is_compressed);
+  }
   ApexFile() = delete;
+  ApexFile(const ApexFile&) = default;
+  ApexFile& operator=(const ApexFile&) = default;
   ApexFile(ApexFile&&) = default;
   ApexFile& operator=(ApexFile&&) = default;
 
@@ -55,7 +70,18 @@ class ApexFile {
   android::base::Result<ApexVerityData> VerifyApexVerity(
       const std::string& public_key) const;
   bool IsCompressed() const { return is_compressed_; }
-  android::base::Result<void> Decompress(const std::string& output_path) const;
+  // Decompresses this CAPEX to |output_path|. If |reserved_path| is given, it
+  // must be a file preallocated for the decompressed APEX; it is moved to
+  // |output_path| and overwritten, so that no new blocks need to be allocated.
+  // For chunked CAPEXes, chunks that are identical in the decompressed APEX at
+  // |base_path|, e.g. a previous version of the package, are cloned or copied
+  // from it rather than decompressed. If the payload is hashed while being
+  // decompressed, its hashtree is written to |hashtree_path|, if given, so
+  // that mounting the decompressed APEX doesn't have to read it all again.
+  android::base::Result<void> Decompress(
+      const std::string& output_path, const std::string& reserved_path = "",
+      const std::string& base_path = "",
+      const std::string& hashtree_path = "") const;
 
  private:
   ApexFile(const std::string& apex_path,
@@ -80,6 +106,13 @@ class ApexFile {
   bool is_compressed_;
 };
 
+// Converts |apex| to and from the form in which apexd persists it.
+void ApexFileToProto(
+    const ApexFile& apex,
+    ::apex::proto::MountDatabaseSnapshot::ApexFileInfo* info);
+android::base::Result<ApexFile> ApexFileFromProto(
+    const ::apex::proto::MountDatabaseSnapshot::ApexFileInfo& info);
+
 }  // namespace apex
 }  // namespace android
 
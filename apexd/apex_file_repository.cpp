@@ -18,6 +18,10 @@
 
 #include "apex_file_repository.h"
 
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <algorithm>
 #include <unordered_map>
 
 #include <android-base/file.h>
@@ -29,15 +33,70 @@
 #include "apex_constants.h"
 #include "apex_file.h"
 #include "apexd_utils.h"
+#include "mount_database.pb.h"
 
 using android::base::EndsWith;
+using android::base::ErrnoError;
 using android::base::Error;
 using android::base::GetProperty;
+using android::base::ReadFileToString;
 using android::base::Result;
+using android::base::WriteStringToFile;
+using ::apex::proto::PreInstalledApexCache;
 
 namespace android {
 namespace apex {
 
+namespace {
+
+// Bump when the format of PreInstalledApexCache changes.
+static constexpr int kPreInstalledApexCacheVersion = 1;
+
+// Returns the apexes that |dir| lists, or an error if the directory doesn't
+// contain exactly the same files anymore.
+Result<std::vector<ApexFile>> ReadCachedDir(
+    const PreInstalledApexCache::ScannedDir& dir) {
+  Result<std::vector<std::string>> all_apex_files = FindFilesBySuffix(
+      dir.path(), {kApexPackageSuffix, kCompressedApexPackageSuffix});
+  if (!all_apex_files.ok()) {
+    return all_apex_files.error();
+  }
+  if (all_apex_files->size() != static_cast<size_t>(dir.apexes_size())) {
+    return Error() << "Number of apexes in " << dir.path() << " changed";
+  }
+  std::vector<ApexFile> ret;
+  for (int i = 0; i < dir.apexes_size(); i++) {
+    const auto& cached = dir.apexes(i);
+    if ((*all_apex_files)[i] != cached.path()) {
+      return Error() << "Found " << (*all_apex_files)[i] << " instead of "
+                     << cached.path();
+    }
+    // Apexes dropped in favour of one with the same name are not cached, as
+    // that choice depends on the other directories.
+    if (!cached.has_apex_file()) {
+      return Error() << cached.path() << " is not cached";
+    }
+    struct stat st;
+    if (stat(cached.path().c_str(), &st) != 0) {
+      return ErrnoError() << "Failed to stat " << cached.path();
+    }
+    if (st.st_dev != cached.dev() || st.st_ino != cached.ino() ||
+        st.st_size != cached.size() ||
+        st.st_mtim.tv_sec != cached.mtime_sec() ||
+        st.st_mtim.tv_nsec != cached.mtime_nsec()) {
+      return Error() << cached.path() << " changed";
+    }
+    auto apex_file = ApexFileFromProto(cached.apex_file());
+    if (!apex_file.ok()) {
+      return apex_file.error();
+    }
+    ret.emplace_back(std::move(*apex_file));
+  }
+  return ret;
+}
+
+}  // namespace
+
 Result<void> ApexFileRepository::ScanBuiltInDir(const std::string& dir) {
   LOG(INFO) << "Scanning " << dir << " for pre-installed ApexFiles";
   if (access(dir.c_str(), F_OK) != 0 && errno == ENOENT) {
@@ -51,40 +110,66 @@ Result<void> ApexFileRepository::ScanBuiltInDir(const std::string& dir) {
     return all_apex_files.error();
   }
 
+  std::vector<ScannedApex> scanned;
   // TODO(b/179248390): scan parallelly if possible
   for (const auto& file : *all_apex_files) {
     LOG(INFO) << "Found pre-installed APEX " << file;
+    // Stat before opening, so that a later change is always noticed.
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0) {
+      return ErrnoError() << "Failed to stat " << file;
+    }
     Result<ApexFile> apex_file = ApexFile::Open(file);
     if (!apex_file.ok()) {
       return Error() << "Failed to open " << file << " : " << apex_file.error();
     }
+    scanned.push_back({.path = file,
+                       .dev = st.st_dev,
+                       .ino = st.st_ino,
+                       .size = st.st_size,
+                       .mtime = st.st_mtim});
+    AddPreInstalledApexFile(std::move(*apex_file));
+  }
 
-    const std::string& name = apex_file->GetManifest().name();
-    auto it = pre_installed_store_.find(name);
-    if (it == pre_installed_store_.end()) {
-      pre_installed_store_.emplace(name, std::move(*apex_file));
-    } else if (it->second.GetPath() != apex_file->GetPath()) {
-      auto level = base::FATAL;
-      // On some development (non-REL) builds the VNDK apex could be in /vendor.
-      // When testing CTS-on-GSI on these builds, there would be two VNDK apexes
-      // in the system, one in /system and one in /vendor.
-      static constexpr char kVndkApexModuleNamePrefix[] = "com.android.vndk.";
-      static constexpr char kPlatformVersionCodenameProperty[] =
-          "ro.build.version.codename";
-      if (android::base::StartsWith(name, kVndkApexModuleNamePrefix) &&
-          GetProperty(kPlatformVersionCodenameProperty, "REL") != "REL") {
-        level = android::base::INFO;
-      }
-      LOG(level) << "Found two apex packages " << it->second.GetPath()
-                 << " and " << apex_file->GetPath()
-                 << " with the same module name " << name;
-    } else if (it->second.GetBundledPublicKey() !=
-               apex_file->GetBundledPublicKey()) {
-      LOG(FATAL) << "Public key of apex package " << it->second.GetPath()
-                 << " (" << name << ") has unexpectedly changed";
+  RecordScannedDir(dir, std::move(scanned));
+  return {};
+}
+
+void ApexFileRepository::RecordScannedDir(const std::string& dir,
+                                          std::vector<ScannedApex> apexes) {
+  auto it = std::find_if(scanned_dirs_.begin(), scanned_dirs_.end(),
+                         [&](const auto& entry) { return entry.first == dir; });
+  if (it != scanned_dirs_.end()) {
+    it->second = std::move(apexes);
+  } else {
+    scanned_dirs_.emplace_back(dir, std::move(apexes));
+  }
+}
+
+void ApexFileRepository::AddPreInstalledApexFile(ApexFile&& apex_file) {
+  const std::string& name = apex_file.GetManifest().name();
+  auto it = pre_installed_store_.find(name);
+  if (it == pre_installed_store_.end()) {
+    pre_installed_store_.emplace(name, std::move(apex_file));
+  } else if (it->second.GetPath() != apex_file.GetPath()) {
+    auto level = base::FATAL;
+    // On some development (non-REL) builds the VNDK apex could be in /vendor.
+    // When testing CTS-on-GSI on these builds, there would be two VNDK apexes
+    // in the system, one in /system and one in /vendor.
+    static constexpr char kVndkApexModuleNamePrefix[] = "com.android.vndk.";
+    static constexpr char kPlatformVersionCodenameProperty[] =
+        "ro.build.version.codename";
+    if (android::base::StartsWith(name, kVndkApexModuleNamePrefix) &&
+        GetProperty(kPlatformVersionCodenameProperty, "REL") != "REL") {
+      level = android::base::INFO;
     }
+    LOG(level) << "Found two apex packages " << it->second.GetPath() << " and "
+               << apex_file.GetPath() << " with the same module name " << name;
+  } else if (it->second.GetBundledPublicKey() !=
+             apex_file.GetBundledPublicKey()) {
+    LOG(FATAL) << "Public key of apex package " << it->second.GetPath() << " ("
+               << name << ") has unexpectedly changed";
   }
-  return {};
 }
 
 ApexFileRepository& ApexFileRepository::GetInstance() {
@@ -102,6 +187,91 @@ android::base::Result<void> ApexFileRepository::AddPreInstalledApex(
   return {};
 }
 
+Result<void> ApexFileRepository::AddPreInstalledApex(
+    const std::vector<std::string>& prebuilt_dirs,
+    const std::string& cache_path) {
+  PreInstalledApexCache cache;
+  std::string content;
+  if (!ReadFileToString(cache_path, &content)) {
+    PLOG(INFO) << "Not using " << cache_path;
+  } else if (!cache.ParseFromString(content) ||
+             cache.version() != kPreInstalledApexCacheVersion) {
+    LOG(WARNING) << "Ignoring invalid " << cache_path;
+    cache.Clear();
+  }
+
+  for (const auto& dir : prebuilt_dirs) {
+    auto cached_dir =
+        std::find_if(cache.dirs().begin(), cache.dirs().end(),
+                     [&](const auto& entry) { return entry.path() == dir; });
+    if (cached_dir == cache.dirs().end()) {
+      if (auto result = ScanBuiltInDir(dir); !result.ok()) {
+        return result.error();
+      }
+      continue;
+    }
+    auto apex_files = ReadCachedDir(*cached_dir);
+    if (!apex_files.ok()) {
+      LOG(INFO) << "Scanning " << dir << " again: " << apex_files.error();
+      if (auto result = ScanBuiltInDir(dir); !result.ok()) {
+        return result.error();
+      }
+      continue;
+    }
+    LOG(INFO) << "Using cached pre-installed ApexFiles of " << dir;
+    std::vector<ScannedApex> scanned;
+    for (const auto& cached : cached_dir->apexes()) {
+      scanned.push_back({.path = cached.path(),
+                         .dev = static_cast<dev_t>(cached.dev()),
+                         .ino = static_cast<ino_t>(cached.ino()),
+                         .size = cached.size(),
+                         .mtime = {.tv_sec = cached.mtime_sec(),
+                                   .tv_nsec = cached.mtime_nsec()}});
+    }
+    for (auto& apex_file : *apex_files) {
+      AddPreInstalledApexFile(std::move(apex_file));
+    }
+    RecordScannedDir(dir, std::move(scanned));
+  }
+  return {};
+}
+
+Result<void> ApexFileRepository::WritePreInstalledCache(
+    const std::string& path) const {
+  std::unordered_map<std::string, const ApexFile*> by_path;
+  for (const auto& [_, apex_file] : pre_installed_store_) {
+    by_path.emplace(apex_file.GetPath(), &apex_file);
+  }
+
+  PreInstalledApexCache cache;
+  cache.set_version(kPreInstalledApexCacheVersion);
+  for (const auto& [dir, apexes] : scanned_dirs_) {
+    auto* cached_dir = cache.add_dirs();
+    cached_dir->set_path(dir);
+    for (const auto& apex : apexes) {
+      auto* cached = cached_dir->add_apexes();
+      cached->set_path(apex.path);
+      cached->set_dev(apex.dev);
+      cached->set_ino(apex.ino);
+      cached->set_size(apex.size);
+      cached->set_mtime_sec(apex.mtime.tv_sec);
+      cached->set_mtime_nsec(apex.mtime.tv_nsec);
+      if (auto it = by_path.find(apex.path); it != by_path.end()) {
+        ApexFileToProto(*it->second, cached->mutable_apex_file());
+      }
+    }
+  }
+  // Readers must never see a partially written cache.
+  std::string tmp_path = path + ".tmp";
+  if (!WriteStringToFile(cache.SerializeAsString(), tmp_path)) {
+    return ErrnoError() << "Failed to write " << tmp_path;
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << tmp_path << " to " << path;
+  }
+  return {};
+}
+
 // TODO(b/179497746): AddDataApex should not concern with filtering out invalid
 //   apex.
 Result<void> ApexFileRepository::AddDataApex(const std::string& data_dir) {
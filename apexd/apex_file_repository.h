@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <sys/stat.h>
+
 #include <functional>
 #include <string>
 #include <unordered_map>
@@ -60,10 +62,24 @@ class ApexFileRepository final {
   android::base::Result<void> AddPreInstalledApex(
       const std::vector<std::string>& prebuilt_dirs);
 
+  // Same as above, but directories whose contents still match the ones listed
+  // in the |cache_path| written by WritePreInstalledCache are populated from
+  // it, instead of opening every apex in them again.
+  android::base::Result<void> AddPreInstalledApex(
+      const std::vector<std::string>& prebuilt_dirs,
+      const std::string& cache_path);
+
+  // Writes the pre-installed apexes collected so far to |path|, so that
+  // another process can import them with AddPreInstalledApex.
+  android::base::Result<void> WritePreInstalledCache(
+      const std::string& path) const;
+
   // Populate instance by collecting data apex files from the given |data_dir|.
   // Note: this call is **not thread safe** and is expected to be performed in a
   // single thread during initialization of apexd. After initialization is
   // finished, all queries to the instance are thread safe.
+  // Queries that only concern pre-installed apexes are safe to run
+  // concurrently with it.
   android::base::Result<void> AddDataApex(const std::string& data_dir);
 
   // Returns trusted public key for an apex with the given |name|.
@@ -115,6 +131,7 @@ class ApexFileRepository final {
   void Reset(const std::string& decompression_dir = kApexDecompressedDir) {
     pre_installed_store_.clear();
     data_store_.clear();
+    scanned_dirs_.clear();
     decompression_dir_ = decompression_dir;
   }
 
@@ -125,11 +142,30 @@ class ApexFileRepository final {
   ApexFileRepository& operator=(ApexFileRepository&&) = delete;
   ApexFileRepository(ApexFileRepository&&) = delete;
 
+  // A pre-installed apex file, as it was when it was opened.
+  struct ScannedApex {
+    std::string path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    timespec mtime;
+  };
+
   // Scans apexes in the given directory and adds collected data into
   // |pre_installed_store_|.
   android::base::Result<void> ScanBuiltInDir(const std::string& dir);
 
+  // Adds |apex_file| found in a built-in directory to |pre_installed_store_|,
+  // unless an apex with the same name was already found.
+  void AddPreInstalledApexFile(ApexFile&& apex_file);
+
+  // Replaces what |scanned_dirs_| knows about |dir|.
+  void RecordScannedDir(const std::string& dir,
+                        std::vector<ScannedApex> apexes);
+
   std::unordered_map<std::string, ApexFile> pre_installed_store_, data_store_;
+  // Built-in directories populated so far, with the apexes found in each.
+  std::vector<std::pair<std::string, std::vector<ScannedApex>>> scanned_dirs_;
   // Decompression directory which will be used to determine if apex is
   // decompressed or not
   std::string decompression_dir_;
@@ -15,9 +15,11 @@
  */
 
 #include <filesystem>
+#include <fstream>
 #include <string>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #include <android-base/file.h>
@@ -134,6 +136,48 @@ TEST(ApexFileRepositoryTest, InitializeFailureCorruptApex) {
   ASSERT_FALSE(IsOk(instance.AddPreInstalledApex({td.path})));
 }
 
+TEST(ApexFileRepositoryTest, AddPreInstalledApexFromCache) {
+  TemporaryDir built_in_dir, cache_dir;
+  fs::copy(GetTestFile("apex.apexd_test.apex"), built_in_dir.path);
+  std::string apex_path =
+      StringPrintf("%s/apex.apexd_test.apex", built_in_dir.path);
+  std::string cache_path = StringPrintf("%s/cache.pb", cache_dir.path);
+
+  {
+    ApexFileRepository instance;
+    ASSERT_TRUE(IsOk(instance.AddPreInstalledApex({built_in_dir.path})));
+    ASSERT_TRUE(IsOk(instance.WritePreInstalledCache(cache_path)));
+  }
+
+  // Corrupt the apex without changing its size or mtime, so that it can only
+  // be imported if it isn't opened again.
+  struct stat st;
+  ASSERT_EQ(0, stat(apex_path.c_str(), &st));
+  {
+    std::fstream apex(apex_path, std::ios::in | std::ios::out);
+    apex.write(std::string(4096, '\0').data(), 4096);
+  }
+  const struct timespec times[2] = {st.st_atim, st.st_mtim};
+  ASSERT_EQ(0, utimensat(AT_FDCWD, apex_path.c_str(), times, 0));
+  ASSERT_FALSE(IsOk(ApexFile::Open(apex_path)));
+
+  {
+    ApexFileRepository instance;
+    ASSERT_TRUE(IsOk(
+        instance.AddPreInstalledApex({built_in_dir.path}, cache_path)));
+    auto path = instance.GetPreinstalledPath("com.android.apex.test_package");
+    ASSERT_TRUE(IsOk(path));
+    ASSERT_EQ(apex_path, *path);
+  }
+
+  // Once the directory changes, it is scanned again.
+  fs::copy(GetTestFile("apex.apexd_test_different_app.apex"),
+           built_in_dir.path);
+  ApexFileRepository instance;
+  ASSERT_FALSE(
+      IsOk(instance.AddPreInstalledApex({built_in_dir.path}, cache_path)));
+}
+
 TEST(ApexFileRepositoryTest, InitializeCompressedApexWithoutApex) {
   // Prepare test data.
   TemporaryDir td;
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <string>
 
 #include <android-base/file.h>
@@ -44,7 +45,9 @@ struct ApexFileTestParam {
 };
 
 constexpr const ApexFileTestParam kParameters[] = {
-    {"ext4", "apex.apexd_test"}, {"f2fs", "apex.apexd_test_f2fs"}};
+    {"ext4", "apex.apexd_test"},
+    {"f2fs", "apex.apexd_test_f2fs"},
+    {"erofs", "apex.apexd_test_erofs"}};
 
 class ApexFileTest : public ::testing::TestWithParam<ApexFileTestParam> {};
 
@@ -253,6 +256,197 @@ TEST(ApexFileTest, DecompressCompressedApex) {
   ASSERT_TRUE(*comparison_result);
 }
 
+TEST(ApexFileTest, DecompressZstdCompressedApex) {
+  const std::string file_path =
+      kTestDataDir + "com.android.apex.compressed.v1_zstd.capex";
+  Result<ApexFile> apex_file = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(apex_file);
+  ASSERT_TRUE(apex_file->IsCompressed());
+
+  TemporaryDir tmp_dir;
+  const std::string decompression_file_path =
+      std::string(tmp_dir.path) + "/" + apex_file->GetManifest().name() +
+      ".capex";
+
+  auto result = apex_file->Decompress(decompression_file_path);
+  ASSERT_RESULT_OK(result);
+
+  const std::string original_apex_file_path =
+      kTestDataDir + "com.android.apex.compressed.v1_original.apex";
+  auto comparison_result =
+      CompareFiles(original_apex_file_path, decompression_file_path);
+  ASSERT_RESULT_OK(comparison_result);
+  ASSERT_TRUE(*comparison_result);
+}
+
+TEST(ApexFileTest, DecompressFailsIfPayloadDoesNotMatchRootDigest) {
+  Result<ApexFile> apex_file = ApexFile::Open(
+      kTestDataDir + "com.android.apex.compressed.v1_zstd.capex");
+  ASSERT_RESULT_OK(apex_file);
+  ASSERT_FALSE(
+      apex_file->GetManifest().capexmetadata().originalapexsalt().empty());
+
+  auto manifest = apex_file->GetManifest();
+  manifest.mutable_capexmetadata()->set_originalapexdigest(
+      std::string(64, '0'));
+  auto wrong_digest_capex = ApexFile::FromParts(
+      apex_file->GetPath(), std::nullopt, std::nullopt, std::move(manifest),
+      apex_file->GetBundledPublicKey(), std::nullopt,
+      /* is_compressed= */ true);
+
+  TemporaryDir tmp_dir;
+  const std::string decompression_file_path =
+      tmp_dir.path + std::string("/decompressed.apex");
+  auto result = wrong_digest_capex.Decompress(decompression_file_path);
+  ASSERT_FALSE(result.ok());
+  ASSERT_THAT(result.error().message(), ::testing::HasSubstr("does not match"));
+  ASSERT_FALSE(*PathExists(decompression_file_path));
+}
+
+TEST(ApexFileTest, DecompressChunkedZstdCompressedApex) {
+  const std::string file_path =
+      kTestDataDir + "com.android.apex.compressed.v1_zstd_chunked.capex";
+  Result<ApexFile> apex_file = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(apex_file);
+  ASSERT_TRUE(apex_file->IsCompressed());
+  ASSERT_GT(
+      apex_file->GetManifest().capexmetadata().chunkcompressedsizes_size(), 1);
+
+  TemporaryDir tmp_dir;
+  const std::string decompression_file_path =
+      std::string(tmp_dir.path) + "/" + apex_file->GetManifest().name() +
+      ".capex";
+
+  auto result = apex_file->Decompress(decompression_file_path);
+  ASSERT_RESULT_OK(result);
+
+  const std::string original_apex_file_path =
+      kTestDataDir + "com.android.apex.compressed.v1_original.apex";
+  auto comparison_result =
+      CompareFiles(original_apex_file_path, decompression_file_path);
+  ASSERT_RESULT_OK(comparison_result);
+  ASSERT_TRUE(*comparison_result);
+  ASSERT_FALSE(*PathExists(decompression_file_path + ".partial"));
+  ASSERT_FALSE(*PathExists(decompression_file_path + ".progress"));
+}
+
+TEST(ApexFileTest, DecompressChunkedZstdCompressedApexResumes) {
+  const std::string file_path =
+      kTestDataDir + "com.android.apex.compressed.v1_zstd_chunked.capex";
+  Result<ApexFile> apex_file = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(apex_file);
+  const auto& capex_metadata = apex_file->GetManifest().capexmetadata();
+  const int chunk_count = capex_metadata.chunkcompressedsizes_size();
+  ASSERT_GT(chunk_count, 1);
+
+  // Pretend that a previous attempt completed all chunks but the first one,
+  // whose data never made it to the disk.
+  const std::string original_apex_file_path =
+      kTestDataDir + "com.android.apex.compressed.v1_original.apex";
+  std::string partial;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(original_apex_file_path, &partial));
+  std::fill_n(partial.begin(), capex_metadata.chunksize(), '\0');
+  std::string progress = capex_metadata.originalapexdigest() + " " +
+                         std::to_string(capex_metadata.chunksize()) + "\n";
+  for (int i = 1; i < chunk_count; i++) {
+    progress += std::to_string(i) + "\n";
+  }
+
+  TemporaryDir tmp_dir;
+  const std::string decompression_file_path =
+      std::string(tmp_dir.path) + "/" + apex_file->GetManifest().name() +
+      ".capex";
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      partial, decompression_file_path + ".partial"));
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      progress, decompression_file_path + ".progress"));
+
+  auto result = apex_file->Decompress(decompression_file_path);
+  ASSERT_RESULT_OK(result);
+
+  auto comparison_result =
+      CompareFiles(original_apex_file_path, decompression_file_path);
+  ASSERT_RESULT_OK(comparison_result);
+  ASSERT_TRUE(*comparison_result);
+  ASSERT_FALSE(*PathExists(decompression_file_path + ".progress"));
+}
+
+TEST(ApexFileTest, DecompressChunkedZstdCompressedApexRedoesCorruptedChunks) {
+  const std::string file_path =
+      kTestDataDir + "com.android.apex.compressed.v1_zstd_chunked.capex";
+  Result<ApexFile> apex_file = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(apex_file);
+  const auto& capex_metadata = apex_file->GetManifest().capexmetadata();
+  const int chunk_count = capex_metadata.chunkcompressedsizes_size();
+  ASSERT_GT(chunk_count, 1);
+  ASSERT_EQ(capex_metadata.chunkdigests_size(), chunk_count);
+
+  // The progress claims that every chunk is complete, but the data of the
+  // first one is corrupted.
+  const std::string original_apex_file_path =
+      kTestDataDir + "com.android.apex.compressed.v1_original.apex";
+  std::string partial;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(original_apex_file_path, &partial));
+  std::fill_n(partial.begin(), capex_metadata.chunksize(), '\0');
+  std::string progress = capex_metadata.originalapexdigest() + " " +
+                         std::to_string(capex_metadata.chunksize()) + "\n";
+  for (int i = 0; i < chunk_count; i++) {
+    progress += std::to_string(i) + "\n";
+  }
+
+  TemporaryDir tmp_dir;
+  const std::string decompression_file_path =
+      std::string(tmp_dir.path) + "/" + apex_file->GetManifest().name() +
+      ".capex";
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      partial, decompression_file_path + ".partial"));
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      progress, decompression_file_path + ".progress"));
+
+  auto result = apex_file->Decompress(decompression_file_path);
+  ASSERT_RESULT_OK(result);
+
+  auto comparison_result =
+      CompareFiles(original_apex_file_path, decompression_file_path);
+  ASSERT_RESULT_OK(comparison_result);
+  ASSERT_TRUE(*comparison_result);
+}
+
+TEST(ApexFileTest, DecompressChunkedZstdCompressedApexReusesBase) {
+  const std::string file_path =
+      kTestDataDir + "com.android.apex.compressed.v1_zstd_chunked.capex";
+  Result<ApexFile> apex_file = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(apex_file);
+  const auto& capex_metadata = apex_file->GetManifest().capexmetadata();
+  ASSERT_EQ(capex_metadata.chunkdigests_size(),
+            capex_metadata.chunkcompressedsizes_size());
+
+  // A base that differs from the original APEX in its first chunk only. The
+  // other chunks are reused, and the first one decompressed.
+  const std::string original_apex_file_path =
+      kTestDataDir + "com.android.apex.compressed.v1_original.apex";
+  std::string base;
+  ASSERT_TRUE(android::base::ReadFileToString(original_apex_file_path, &base));
+  std::fill_n(base.begin(), capex_metadata.chunksize(), '\0');
+  TemporaryFile base_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(base, base_file.path));
+
+  TemporaryDir tmp_dir;
+  const std::string decompression_file_path =
+      std::string(tmp_dir.path) + "/" + apex_file->GetManifest().name() +
+      ".capex";
+  auto result = apex_file->Decompress(decompression_file_path,
+                                      /* reserved_path= */ "", base_file.path);
+  ASSERT_RESULT_OK(result);
+
+  auto comparison_result =
+      CompareFiles(original_apex_file_path, decompression_file_path);
+  ASSERT_RESULT_OK(comparison_result);
+  ASSERT_TRUE(*comparison_result);
+}
+
 TEST(ApexFileTest, DecompressFailForNormalApex) {
   const std::string file_path =
       kTestDataDir + "com.android.apex.compressed.v1_original.apex";
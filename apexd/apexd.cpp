@@ -23,13 +23,16 @@
 #include "apex_file.h"
 #include "apex_manifest.h"
 #include "apex_shim.h"
+#include "apexd_activation_watchdog.h"
 #include "apexd_checkpoint.h"
+#include "apexd_hashtree_image.h"
 #include "apexd_lifecycle.h"
 #include "apexd_loop.h"
 #include "apexd_prepostinstall.h"
 #include "apexd_rollback_utils.h"
 #include "apexd_session.h"
 #include "apexd_utils.h"
+#include "apexd_verification_io.h"
 #include "apexd_verity.h"
 #include "com_android_apex.h"
 
@@ -54,12 +57,15 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <linux/f2fs.h>
+#include <linux/ioprio.h>
 #include <linux/loop.h>
 #include <stdlib.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -67,13 +73,19 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <iomanip>
 #include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
@@ -87,6 +99,8 @@
 
 using android::base::boot_clock;
 using android::base::ConsumePrefix;
+using android::base::ConsumeSuffix;
+using android::base::EndsWith;
 using android::base::ErrnoError;
 using android::base::Error;
 using android::base::GetProperty;
@@ -96,6 +110,7 @@ using android::base::ReadFully;
 using android::base::RemoveFileIfExists;
 using android::base::Result;
 using android::base::SetProperty;
+using android::base::StartsWith;
 using android::base::StringPrintf;
 using android::base::unique_fd;
 using android::dm::DeviceMapper;
@@ -129,6 +144,9 @@ bool gInFsCheckpointMode = false;
 
 static constexpr size_t kLoopDeviceSetupAttempts = 3u;
 
+// Filesystem block size used by apexer for EROFS payloads.
+static constexpr int32_t kErofsBlockSize = 4096;
+
 // Please DO NOT add new modules to this list without contacting mainline-modularization@ first.
 static const std::vector<std::string> kBootstrapApexes = ([]() {
   std::vector<std::string> ret = {
@@ -181,24 +199,18 @@ void ReleaseF2fsCompressedBlocks(const std::string& file_path) {
 }
 
 // Pre-allocate loop devices so that we don't have to wait for them
-// later when actually activating APEXes.
+// later when actually activating APEXes. The pre-installed APEXes are only
+// listed, not opened, so that this can run while they are being scanned.
 Result<void> PreAllocateLoopDevices() {
   auto scan = FindApexes(kApexPackageBuiltinDirs);
   if (!scan.ok()) {
     return scan.error();
   }
 
-  auto size = 0;
-  for (const auto& path : *scan) {
-    auto apex_file = ApexFile::Open(path);
-    if (!apex_file.ok()) {
-      continue;
-    }
-    size++;
-    // bootstrap Apexes may be activated on separate namespaces.
-    if (IsBootstrapApex(*apex_file)) {
-      size++;
-    }
+  size_t size = scan->size();
+  // bootstrap Apexes may be activated on separate namespaces.
+  if (size > 0) {
+    size += kBootstrapApexes.size();
   }
 
   // note: do not call PreAllocateLoopDevices() if size == 0.
@@ -211,14 +223,16 @@ Result<void> PreAllocateLoopDevices() {
   return loop::PreAllocateLoopDevices(size);
 }
 
+// |hash_start_block| is only used for an external |hash_device|, e.g. a slot of
+// the consolidated hashtree image.
 std::unique_ptr<DmTable> CreateVerityTable(const ApexVerityData& verity_data,
                                            const std::string& block_device,
                                            const std::string& hash_device,
-                                           bool restart_on_corruption) {
+                                           bool restart_on_corruption,
+                                           uint32_t hash_start_block = 0) {
   AvbHashtreeDescriptor* desc = verity_data.desc.get();
   auto table = std::make_unique<DmTable>();
 
-  uint32_t hash_start_block = 0;
   if (hash_device == block_device) {
     hash_start_block = desc->tree_offset / desc->hash_block_size;
   }
@@ -376,11 +390,40 @@ Result<void> RemovePreviouslyActiveApexFiles(
   return {};
 }
 
-// Reads the entire device to verify the image is authenticatic
-Result<void> ReadVerityDevice(const std::string& verity_device,
-                              uint64_t device_size) {
+// Identifies the content of a file, as long as it isn't modified. Any change,
+// including to its timestamps, updates ctime.
+struct FileIdentity {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  timespec ctime;
+
+  bool operator==(const FileIdentity& other) const {
+    return dev == other.dev && ino == other.ino && size == other.size &&
+           ctime.tv_sec == other.ctime.tv_sec &&
+           ctime.tv_nsec == other.ctime.tv_nsec;
+  }
+};
+
+Result<FileIdentity> GetFileIdentity(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << path;
+  }
+  return FileIdentity{st.st_dev, st.st_ino, st.st_size, st.st_ctim};
+}
+
+// Reads the entire device to verify the image is authenticatic. Reading starts
+// at |start_offset|, and |on_progress| is told how many bytes from the start
+// of the device were read so far after each chunk.
+Result<void> ReadVerityDevice(
+    const std::string& verity_device, uint64_t device_size,
+    uint64_t start_offset = 0,
+    const std::function<void(uint64_t)>& on_progress = nullptr) {
   static constexpr int kBlockSize = 4096;
-  static constexpr size_t kBufSize = 1024 * kBlockSize;
+  // Small enough for OnVerificationRead to pace reads and notice cancellation
+  // promptly.
+  static constexpr size_t kBufSize = 256 * kBlockSize;
   std::vector<uint8_t> buffer(kBufSize);
 
   unique_fd fd(
@@ -389,18 +432,108 @@ Result<void> ReadVerityDevice(const std::string& verity_device,
     return ErrnoError() << "Can't open " << verity_device;
   }
 
-  size_t bytes_left = device_size;
+  if (start_offset > 0 && lseek(fd.get(), start_offset, SEEK_SET) == -1) {
+    return ErrnoError() << "Failed to seek " << verity_device;
+  }
+
+  size_t bytes_left = device_size - start_offset;
   while (bytes_left > 0) {
     size_t to_read = std::min(bytes_left, kBufSize);
+    if (auto st = OnVerificationRead(to_read); !st.ok()) {
+      return st.error();
+    }
+    if (auto st = CheckActivationDeadline(); !st.ok()) {
+      return st.error();
+    }
     if (!android::base::ReadFully(fd.get(), buffer.data(), to_read)) {
       return ErrnoError() << "Can't verify " << verity_device << "; corrupted?";
     }
     bytes_left -= to_read;
+    if (on_progress) {
+      on_progress(device_size - bytes_left);
+    }
   }
 
   return {};
 }
 
+std::string GetVerificationCheckpointPath(const ApexFile& apex) {
+  return StringPrintf("%s/%s.progress", gConfig->apex_hash_tree_dir,
+                      GetPackageId(apex.GetManifest()).c_str());
+}
+
+// Like ReadVerityDevice, but records how far the read got every
+// kCheckpointInterval bytes. If the same file was partially read before,
+// against the same root digest, only the rest of it is read. This survives
+// apexd restarts and reboots, as the checkpoint is only discarded once the
+// file changes or the read completes.
+Result<void> ReadVerityDeviceWithCheckpoints(const ApexFile& apex,
+                                             const ApexVerityData& verity_data,
+                                             const std::string& verity_device) {
+  static constexpr uint64_t kCheckpointInterval = 64 * 1024 * 1024;
+  uint64_t device_size = verity_data.desc->image_size;
+  auto identity = GetFileIdentity(apex.GetPath());
+  if (!identity.ok()) {
+    return identity.error();
+  }
+  ::apex::proto::VerificationCheckpoint checkpoint;
+  checkpoint.set_dev(identity->dev);
+  checkpoint.set_ino(identity->ino);
+  checkpoint.set_size(identity->size);
+  checkpoint.set_ctime_sec(identity->ctime.tv_sec);
+  checkpoint.set_ctime_nsec(identity->ctime.tv_nsec);
+  checkpoint.set_root_digest(verity_data.root_digest);
+
+  std::string checkpoint_path = GetVerificationCheckpointPath(apex);
+  uint64_t start_offset = 0;
+  std::string content;
+  ::apex::proto::VerificationCheckpoint previous;
+  if (android::base::ReadFileToString(checkpoint_path, &content) &&
+      previous.ParseFromString(content)) {
+    uint64_t verified_bytes = previous.verified_bytes();
+    previous.clear_verified_bytes();
+    if (MessageDifferencer::Equals(previous, checkpoint) &&
+        verified_bytes < device_size) {
+      LOG(INFO) << "Resuming verification of " << apex.GetPath() << " after "
+                << verified_bytes << " bytes";
+      start_offset = verified_bytes;
+    }
+  }
+
+  uint64_t last_checkpoint = start_offset;
+  auto on_progress = [&](uint64_t verified_bytes) {
+    if (verified_bytes - last_checkpoint < kCheckpointInterval) {
+      return;
+    }
+    checkpoint.set_verified_bytes(verified_bytes);
+    // Synced before and after the rename, so that a power loss leaves either
+    // the previous checkpoint or this one.
+    std::string tmp_path = checkpoint_path + ".tmp";
+    unique_fd fd(TEMP_FAILURE_RETRY(
+        open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+             0600)));
+    if (fd.get() == -1 ||
+        !android::base::WriteStringToFd(checkpoint.SerializeAsString(), fd) ||
+        fsync(fd.get()) != 0 ||
+        rename(tmp_path.c_str(), checkpoint_path.c_str()) != 0) {
+      PLOG(WARNING) << "Failed to write " << checkpoint_path;
+      return;
+    }
+    unique_fd dir_fd(open(gConfig->apex_hash_tree_dir,
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (dir_fd.get() == -1 || fsync(dir_fd.get()) != 0) {
+      PLOG(WARNING) << "Failed to sync " << gConfig->apex_hash_tree_dir;
+    }
+    last_checkpoint = verified_bytes;
+  };
+  auto status =
+      ReadVerityDevice(verity_device, device_size, start_offset, on_progress);
+  if (status.ok() && unlink(checkpoint_path.c_str()) != 0 && errno != ENOENT) {
+    PLOG(WARNING) << "Failed to remove " << checkpoint_path;
+  }
+  return status;
+}
+
 Result<void> VerifyMountedImage(const ApexFile& apex,
                                 const std::string& mount_point) {
   // Verify that apex_manifest.pb inside mounted image matches the one in the
@@ -420,6 +553,137 @@ Result<void> VerifyMountedImage(const ApexFile& apex,
   return {};
 }
 
+// Cleared once the kernel refuses to mount a regular file, so that the rest of
+// the packages go straight to loop devices.
+std::atomic<bool> gLoopFreeMountSupported{true};
+
+bool CanMountWithoutLoop(const ApexFile& apex) {
+  if (!android::sysprop::ApexProperties::loop_free_mount().value_or(false) ||
+      !gLoopFreeMountSupported) {
+    return false;
+  }
+  // Only EROFS can be mounted straight from a regular file, and only if the
+  // payload is aligned to its block size.
+  return apex.GetFsType() == "erofs" && apex.GetImageOffset() &&
+         *apex.GetImageOffset() % kErofsBlockSize == 0;
+}
+
+// Returns where PrepareFsVerity records the fs-verity digest of |apex|.
+std::string GetFsVerityDigestFileName(const ApexFile& apex) {
+  return StringPrintf("%s/%s.fsverity", gConfig->apex_hash_tree_dir,
+                      GetPackageId(apex.GetManifest()).c_str());
+}
+
+// Mounts |apex| directly from its backing file. Instead of dm-verity, APEXes
+// that need to be verified are protected by fs-verity on the backing file,
+// which is checked once against the AVB root digest in |verity_data|.
+Result<MountedApexData> MountPackageWithoutLoop(
+    const ApexFile& apex, const ApexVerityData& verity_data,
+    const std::string& mount_point, bool mount_on_verity,
+    uint32_t mount_flags) {
+  if (mount_on_verity) {
+    if (auto st = PrepareFsVerity(apex, verity_data,
+                                  GetFsVerityDigestFileName(apex));
+        !st.ok()) {
+      return st.error();
+    }
+  }
+  std::string options =
+      StringPrintf("fsoffset=%d", apex.GetImageOffset().value());
+  if (mount(apex.GetPath().c_str(), mount_point.c_str(), "erofs", mount_flags,
+            options.c_str()) != 0) {
+    if (errno == ENOTBLK) {
+      LOG(WARNING) << "Loop-free mounts are not supported by the kernel";
+      gLoopFreeMountSupported = false;
+    }
+    return ErrnoError() << "Failed to mount " << apex.GetPath()
+                        << " without loop device";
+  }
+  return MountedApexData(/* loop_name = */ "", apex.GetPath(), mount_point,
+                         /* device_name = */ "",
+                         /* hashtree_loop_name = */ "",
+                         /* is_temp_mount */ false);
+}
+
+// Returns the consolidated hashtree image, or nullptr if it is disabled.
+HashTreeImage* GetHashTreeImage() {
+  static std::once_flag once;
+  static std::unique_ptr<HashTreeImage> image;
+  std::call_once(once, []() {
+    uint64_t size_mb =
+        android::sysprop::ApexProperties::hashtree_image_size_mb().value_or(0);
+    if (size_mb > 0) {
+      std::vector<std::string> mounted_package_ids;
+      gMountedApexes.ForallMountedApexes(
+          [&](const std::string&, const MountedApexData& data, bool) {
+            if (!data.device_name.empty()) {
+              mounted_package_ids.push_back(data.device_name);
+            }
+          });
+      image = std::make_unique<HashTreeImage>(
+          StringPrintf("%s/%s", gConfig->apex_hash_tree_dir,
+                       kApexHashTreeImageName),
+          size_mb * 1024 * 1024, std::move(mounted_package_ids));
+    }
+  });
+  return image.get();
+}
+
+// Returns true if fs-verity on the backing file of |apex| should be used
+// instead of dm-verity. Only applies to APEXes in /data/apex/active, which get
+// fs-verity enabled once they have been booted, see BootCompletedCleanup.
+bool ShouldUseFsVerity(const ApexFile& apex) {
+  return android::sysprop::ApexProperties::data_apex_fs_verity().value_or(
+             false) &&
+         StartsWith(apex.GetPath(), gConfig->active_apex_data_dir);
+}
+
+// APEXes staged by StageApexFromFd, by path. Their payload was verified right
+// after it was written.
+std::mutex gStreamedApexesMutex;
+// Guarded by gStreamedApexesMutex.
+std::map<std::string, FileIdentity> gStreamedApexes;
+
+// Returns true if the payload of |apex| was verified by StageApexFromFd and
+// the file hasn't changed since.
+bool IsVerifiedStreamedApex(const ApexFile& apex) {
+  std::lock_guard lock(gStreamedApexesMutex);
+  auto it = gStreamedApexes.find(apex.GetPath());
+  if (it == gStreamedApexes.end()) {
+    return false;
+  }
+  auto identity = GetFileIdentity(apex.GetPath());
+  return identity.ok() && *identity == it->second;
+}
+
+// Drops what StageApexFromFd recorded for |session_ids|.
+void ForgetStreamedApexes(const std::vector<int>& session_ids) {
+  std::lock_guard lock(gStreamedApexesMutex);
+  for (int session_id : session_ids) {
+    gStreamedApexes.erase(StringPrintf("%s/session_%d/%s",
+                                       gConfig->staged_session_dir,
+                                       session_id, kStreamedApexFileName));
+  }
+}
+
+// Removes what ReadVerityDeviceWithCheckpoints recorded for the packages of
+// |session_ids|, which won't be verified again.
+void RemoveVerificationCheckpoints(const std::vector<int>& session_ids) {
+  for (int session_id : session_ids) {
+    auto session_dir = StringPrintf("%s/session_%d",
+                                    gConfig->staged_session_dir, session_id);
+    auto paths = FindFilesBySuffix(session_dir, {kApexPackageSuffix});
+    if (!paths.ok()) {
+      continue;
+    }
+    for (const auto& path : *paths) {
+      if (auto apex = ApexFile::Open(path); apex.ok()) {
+        RemoveFileIfExists(GetVerificationCheckpointPath(*apex));
+      }
+    }
+  }
+}
+
 Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
                                          const std::string& mount_point,
                                          const std::string& device_name,
@@ -463,20 +727,6 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
   if (!apex.GetImageOffset() || !apex.GetImageSize()) {
     return Error() << "Cannot create mount point without image offset and size";
   }
-  loop::LoopbackDeviceUniqueFd loopback_device;
-  for (size_t attempts = 1;; ++attempts) {
-    Result<loop::LoopbackDeviceUniqueFd> ret = loop::CreateLoopDevice(
-        full_path, apex.GetImageOffset().value(), apex.GetImageSize().value());
-    if (ret.ok()) {
-      loopback_device = std::move(*ret);
-      break;
-    }
-    if (attempts >= kLoopDeviceSetupAttempts) {
-      return Error() << "Could not create loop device for " << full_path << ": "
-                     << ret.error();
-    }
-  }
-  LOG(VERBOSE) << "Loopback device created: " << loopback_device.name;
 
   auto& instance = ApexFileRepository::GetInstance();
 
@@ -490,11 +740,6 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
     return Error() << "Failed to verify Apex Verity data for " << full_path
                    << ": " << verity_data.error();
   }
-  std::string block_device = loopback_device.name;
-  MountedApexData apex_data(loopback_device.name, apex.GetPath(), mount_point,
-                            /* device_name = */ "",
-                            /* hashtree_loop_name = */ "",
-                            /* is_temp_mount */ temp_mount);
 
   // for APEXes in immutable partitions, we don't need to mount them on
   // dm-verity because they are already in the dm-verity protected partition;
@@ -503,26 +748,144 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
   const bool mount_on_verity =
       !instance.IsPreInstalledApex(apex) || instance.IsDecompressedApex(apex);
 
+  uint32_t mount_flags = MS_NOATIME | MS_NODEV | MS_DIRSYNC | MS_RDONLY;
+  if (apex.GetManifest().nocode()) {
+    mount_flags |= MS_NOEXEC;
+  }
+
+  if (!apex.GetFsType()) {
+    return Error() << "Cannot mount package without FsType";
+  }
+
+  // Temp mounts are of files still owned by the installer, which must not be
+  // made immutable by fs-verity.
+  if (!temp_mount && CanMountWithoutLoop(apex)) {
+    if (auto st = EnterActivationStage(ActivationStage::kMount); !st.ok()) {
+      return st.error();
+    }
+    auto ret = MountPackageWithoutLoop(apex, *verity_data, mount_point,
+                                       mount_on_verity, mount_flags);
+    if (ret.ok()) {
+      auto time_elapsed =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              boot_clock::now() - time_started).count();
+      LOG(INFO) << "Successfully mounted package " << full_path << " on "
+                << mount_point << " without loop device duration="
+                << time_elapsed;
+      auto status = VerifyMountedImage(apex, mount_point);
+      if (!status.ok()) {
+        if (umount2(mount_point.c_str(), UMOUNT_NOFOLLOW) != 0) {
+          PLOG(ERROR) << "Failed to umount " << mount_point;
+        }
+        return Error() << "Failed to verify " << full_path << ": "
+                       << status.error();
+      }
+      scope_guard.Disable();  // Accept the mount.
+      return *ret;
+    }
+    // Fall back to loop and dm-verity devices, which enforce integrity on
+    // their own.
+    LOG(WARNING) << ret.error();
+  }
+
+  // Data APEXes whose backing file is protected by fs-verity don't need a
+  // dm-verity device on top of the loop device. Only the fs-verity digest is
+  // measured here, the payload was checked when fs-verity was enabled.
+  bool use_dm_verity = mount_on_verity;
+  if (mount_on_verity && ShouldUseFsVerity(apex)) {
+    if (auto st = CheckFsVerity(apex, *verity_data,
+                                GetFsVerityDigestFileName(apex));
+        st.ok()) {
+      use_dm_verity = false;
+    } else {
+      LOG(INFO) << "Using dm-verity for " << full_path << ": " << st.error();
+    }
+  }
+
+  if (auto st = EnterActivationStage(ActivationStage::kLoopDevice); !st.ok()) {
+    return st.error();
+  }
+  loop::LoopbackDeviceUniqueFd loopback_device;
+  for (size_t attempts = 1;; ++attempts) {
+    Result<loop::LoopbackDeviceUniqueFd> ret = loop::CreateLoopDevice(
+        full_path, apex.GetImageOffset().value(), apex.GetImageSize().value());
+    if (ret.ok()) {
+      loopback_device = std::move(*ret);
+      break;
+    }
+    if (attempts >= kLoopDeviceSetupAttempts) {
+      return Error() << "Could not create loop device for " << full_path << ": "
+                     << ret.error();
+    }
+  }
+  LOG(VERBOSE) << "Loopback device created: " << loopback_device.name;
+
+  std::string block_device = loopback_device.name;
+  MountedApexData apex_data(loopback_device.name, apex.GetPath(), mount_point,
+                            /* device_name = */ "",
+                            /* hashtree_loop_name = */ "",
+                            /* is_temp_mount */ temp_mount);
+
   DmVerityDevice verity_dev;
   loop::LoopbackDeviceUniqueFd loop_for_hash;
-  if (mount_on_verity) {
+  // Set once a slot of the hashtree image is used, which is released again if
+  // mounting fails.
+  HashTreeImage* slot_image = nullptr;
+  auto slot_guard = android::base::make_scope_guard([&]() {
+    if (slot_image != nullptr) {
+      slot_image->ReleaseHashTree(device_name);
+    }
+  });
+  if (use_dm_verity) {
+    if (auto st = EnterActivationStage(ActivationStage::kDmVerity); !st.ok()) {
+      return st.error();
+    }
     std::string hash_device = loopback_device.name;
+    uint32_t hash_start_block = 0;
     if (verity_data->desc->tree_size == 0) {
-      if (auto st = PrepareHashTree(apex, *verity_data, hashtree_file);
-          !st.ok()) {
-        return st.error();
+      HashTreeImage* image = temp_mount ? nullptr : GetHashTreeImage();
+      uint32_t hash_block_size = verity_data->desc->hash_block_size;
+      // The hashtree is only generated if the image doesn't hold it already,
+      // and then moved into the image.
+      Result<HashTreeSlot> slot = Error() << "hashtree image is not used";
+      if (image != nullptr) {
+        slot = image->GetHashTree(device_name, verity_data->root_digest,
+                                  hash_block_size);
+      }
+      if (!slot.ok()) {
+        if (auto st = PrepareHashTree(apex, *verity_data, hashtree_file);
+            !st.ok()) {
+          return st.error();
+        }
+        if (image != nullptr) {
+          slot = image->AddHashTree(device_name, verity_data->root_digest,
+                                    hashtree_file, hash_block_size);
+        }
+        if (slot.ok() &&
+            TEMP_FAILURE_RETRY(unlink(hashtree_file.c_str())) != 0) {
+          PLOG(WARNING) << "Failed to unlink " << hashtree_file;
+        }
       }
-      auto create_loop_status = loop::CreateLoopDevice(hashtree_file, 0, 0);
-      if (!create_loop_status.ok()) {
-        return create_loop_status.error();
+      if (slot.ok()) {
+        slot_image = image;
+        hash_device = slot->loop_name;
+        hash_start_block = slot->hash_start_block;
+      } else {
+        LOG(VERBOSE) << "Using dedicated loop device for " << hashtree_file
+                     << ": " << slot.error();
+        auto create_loop_status = loop::CreateLoopDevice(hashtree_file, 0, 0);
+        if (!create_loop_status.ok()) {
+          return create_loop_status.error();
+        }
+        loop_for_hash = std::move(*create_loop_status);
+        hash_device = loop_for_hash.name;
+        apex_data.hashtree_loop_name = hash_device;
       }
-      loop_for_hash = std::move(*create_loop_status);
-      hash_device = loop_for_hash.name;
-      apex_data.hashtree_loop_name = hash_device;
     }
     auto verity_table =
         CreateVerityTable(*verity_data, loopback_device.name, hash_device,
-                          /* restart_on_corruption = */ !verify_image);
+                          /* restart_on_corruption = */ !verify_image,
+                          hash_start_block);
     Result<DmVerityDevice> verity_dev_res =
         CreateVerityDevice(device_name, *verity_table);
     if (!verity_dev_res.ok()) {
@@ -540,21 +903,23 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
     }
   }
   // TODO(b/158467418): consider moving this inside RunVerifyFnInsideTempMount.
-  if (mount_on_verity && verify_image) {
+  if (use_dm_verity && verify_image && IsVerifiedStreamedApex(apex)) {
+    LOG(INFO) << "Not reading " << full_path << " again, its payload was "
+              << "verified when it was staged";
+  } else if (use_dm_verity && verify_image) {
+    if (auto st = EnterActivationStage(ActivationStage::kReadVerity);
+        !st.ok()) {
+      return st.error();
+    }
     Result<void> verity_status =
-        ReadVerityDevice(block_device, (*verity_data).desc->image_size);
+        ReadVerityDeviceWithCheckpoints(apex, *verity_data, block_device);
     if (!verity_status.ok()) {
       return verity_status.error();
     }
   }
 
-  uint32_t mount_flags = MS_NOATIME | MS_NODEV | MS_DIRSYNC | MS_RDONLY;
-  if (apex.GetManifest().nocode()) {
-    mount_flags |= MS_NOEXEC;
-  }
-
-  if (!apex.GetFsType()) {
-    return Error() << "Cannot mount package without FsType";
+  if (auto st = EnterActivationStage(ActivationStage::kMount); !st.ok()) {
+    return st.error();
   }
   if (mount(block_device.c_str(), mount_point.c_str(),
             apex.GetFsType().value().c_str(), mount_flags, nullptr) == 0) {
@@ -574,6 +939,7 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
     verity_dev.Release();
     loopback_device.CloseGood();
     loop_for_hash.CloseGood();
+    slot_guard.Disable();
 
     scope_guard.Disable();  // Accept the mount.
     return apex_data;
@@ -594,13 +960,10 @@ Result<MountedApexData> VerifyAndTempMountPackage(
   const std::string& package_id = GetPackageId(apex.GetManifest());
   LOG(DEBUG) << "Temp mounting " << package_id << " to " << mount_point;
   const std::string& temp_device_name = package_id + ".tmp";
+  // A hashtree left by an interrupted verification is reused if its root
+  // digest still matches, see PrepareHashTree. Lower levels are checked by
+  // dm-verity as the device is read.
   std::string hashtree_file = GetHashTreeFileName(apex, /* is_new = */ true);
-  if (access(hashtree_file.c_str(), F_OK) == 0) {
-    LOG(DEBUG) << hashtree_file << " already exists. Deleting it";
-    if (TEMP_FAILURE_RETRY(unlink(hashtree_file.c_str())) != 0) {
-      return ErrnoError() << "Failed to unlink " << hashtree_file;
-    }
-  }
   auto ret =
       MountPackageImpl(apex, mount_point, temp_device_name, hashtree_file,
                        /* verify_image = */ true, /* temp_mount = */ true);
@@ -609,12 +972,24 @@ Result<MountedApexData> VerifyAndTempMountPackage(
     if (TEMP_FAILURE_RETRY(unlink(hashtree_file.c_str())) != 0) {
       PLOG(ERROR) << "Failed to unlink " << hashtree_file;
     }
+    // A failed or cancelled verification is started over if it is retried.
+    RemoveFileIfExists(GetVerificationCheckpointPath(apex));
   } else {
+    ret->apex_file = std::make_shared<const ApexFile>(apex);
     gMountedApexes.AddMountedApex(apex.GetManifest().name(), false, *ret);
   }
   return ret;
 }
 
+// Returns the apex recorded when |data| was mounted, only opening the file
+// again if it wasn't available at that time.
+Result<ApexFile> GetMountedApexFile(const MountedApexData& data) {
+  if (data.apex_file != nullptr) {
+    return *data.apex_file;
+  }
+  return ApexFile::Open(data.full_path);
+}
+
 }  // namespace
 
 Result<void> Unmount(const MountedApexData& data, bool deferred) {
@@ -656,6 +1031,12 @@ Result<void> Unmount(const MountedApexData& data, bool deferred) {
   if (!data.hashtree_loop_name.empty() && !deferred) {
     loop::DestroyLoopDevice(data.hashtree_loop_name, log_fn);
   }
+  // A deferred dm-verity device may still read its slot of the hashtree image.
+  if (!data.device_name.empty() && !data.is_temp_mount && !deferred) {
+    if (HashTreeImage* image = GetHashTreeImage(); image != nullptr) {
+      image->ReleaseHashTree(data.device_name);
+    }
+  }
 
   return {};
 }
@@ -854,8 +1235,9 @@ Result<std::vector<ApexFile>> VerifyPackages(
 }
 
 Result<ApexFile> VerifySessionDir(const int session_id) {
-  std::string session_dir_path = std::string(kStagedSessionsDir) + "/session_" +
-                                 std::to_string(session_id);
+  std::string session_dir_path =
+      std::string(gConfig->staged_session_dir) + "/session_" +
+      std::to_string(session_id);
   LOG(INFO) << "Scanning " << session_dir_path
             << " looking for packages to be validated";
   Result<std::vector<std::string>> scan =
@@ -877,6 +1259,61 @@ Result<ApexFile> VerifySessionDir(const int session_id) {
   return std::move((*verified)[0]);
 }
 
+// Staged sessions being verified by SubmitStagedSession, so that
+// AbortStagedSession can cancel them.
+std::mutex gVerificationsMutex;
+// Guarded by gVerificationsMutex.
+std::map<int, VerificationCancelFlag> gVerificationsInProgress;
+std::function<void(int)> gSessionVerifiedCallback;
+
+// Verifies the session directories of |session_ids| concurrently. Each
+// verification temp mounts its package and reads it in full, so the number of
+// workers bounds both the temp mounts and the reads in flight at any time.
+// The reads run at low I/O priority, and stop once |cancelled| is set.
+// Results are returned in the order of |session_ids|.
+std::vector<Result<ApexFile>> VerifySessionDirs(
+    const std::vector<int>& session_ids,
+    const VerificationCancelFlag& cancelled) {
+  static constexpr size_t kDefaultVerificationWorkers = 4;
+  size_t worker_num =
+      android::sysprop::ApexProperties::verification_workers().value_or(
+          std::min<size_t>(std::max(get_nprocs_conf() >> 1, 1),
+                           kDefaultVerificationWorkers));
+  worker_num = std::min(std::max<size_t>(worker_num, 1), session_ids.size());
+
+  using android::sysprop::ApexProperties;
+  VerificationIoConfig io_config = {
+      .idle = ApexProperties::verification_io_idle().value_or(false),
+      .max_bytes_per_sec =
+          ApexProperties::verification_max_read_kbps().value_or(0) * 1024,
+  };
+
+  std::vector<std::optional<Result<ApexFile>>> results(session_ids.size());
+  std::atomic<size_t> next_index = 0;
+  auto worker = [&]() {
+    ScopedVerificationIo scoped_io(io_config, cancelled);
+    for (size_t i = next_index++; i < session_ids.size(); i = next_index++) {
+      results[i] = VerifySessionDir(session_ids[i]);
+    }
+  };
+  std::vector<std::future<void>> futures;
+  futures.reserve(worker_num - 1);
+  for (size_t i = 1; i < worker_num; i++) {
+    futures.push_back(std::async(std::launch::async, worker));
+  }
+  worker();
+  for (auto& future : futures) {
+    future.get();
+  }
+
+  std::vector<Result<ApexFile>> ret;
+  ret.reserve(results.size());
+  for (auto& result : results) {
+    ret.push_back(std::move(*result));
+  }
+  return ret;
+}
+
 Result<void> DeleteBackup() {
   auto exists = PathExists(std::string(kApexBackupDir));
   if (!exists.ok()) {
@@ -1050,6 +1487,7 @@ Result<void> MountPackage(const ApexFile& apex, const std::string& mount_point,
     return ret.error();
   }
 
+  ret->apex_file = std::make_shared<const ApexFile>(apex);
   gMountedApexes.AddMountedApex(apex.GetManifest().name(), false, *ret);
   return {};
 }
@@ -1094,15 +1532,7 @@ Result<MountedApexData> GetTempMountedApexData(const std::string& package) {
 }
 
 bool IsMounted(const std::string& full_path) {
-  bool found_mounted = false;
-  gMountedApexes.ForallMountedApexes([&](const std::string&,
-                                         const MountedApexData& data,
-                                         [[maybe_unused]] bool latest) {
-    if (full_path == data.full_path) {
-      found_mounted = true;
-    }
-  });
-  return found_mounted;
+  return gMountedApexes.IsMounted(full_path);
 }
 
 std::string GetPackageMountPoint(const ApexManifest& manifest) {
@@ -1263,7 +1693,7 @@ Result<void> ActivatePackageImpl(const ApexFile& apex_file,
     bool version_found_active = false;
     gMountedApexes.ForallMountedApexes(
         manifest.name(), [&](const MountedApexData& data, bool latest) {
-          Result<ApexFile> other_apex = ApexFile::Open(data.full_path);
+          Result<ApexFile> other_apex = GetMountedApexFile(data);
           if (!other_apex.ok()) {
             return;
           }
@@ -1371,7 +1801,7 @@ std::vector<ApexFile> GetActivePackages() {
           return;
         }
 
-        Result<ApexFile> apex_file = ApexFile::Open(data.full_path);
+        Result<ApexFile> apex_file = GetMountedApexFile(data);
         if (!apex_file.ok()) {
           return;
         }
@@ -1518,10 +1948,25 @@ Result<ApexFile> GetActivePackage(const std::string& packageName) {
  * Returns without error only if session was successfully aborted.
  **/
 Result<void> AbortStagedSession(int session_id) {
+  {
+    std::lock_guard lock(gVerificationsMutex);
+    auto it = gVerificationsInProgress.find(session_id);
+    if (it != gVerificationsInProgress.end()) {
+      LOG(INFO) << "Cancelling verification of session " << session_id;
+      it->second->store(true);
+      return {};
+    }
+  }
+  ForgetStreamedApexes({session_id});
+  RemoveVerificationCheckpoints({session_id});
   auto session = ApexSession::GetSession(session_id);
   if (!session.ok()) {
     return Error() << "No session found with id " << session_id;
   }
+  auto child_ids = session->GetChildSessionIds();
+  std::vector<int> child_session_ids(child_ids.begin(), child_ids.end());
+  ForgetStreamedApexes(child_session_ids);
+  RemoveVerificationCheckpoints(child_session_ids);
   switch (session->GetState()) {
     case SessionState::VERIFIED:
       [[clang::fallthrough]];
@@ -1534,103 +1979,73 @@ Result<void> AbortStagedSession(int session_id) {
 
 namespace {
 
-// TODO(b/179497746): Avoid scanning apex directly here
-// Only used in OnBootstrap. Should we remove this function?
-Result<std::vector<ApexFile>> ScanApexFiles(const char* apex_package_dir,
-                                            bool include_compressed = false) {
-  LOG(INFO) << "Scanning " << apex_package_dir << " looking for APEX packages.";
-  if (access(apex_package_dir, F_OK) != 0 && errno == ENOENT) {
-    LOG(INFO) << "... does not exist. Skipping";
-    return {};
-  }
-  std::vector<std::string> suffix_list = {kApexPackageSuffix};
-  if (include_compressed) {
-    suffix_list.push_back(kCompressedApexPackageSuffix);
-  }
-  Result<std::vector<std::string>> scan =
-      FindFilesBySuffix(apex_package_dir, suffix_list);
-  if (!scan.ok()) {
-    return Error() << "Failed to scan " << apex_package_dir << " : "
-                   << scan.error();
-  }
-  std::vector<ApexFile> ret;
-  for (const auto& name : *scan) {
-    Result<ApexFile> apex_file = ApexFile::Open(name);
-    if (!apex_file.ok()) {
-      LOG(ERROR) << "Failed to scan " << name << " : " << apex_file.error();
-    } else {
-      ret.emplace_back(std::move(*apex_file));
+// Activates apexes on a pool of workers as soon as they are pushed, so that
+// activation can start before every apex to activate is known. If |watchdog|
+// is given, it records deadline overruns, and fails data apexes that overrun.
+class ActivationPipeline {
+ public:
+  ActivationPipeline(bool is_ota_chroot, size_t worker_num,
+                     ActivationWatchdog* watchdog = nullptr)
+      : is_ota_chroot_(is_ota_chroot), watchdog_(watchdog) {
+    workers_.reserve(worker_num);
+    for (size_t i = 0; i < worker_num; i++) {
+      workers_.push_back(std::async(std::launch::async, [this]() { Work(); }));
     }
   }
-  return ret;
-}
 
-std::vector<Result<void>> ActivateApexWorker(
-    bool is_ota_chroot, std::queue<const ApexFile*>& apex_queue,
-    std::mutex& mutex) {
-  std::vector<Result<void>> ret;
+  ~ActivationPipeline() { Close(); }
 
-  while (true) {
-    const ApexFile* apex;
-    {
-      std::lock_guard lock(mutex);
-      if (apex_queue.empty()) break;
-      apex = apex_queue.front();
-      apex_queue.pop();
-    }
+  ActivationPipeline(const ActivationPipeline&) = delete;
+  ActivationPipeline& operator=(const ActivationPipeline&) = delete;
 
-    std::string device_name = GetPackageId(apex->GetManifest());
-    if (is_ota_chroot) {
-      device_name += ".chroot";
-    }
-    if (auto res = ActivatePackageImpl(*apex, device_name); !res.ok()) {
-      ret.push_back(Error() << "Failed to activate " << apex->GetPath() << " : "
-                            << res.error());
-    } else {
-      ret.push_back({});
+  // |apex| must outlive Finish().
+  void Push(const ApexFile& apex) {
+    {
+      std::lock_guard lock(mutex_);
+      queue_.push(&apex);
     }
+    cv_.notify_one();
   }
 
-  return ret;
-}
-
-Result<void> ActivateApexPackages(const std::vector<ApexFileRef>& apexes,
-                                  bool is_ota_chroot) {
-  std::queue<const ApexFile*> apex_queue;
-  std::mutex apex_queue_mutex;
-
-  for (const ApexFile& apex : apexes) {
-    apex_queue.emplace(&apex);
+  // Same as above, for an apex that nothing else keeps around, e.g. one that
+  // was just decompressed.
+  void Push(ApexFile&& apex) {
+    {
+      std::lock_guard lock(mutex_);
+      queue_.push(&owned_.emplace_back(std::move(apex)));
+    }
+    cv_.notify_one();
   }
 
-  // Creates threads as many as half number of cores for the performance.
-  size_t worker_num = std::max(get_nprocs_conf() >> 1, 1);
-  worker_num = std::min(apex_queue.size(), worker_num);
-
-  // On -eng builds there might be two different pre-installed art apexes.
-  // Attempting to activate them in parallel will result in UB (e.g.
-  // apexd-bootstrap might crash). In order to avoid this, for the time being on
-  // -eng builds activate apexes sequentially.
-  // TODO(b/176497601): remove this.
-  if (GetProperty("ro.build.type", "") == "eng") {
-    worker_num = 1;
-  }
+  // Waits until every apex pushed so far is activated. Nothing can be pushed
+  // afterwards. Apexes failed by |watchdog_| are left out of the result, as
+  // they are replaced by their pre-installed version rather than treated as
+  // a failed activation.
+  Result<void> Finish() {
+    Close();
+    for (auto& worker : workers_) {
+      worker.get();
+    }
+    workers_.clear();
 
-  std::vector<std::future<std::vector<Result<void>>>> futures;
-  futures.reserve(worker_num);
-  for (size_t i = 0; i < worker_num; i++) {
-    futures.push_back(std::async(std::launch::async, ActivateApexWorker,
-                                 std::ref(is_ota_chroot), std::ref(apex_queue),
-                                 std::ref(apex_queue_mutex)));
-  }
+    std::unordered_set<std::string> overrun_packages;
+    if (watchdog_ != nullptr) {
+      for (const auto& overrun : watchdog_->GetOverruns()) {
+        if (overrun.failed) {
+          overrun_packages.insert(overrun.package);
+        }
+      }
+    }
 
-  size_t activated_cnt = 0;
-  size_t failed_cnt = 0;
-  std::string error_message;
-  for (size_t i = 0; i < futures.size(); i++) {
-    for (const auto& res : futures[i].get()) {
+    size_t activated_cnt = 0;
+    size_t failed_cnt = 0;
+    std::string error_message;
+    std::lock_guard lock(mutex_);
+    for (const auto& [path, res] : results_) {
       if (res.ok()) {
         ++activated_cnt;
+      } else if (overrun_packages.count(path) != 0) {
+        LOG(ERROR) << res.error();
       } else {
         ++failed_cnt;
         LOG(ERROR) << res.error();
@@ -1639,14 +2054,127 @@ Result<void> ActivateApexPackages(const std::vector<ApexFileRef>& apexes,
         }
       }
     }
+
+    if (failed_cnt > 0) {
+      return Error() << "Failed to activate " << failed_cnt
+                     << " APEX packages. One of the errors: " << error_message;
+    }
+    LOG(INFO) << "Activated " << activated_cnt << " packages.";
+    return {};
+  }
+
+ private:
+  void Close() {
+    {
+      std::lock_guard lock(mutex_);
+      closed_ = true;
+    }
+    cv_.notify_all();
   }
 
-  if (failed_cnt > 0) {
-    return Error() << "Failed to activate " << failed_cnt
-                   << " APEX packages. One of the errors: " << error_message;
+  void Work() {
+    while (true) {
+      const ApexFile* apex;
+      {
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [this]() { return closed_ || !queue_.empty(); });
+        if (queue_.empty()) break;
+        apex = queue_.front();
+        queue_.pop();
+      }
+
+      std::string device_name = GetPackageId(apex->GetManifest());
+      if (is_ota_chroot_) {
+        device_name += ".chroot";
+      }
+      Result<void> ret;
+      // Only a data APEX can fall back to the pre-installed one if it is
+      // failed for overrunning a deadline.
+      const auto& instance = ApexFileRepository::GetInstance();
+      bool has_fallback = !instance.IsPreInstalledApex(*apex) &&
+                          !instance.IsDecompressedApex(*apex);
+      ScopedActivationDeadline deadline(watchdog_, apex->GetPath(),
+                                        has_fallback);
+      if (auto res = ActivatePackageImpl(*apex, device_name); !res.ok()) {
+        ret = Error() << "Failed to activate " << apex->GetPath() << " : "
+                      << res.error();
+      }
+      std::lock_guard lock(mutex_);
+      results_.emplace_back(apex->GetPath(), std::move(ret));
+    }
+  }
+
+  const bool is_ota_chroot_;
+  ActivationWatchdog* const watchdog_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Guarded by mutex_.
+  std::queue<const ApexFile*> queue_;
+  // Apexes pushed by value. A deque never moves its elements when growing.
+  // Guarded by mutex_.
+  std::deque<ApexFile> owned_;
+  // Guarded by mutex_.
+  bool closed_ = false;
+  // Results by apex path. Guarded by mutex_.
+  std::vector<std::pair<std::string, Result<void>>> results_;
+  // Last, so that the workers are joined before anything they use goes away.
+  std::vector<std::future<void>> workers_;
+};
+
+std::optional<ActivationDeadlines> gActivationDeadlinesForTesting;
+
+// Deadlines of the stages of activation in OnStart. They are far above what a
+// stage normally takes, so that only packages that are stuck get failed.
+ActivationDeadlines GetActivationDeadlines() {
+  using namespace std::chrono_literals;
+  if (gActivationDeadlinesForTesting.has_value()) {
+    return *gActivationDeadlinesForTesting;
   }
-  LOG(INFO) << "Activated " << activated_cnt << " packages.";
-  return {};
+  if (auto deadline_ms =
+          android::sysprop::ApexProperties::activation_stage_deadline_ms();
+      deadline_ms.has_value()) {
+    // 0 turns the deadlines off.
+    if (*deadline_ms == 0) {
+      return {};
+    }
+    ActivationDeadlines deadlines;
+    for (auto stage : {ActivationStage::kVerifyPayload,
+                       ActivationStage::kLoopDevice, ActivationStage::kDmVerity,
+                       ActivationStage::kReadVerity, ActivationStage::kMount}) {
+      deadlines[stage] = std::chrono::milliseconds(*deadline_ms);
+    }
+    return deadlines;
+  }
+  return {
+      {ActivationStage::kVerifyPayload, 30s},
+      {ActivationStage::kLoopDevice, 10s},
+      {ActivationStage::kDmVerity, 30s},
+      {ActivationStage::kReadVerity, 60s},
+      {ActivationStage::kMount, 10s},
+  };
+}
+
+// Creates threads as many as half number of cores for the performance.
+size_t GetActivationWorkerNum() {
+  // On -eng builds there might be two different pre-installed art apexes.
+  // Attempting to activate them in parallel will result in UB (e.g.
+  // apexd-bootstrap might crash). In order to avoid this, for the time being on
+  // -eng builds activate apexes sequentially.
+  // TODO(b/176497601): remove this.
+  if (GetProperty("ro.build.type", "") == "eng") {
+    return 1;
+  }
+  return std::max(get_nprocs_conf() >> 1, 1);
+}
+
+Result<void> ActivateApexPackages(const std::vector<ApexFileRef>& apexes,
+                                  bool is_ota_chroot) {
+  ActivationPipeline pipeline(
+      is_ota_chroot, std::min(apexes.size(), GetActivationWorkerNum()));
+  for (const ApexFile& apex : apexes) {
+    pipeline.Push(apex);
+  }
+  return pipeline.Finish();
 }
 
 // A fallback function in case some of the apexes failed to activate. For all
@@ -2257,24 +2785,24 @@ Result<void> RevertActiveSessions(const std::string& crashing_native_process,
     if (!error_message.empty()) {
       session.SetErrorMessage(error_message);
     }
-    auto status =
-        session.UpdateStateAndCommit(SessionState::REVERT_IN_PROGRESS);
-    if (!status.ok()) {
-      return Error() << "Revert of session " << session
-                     << " failed : " << status.error();
-    }
+  }
+  // All sessions move to the next state in a single journal record, so a
+  // crash can't leave them in different states.
+  auto status = ApexSession::UpdateStateAndCommitAll(
+      active_sessions, SessionState::REVERT_IN_PROGRESS);
+  if (!status.ok()) {
+    return Error() << "Revert of active sessions failed : " << status.error();
   }
 
   if (!gSupportsFsCheckpoints) {
     auto restore_status = RestoreActivePackages();
     if (!restore_status.ok()) {
-      for (auto& session : active_sessions) {
-        auto st = session.UpdateStateAndCommit(SessionState::REVERT_FAILED);
-        LOG(DEBUG) << "Marking " << session << " as failed to revert";
-        if (!st.ok()) {
-          LOG(WARNING) << "Failed to mark session " << session
-                       << " as failed to revert : " << st.error();
-        }
+      LOG(DEBUG) << "Marking active sessions as failed to revert";
+      auto st = ApexSession::UpdateStateAndCommitAll(
+          active_sessions, SessionState::REVERT_FAILED);
+      if (!st.ok()) {
+        LOG(WARNING) << "Failed to mark active sessions as failed to revert : "
+                     << st.error();
       }
       return restore_status;
     }
@@ -2288,12 +2816,12 @@ Result<void> RevertActiveSessions(const std::string& crashing_native_process,
       // pre-restore snapshot.
       RestoreDePreRestoreSnapshotsIfPresent(session);
     }
-
-    auto status = session.UpdateStateAndCommit(SessionState::REVERTED);
-    if (!status.ok()) {
-      LOG(WARNING) << "Failed to mark session " << session
-                   << " as reverted : " << status.error();
-    }
+  }
+  status = ApexSession::UpdateStateAndCommitAll(active_sessions,
+                                                SessionState::REVERTED);
+  if (!status.ok()) {
+    LOG(WARNING) << "Failed to mark active sessions as reverted : "
+                 << status.error();
   }
 
   return {};
@@ -2350,11 +2878,9 @@ Result<void> CreateSharedLibsApexDir() {
 
 int OnBootstrap() {
   auto time_started = boot_clock::now();
-  Result<void> pre_allocate = PreAllocateLoopDevices();
-  if (!pre_allocate.ok()) {
-    LOG(ERROR) << "Failed to pre-allocate loop devices : "
-               << pre_allocate.error();
-  }
+  // Pre-allocating loop devices mostly waits for the kernel, so it overlaps
+  // with opening the pre-installed APEXes.
+  auto pre_allocate = std::async(std::launch::async, PreAllocateLoopDevices);
 
   ApexFileRepository& instance = ApexFileRepository::GetInstance();
   static const std::vector<std::string> kBootstrapApexDirs{
@@ -2364,6 +2890,13 @@ int OnBootstrap() {
     LOG(ERROR) << "Failed to collect APEX keys : " << status.error();
     return 1;
   }
+  // Lets the main apexd skip opening these apexes again.
+  if (auto st = instance.WritePreInstalledCache(
+          StringPrintf("%s/%s", kApexRoot, kPreInstalledApexCache));
+      !st.ok()) {
+    LOG(WARNING) << "Failed to cache pre-installed APEX files : "
+                 << st.error();
+  }
 
   // Create directories for APEX shared libraries.
   auto sharedlibs_apex_dir = CreateSharedLibsApexDir();
@@ -2372,26 +2905,20 @@ int OnBootstrap() {
     return 1;
   }
 
-  // Find all bootstrap apexes
-  std::vector<ApexFile> bootstrap_apexes;
-  for (const auto& dir : kBootstrapApexDirs) {
-    auto scan = ScanApexFiles(dir.c_str());
-    if (!scan.ok()) {
-      LOG(ERROR) << "Failed to scan APEX files in " << dir << " : "
-                 << scan.error();
-      return 1;
+  // Find all bootstrap apexes among the ones the repository already opened.
+  std::vector<ApexFileRef> bootstrap_apexes;
+  for (const ApexFile& apex : instance.GetPreInstalledApexFiles()) {
+    if (!apex.IsCompressed() && IsBootstrapApex(apex)) {
+      bootstrap_apexes.emplace_back(std::cref(apex));
     }
-    std::copy_if(std::make_move_iterator(scan->begin()),
-                 std::make_move_iterator(scan->end()),
-                 std::back_inserter(bootstrap_apexes), IsBootstrapApex);
+  }
+
+  if (auto st = pre_allocate.get(); !st.ok()) {
+    LOG(ERROR) << "Failed to pre-allocate loop devices : " << st.error();
   }
 
   // Now activate bootstrap apexes.
-  std::vector<ApexFileRef> bootstrap_apexes_ref;
-  std::transform(bootstrap_apexes.begin(), bootstrap_apexes.end(),
-                 std::back_inserter(bootstrap_apexes_ref),
-                 [](const auto& x) { return std::cref(x); });
-  auto ret = ActivateApexPackages(bootstrap_apexes_ref,
+  auto ret = ActivateApexPackages(bootstrap_apexes,
                                   /* is_ota_chroot= */ false);
   if (!ret.ok()) {
     LOG(ERROR) << "Failed to activate bootstrap apex files : " << ret.error();
@@ -2438,15 +2965,32 @@ void InitializeVold(CheckpointInterface* checkpoint_service) {
 void Initialize(CheckpointInterface* checkpoint_service) {
   InitializeVold(checkpoint_service);
   ApexFileRepository& instance = ApexFileRepository::GetInstance();
-  Result<void> status = instance.AddPreInstalledApex(kApexPackageBuiltinDirs);
+  Result<void> status = instance.AddPreInstalledApex(
+      kApexPackageBuiltinDirs,
+      StringPrintf("%s/%s", kApexRoot, kPreInstalledApexCache));
   if (!status.ok()) {
     LOG(ERROR) << "Failed to collect pre-installed APEX files : "
                << status.error();
     return;
   }
-  gMountedApexes.PopulateFromMounts(gConfig->active_apex_data_dir,
-                                    gConfig->decompression_dir,
-                                    gConfig->apex_hash_tree_dir);
+  // When apexd restarts after boot, the database it persisted is still valid,
+  // unless something was mounted or unmounted since.
+  std::string snapshot_path =
+      StringPrintf("%s/%s", kApexRoot, kMountDatabaseSnapshot);
+  if (auto st = gMountedApexes.LoadFromSnapshot(snapshot_path); !st.ok()) {
+    LOG(INFO) << "Not restoring APEX database: " << st.error();
+    gMountedApexes.PopulateFromMounts(gConfig->active_apex_data_dir,
+                                      gConfig->decompression_dir,
+                                      gConfig->apex_hash_tree_dir);
+  }
+  // Created before anything is activated, so that only the packages mounted by
+  // a previous apexd are taken to reference the hashtree image.
+  GetHashTreeImage();
+  // While booting, the database is only persisted once all packages are
+  // activated, see OnAllPackagesActivated.
+  if (!ApexdLifecycle::GetInstance().IsBooting()) {
+    gMountedApexes.PersistTo(snapshot_path);
+  }
 }
 
 // Note: Pre-installed apex are initialized in Initialize(CheckpointInterface*)
@@ -2582,8 +3126,52 @@ Result<ApexFile> OpenAndValidateDecompressedApex(const ApexFile& capex,
   return std::move(*apex);
 }
 
+// Returns a decompressed APEX of the same package as |capex|, e.g. of a
+// previous version, from which unchanged chunks can be reused. Returns an empty
+// string if there is none, or if |capex| can't reuse chunks.
+std::string FindDecompressedApexToReuse(const ApexFile& capex) {
+  if (capex.GetManifest().capexmetadata().chunkdigests().empty()) {
+    return "";
+  }
+  auto decompressed_apexes = FindFilesBySuffix(
+      gConfig->decompression_dir, {kDecompressedApexPackageSuffix});
+  if (!decompressed_apexes.ok()) {
+    return "";
+  }
+  const std::string prefix = capex.GetManifest().name() + "@";
+  for (const auto& path : *decompressed_apexes) {
+    if (StartsWith(std::filesystem::path(path).filename().string(), prefix)) {
+      return path;
+    }
+  }
+  return "";
+}
+
 // Process a single compressed APEX. Returns the decompressed APEX if
 // successful.
+// Held while ota_apex files are produced or removed, so that
+// RemoveProcessedOtaApex doesn't remove one that the pre-reboot decompression
+// is still working on. Taken before gReservedSpaceMutex.
+std::mutex gOtaApexMutex;
+// Held while the reserved space directory is changed.
+std::mutex gReservedSpaceMutex;
+
+// Removes everything in the reserved space directory except reservations of
+// individual packages, e.g. an aggregate reservation made by an older caller.
+// Those packages might be decompressed in parallel, so their space is kept.
+void ReleaseUnclaimedReservedSpace() {
+  auto files = ReadDir(gConfig->ota_reserved_dir, [](auto _) { return true; });
+  if (!files.ok()) {
+    LOG(ERROR) << "Failed to clean up reserved space: " << files.error();
+    return;
+  }
+  for (const auto& file_path : *files) {
+    if (!EndsWith(file_path, kReservedSpaceSuffix)) {
+      RemoveFileIfExists(file_path);
+    }
+  }
+}
+
 Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
                                        bool is_ota_chroot) {
   LOG(INFO) << "Processing compressed APEX " << capex.GetPath();
@@ -2603,10 +3191,14 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
     }
     // Do not delete existing decompressed APEX when is_ota_chroot is true
     if (!is_ota_chroot) {
-      // Existing decompressed APEX is not valid. We will have to redecompress
+      // Existing decompressed APEX is not valid. We will have to redecompress,
+      // but what didn't change in it can still be reused.
       LOG(WARNING) << "Existing decompressed APEX is invalid: "
                    << result.error();
-      RemoveFileIfExists(decompressed_apex_path);
+      auto old_apex_path = decompressed_apex_path + ".old";
+      if (rename(decompressed_apex_path.c_str(), old_apex_path.c_str()) != 0) {
+        RemoveFileIfExists(decompressed_apex_path);
+      }
     }
   }
 
@@ -2661,17 +3253,51 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
 
   // There was no way to avoid decompression
 
-  // Clean up reserved space before decompressing capex
-  if (auto ret = DeleteDirContent(gConfig->ota_reserved_dir); !ret.ok()) {
-    LOG(ERROR) << "Failed to clean up reserved space: " << ret.error();
-  }
-
   auto decompression_dest =
       is_ota_chroot ? ota_apex_path : decompressed_apex_path;
-  auto scope_guard = android::base::make_scope_guard(
-      [&]() { RemoveFileIfExists(decompression_dest); });
+  // Decompress into the space reserved for this package, if any. It is first
+  // claimed by moving it next to |decompression_dest|, so that it isn't
+  // released when another CAPEX without a reservation needs the space.
+  std::string reserved_path;
+  {
+    // Several CAPEXes might be decompressed in parallel.
+    std::lock_guard lock(gReservedSpaceMutex);
+    auto package_reserved_path = GetReservedSpacePath(
+        gConfig->ota_reserved_dir, capex.GetManifest().name());
+    auto claimed_path = decompression_dest + kReservedSpaceSuffix;
+    if (rename(package_reserved_path.c_str(), claimed_path.c_str()) == 0) {
+      LOG(INFO) << "Decompressing into space reserved for "
+                << capex.GetManifest().name();
+      reserved_path = std::move(claimed_path);
+    } else {
+      // Nothing reserved for this package. Release the space that isn't set
+      // aside for another package before decompressing capex.
+      ReleaseUnclaimedReservedSpace();
+    }
+  }
 
-  auto decompression_result = capex.Decompress(decompression_dest);
+  auto scope_guard = android::base::make_scope_guard([&]() {
+    RemoveFileIfExists(decompression_dest);
+    if (!reserved_path.empty()) {
+      RemoveFileIfExists(reserved_path);
+    }
+  });
+
+  // Build the new decompressed APEX out of an older one where possible, which
+  // saves writing the chunks that didn't change.
+  auto old_apex_path = decompressed_apex_path + ".old";
+  auto old_apex_guard = android::base::make_scope_guard(
+      [&]() { RemoveFileIfExists(old_apex_path); });
+  auto base_path = access(old_apex_path.c_str(), F_OK) == 0
+                       ? old_apex_path
+                       : FindDecompressedApexToReuse(capex);
+
+  // The hashtree of the payload is computed while decompressing it, so it is
+  // written where activation looks for it rather than generated again there.
+  auto hashtree_path =
+      is_ota_chroot ? "" : GetHashTreeFileName(capex, /* is_new= */ false);
+  auto decompression_result = capex.Decompress(
+      decompression_dest, reserved_path, base_path, hashtree_path);
   if (!decompression_result.ok()) {
     return Error() << "Failed to decompress : " << capex.GetPath().c_str()
                    << " " << decompression_result.error();
@@ -2696,6 +3322,39 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
   scope_guard.Disable();
   return return_apex;
 }
+
+// Each element of |capex_queue| lists the indices in |capexes| that share a
+// package id, and thus a decompression path. They are processed in order by a
+// single worker.
+void ProcessCompressedApexWorker(
+    bool is_ota_chroot, const std::vector<const ApexFile*>& capexes,
+    std::queue<std::vector<size_t>>& capex_queue, std::mutex& mutex,
+    std::vector<std::optional<ApexFile>>& decompressed_apexes,
+    const std::function<void(const ApexFile&)>& on_decompressed) {
+  while (true) {
+    std::vector<size_t> indices;
+    {
+      std::lock_guard lock(mutex);
+      if (capex_queue.empty()) break;
+      indices = std::move(capex_queue.front());
+      capex_queue.pop();
+    }
+
+    for (size_t index : indices) {
+      auto decompressed_apex =
+          ProcessCompressedApex(*capexes[index], is_ota_chroot);
+      if (!decompressed_apex.ok()) {
+        LOG(ERROR) << "Failed to process compressed APEX: "
+                   << decompressed_apex.error();
+        continue;
+      }
+      decompressed_apexes[index].emplace(std::move(*decompressed_apex));
+      if (on_decompressed) {
+        on_decompressed(*decompressed_apexes[index]);
+      }
+    }
+  }
+}
 }  // namespace
 
 /**
@@ -2705,22 +3364,54 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
  * Returns list of decompressed APEX.
  */
 std::vector<ApexFile> ProcessCompressedApex(
-    const std::vector<ApexFileRef>& compressed_apex, bool is_ota_chroot) {
+    const std::vector<ApexFileRef>& compressed_apex, bool is_ota_chroot,
+    const std::function<void(const ApexFile&)>& on_decompressed) {
   LOG(INFO) << "Processing compressed APEX";
 
-  std::vector<ApexFile> decompressed_apex_list;
+  std::vector<const ApexFile*> capexes;
+  std::map<std::string, std::vector<size_t>> indices_by_package_id;
   for (const ApexFile& capex : compressed_apex) {
     if (!capex.IsCompressed()) {
       continue;
     }
+    indices_by_package_id[GetPackageId(capex.GetManifest())].push_back(
+        capexes.size());
+    capexes.push_back(&capex);
+  }
+  std::queue<std::vector<size_t>> capex_queue;
+  std::mutex capex_queue_mutex;
+  for (auto& [_, indices] : indices_by_package_id) {
+    capex_queue.push(std::move(indices));
+  }
 
-    auto decompressed_apex = ProcessCompressedApex(capex, is_ota_chroot);
-    if (decompressed_apex.ok()) {
+  // Decompression is mostly CPU bound, so use half of the cores, same as
+  // ActivateApexPackages. Beyond a few writers the storage becomes the
+  // bottleneck, so cap the number of workers.
+  static constexpr size_t kMaxDecompressionWorkers = 4;
+  size_t worker_num = std::max(get_nprocs_conf() >> 1, 1);
+  worker_num =
+      std::min({capex_queue.size(), worker_num, kMaxDecompressionWorkers});
+
+  std::vector<std::optional<ApexFile>> decompressed_apexes(capexes.size());
+  std::vector<std::future<void>> futures;
+  futures.reserve(worker_num);
+  for (size_t i = 0; i < worker_num; i++) {
+    futures.push_back(std::async(
+        std::launch::async, ProcessCompressedApexWorker, is_ota_chroot,
+        std::cref(capexes), std::ref(capex_queue),
+        std::ref(capex_queue_mutex), std::ref(decompressed_apexes),
+        std::cref(on_decompressed)));
+  }
+  for (auto& future : futures) {
+    future.get();
+  }
+
+  // Keep the order of |compressed_apex|.
+  std::vector<ApexFile> decompressed_apex_list;
+  for (auto& decompressed_apex : decompressed_apexes) {
+    if (decompressed_apex.has_value()) {
       decompressed_apex_list.emplace_back(std::move(*decompressed_apex));
-      continue;
     }
-    LOG(ERROR) << "Failed to process compressed APEX: "
-               << decompressed_apex.error();
   }
   return std::move(decompressed_apex_list);
 }
@@ -2751,6 +3442,168 @@ Result<void> ValidateDecompressedApex(const ApexFile& capex,
   return {};
 }
 
+namespace {
+
+std::mutex gPreRebootDecompressionMutex;
+// Guarded by gPreRebootDecompressionMutex.
+PreRebootDecompressionStatus gPreRebootDecompressionStatus;
+std::shared_future<void> gPreRebootDecompressionFuture;
+std::atomic<bool> gPreRebootDecompressionCancelled = false;
+std::function<void(const std::string&)> gPreRebootDecompressionCallback;
+
+// Lowers the CPU and I/O priority of the calling thread, and of the threads it
+// starts, so that it doesn't compete with the foreground workload.
+void LowerThreadPriority() {
+  static constexpr int kBackgroundNice = 10;
+  if (setpriority(PRIO_PROCESS, 0, kBackgroundNice) != 0) {
+    PLOG(WARNING) << "Failed to lower CPU priority";
+  }
+  if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+              IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) != 0) {
+    PLOG(WARNING) << "Failed to lower I/O priority";
+  }
+}
+
+// Processes the CAPEX at |capex_path| as in otapreopt_chroot, which reuses an
+// ota_apex that is already there, and otherwise produces one.
+Result<void> DecompressForNextBoot(const std::string& capex_path) {
+  auto capex = ApexFile::Open(capex_path);
+  if (!capex.ok()) {
+    return capex.error();
+  }
+  if (!capex->IsCompressed()) {
+    return Error() << capex_path << " is not a compressed APEX";
+  }
+  if (auto apex = ProcessCompressedApex(*capex, /* is_ota_chroot= */ true);
+      !apex.ok()) {
+    return apex.error();
+  }
+  return {};
+}
+
+void PreRebootDecompressionWorker(std::vector<std::string> capex_paths) {
+  LowerThreadPriority();
+  bool cancelled = false;
+  for (const auto& path : capex_paths) {
+    if (gPreRebootDecompressionCancelled) {
+      LOG(INFO) << "Pre-reboot decompression cancelled";
+      cancelled = true;
+      break;
+    }
+    {
+      std::lock_guard lock(gPreRebootDecompressionMutex);
+      gPreRebootDecompressionStatus.current_capex_path = path;
+    }
+    Result<void> result;
+    {
+      std::lock_guard ota_apex_lock(gOtaApexMutex);
+      result = DecompressForNextBoot(path);
+    }
+    {
+      std::lock_guard lock(gPreRebootDecompressionMutex);
+      if (result.ok()) {
+        gPreRebootDecompressionStatus.completed_count++;
+      } else {
+        LOG(ERROR) << "Failed to decompress " << path << " : "
+                   << result.error();
+        gPreRebootDecompressionStatus.failed_count++;
+      }
+    }
+    if (gPreRebootDecompressionCallback) {
+      gPreRebootDecompressionCallback(path);
+    }
+  }
+  std::lock_guard lock(gPreRebootDecompressionMutex);
+  gPreRebootDecompressionStatus.is_running = false;
+  gPreRebootDecompressionStatus.is_cancelled = cancelled;
+  gPreRebootDecompressionStatus.current_capex_path.clear();
+}
+
+}  // namespace
+
+Result<void> StartPreRebootDecompression(std::vector<std::string> capex_paths) {
+  std::lock_guard lock(gPreRebootDecompressionMutex);
+  if (gPreRebootDecompressionStatus.is_running) {
+    return Error() << "Pre-reboot decompression is already running";
+  }
+  LOG(INFO) << "Starting pre-reboot decompression of " << capex_paths.size()
+            << " CAPEXes";
+  gPreRebootDecompressionStatus = {.total_count = capex_paths.size(),
+                                   .is_running = true};
+  gPreRebootDecompressionCancelled = false;
+  gPreRebootDecompressionFuture =
+      std::async(std::launch::async, PreRebootDecompressionWorker,
+                 std::move(capex_paths))
+          .share();
+  return {};
+}
+
+PreRebootDecompressionStatus GetPreRebootDecompressionStatus() {
+  std::lock_guard lock(gPreRebootDecompressionMutex);
+  return gPreRebootDecompressionStatus;
+}
+
+void CancelPreRebootDecompression() {
+  gPreRebootDecompressionCancelled = true;
+}
+
+void WaitForPreRebootDecompression() {
+  std::shared_future<void> future;
+  {
+    std::lock_guard lock(gPreRebootDecompressionMutex);
+    future = gPreRebootDecompressionFuture;
+  }
+  if (future.valid()) {
+    future.wait();
+  }
+}
+
+namespace {
+
+// Returns the pre-installed apexes that get selected for activation whatever
+// is on |data_dir|, which is listed without opening anything: apexd names the
+// apexes it installs there after their package id, so that only the packages
+// named by those files can have a data version. Returns nothing if anything
+// else is there.
+std::vector<ApexFileRef> SelectApexForEarlyActivation(
+    const ApexFileRepository& instance, const std::string& data_dir) {
+  std::unordered_set<std::string> data_packages;
+  auto data_dir_exists = PathExists(data_dir);
+  if (!data_dir_exists.ok()) {
+    return {};
+  }
+  if (*data_dir_exists) {
+    auto data_apexes = FindFilesBySuffix(data_dir, {kApexPackageSuffix});
+    if (!data_apexes.ok()) {
+      return {};
+    }
+    for (const auto& path : *data_apexes) {
+      std::string name = std::filesystem::path(path).filename();
+      auto at = name.find('@');
+      if (at == std::string::npos) {
+        LOG(INFO) << "Not activating any APEX early because of " << path;
+        return {};
+      }
+      data_packages.insert(name.substr(0, at));
+    }
+  }
+
+  std::vector<ApexFileRef> ret;
+  for (const ApexFile& apex : instance.GetPreInstalledApexFiles()) {
+    const ApexManifest& manifest = apex.GetManifest();
+    // Compressed apexes are activated as soon as they are decompressed
+    // instead, and shared libs apexes might need their data version as well.
+    if (apex.IsCompressed() || manifest.providesharedapexlibs() ||
+        data_packages.count(manifest.name()) != 0) {
+      continue;
+    }
+    ret.emplace_back(std::cref(apex));
+  }
+  return ret;
+}
+
+}  // namespace
+
 void OnStart() {
   LOG(INFO) << "Marking APEXd as starting";
   auto time_started = boot_clock::now();
@@ -2784,42 +3637,68 @@ void OnStart() {
   // If there is any new apex to be installed on /data/app-staging, hardlink
   // them to /data/apex/active first.
   ScanStagedSessionsDirAndStage();
-  if (auto status = ApexFileRepository::GetInstance().AddDataApex(
-          gConfig->active_apex_data_dir);
-      !status.ok()) {
-    LOG(ERROR) << "Failed to collect data APEX files : " << status.error();
-  }
-
+  // Finish any revert before looking at /data/apex/active, as it changes it.
   auto status = ResumeRevertIfNeeded();
   if (!status.ok()) {
     LOG(ERROR) << "Failed to resume revert : " << status.error();
   }
 
-  // Group every ApexFile on device by name
+  // Packages that overrun a deadline are failed, and thus replaced by their
+  // pre-installed version by ActivateMissingApexes.
+  ActivationWatchdog watchdog(GetActivationDeadlines());
+  // Activation runs as a pipeline: each apex is pushed as soon as it is known
+  // to be activated, so that mounting overlaps with scanning /data and with
+  // decompressing CAPEXes.
   const auto& instance = ApexFileRepository::GetInstance();
+  ActivationPipeline pipeline(/* is_ota_chroot= */ false,
+                              GetActivationWorkerNum(), &watchdog);
+  std::unordered_set<const ApexFile*> activated_early;
+  for (const ApexFile& apex :
+       SelectApexForEarlyActivation(instance, gConfig->active_apex_data_dir)) {
+    activated_early.insert(&apex);
+    pipeline.Push(apex);
+  }
+  LOG(INFO) << "Activating " << activated_early.size()
+            << " pre-installed APEX early";
+
+  if (auto st = ApexFileRepository::GetInstance().AddDataApex(
+          gConfig->active_apex_data_dir);
+      !st.ok()) {
+    LOG(ERROR) << "Failed to collect data APEX files : " << st.error();
+  }
+
+  // Group every ApexFile on device by name
   const auto& all_apex = instance.AllApexFilesByName();
   // There can be multiple APEX packages with package name X. Determine which
   // one to activate.
   auto activation_list = SelectApexForActivation(all_apex, instance);
 
-  // Process compressed APEX, if any
   std::vector<ApexFileRef> compressed_apex;
-  for (auto it = activation_list.begin(); it != activation_list.end();) {
-    if (it->get().IsCompressed()) {
-      compressed_apex.emplace_back(*it);
-      it = activation_list.erase(it);
+  std::vector<ApexFileRef> remaining_apex;
+  for (const auto& apex : activation_list) {
+    if (apex.get().IsCompressed()) {
+      compressed_apex.emplace_back(apex);
+    } else if (activated_early.erase(&apex.get()) == 0) {
+      remaining_apex.emplace_back(apex);
+    }
+  }
+  // What is left in |activated_early| lost to an apex on /data that wasn't
+  // named after its package. It must be unmounted before the one that was
+  // selected instead can be activated.
+  std::unordered_set<std::string> misselected_packages;
+  for (const ApexFile* apex : activated_early) {
+    LOG(WARNING) << apex->GetPath() << " was activated early by mistake";
+    misselected_packages.insert(apex->GetManifest().name());
+  }
+  std::vector<ApexFileRef> deferred_apex;
+  for (auto it = remaining_apex.begin(); it != remaining_apex.end();) {
+    if (misselected_packages.count(it->get().GetManifest().name()) != 0) {
+      deferred_apex.emplace_back(*it);
+      it = remaining_apex.erase(it);
     } else {
       it++;
     }
   }
-  std::vector<ApexFile> decompressed_apex;
-  if (!compressed_apex.empty()) {
-    decompressed_apex =
-        ProcessCompressedApex(compressed_apex, /* is_ota_chroot= */ false);
-    for (const ApexFile& apex_file : decompressed_apex) {
-      activation_list.emplace_back(std::cref(apex_file));
-    }
-  }
 
   int data_apex_cnt = std::count_if(
       activation_list.begin(), activation_list.end(), [](const auto& a) {
@@ -2833,9 +3712,51 @@ void OnStart() {
     }
   }
 
-  // TODO(b/179248390): activate parallelly if possible
-  auto activate_status =
-      ActivateApexPackages(activation_list, /* is_ota_chroot= */ false);
+  for (const ApexFile& apex : remaining_apex) {
+    pipeline.Push(apex);
+  }
+  // Process compressed APEX, if any
+  std::vector<ApexFile> decompressed_apex;
+  if (!compressed_apex.empty()) {
+    decompressed_apex = ProcessCompressedApex(
+        compressed_apex, /* is_ota_chroot= */ false,
+        [&pipeline](const ApexFile& apex) { pipeline.Push(ApexFile(apex)); });
+    activation_list.erase(
+        std::remove_if(activation_list.begin(), activation_list.end(),
+                       [](const auto& a) { return a.get().IsCompressed(); }),
+        activation_list.end());
+    for (const ApexFile& apex_file : decompressed_apex) {
+      activation_list.emplace_back(std::cref(apex_file));
+    }
+  }
+
+  auto activate_status = pipeline.Finish();
+  if (!activated_early.empty()) {
+    for (const ApexFile* apex : activated_early) {
+      if (auto st = UnmountPackage(*apex, /* allow_latest= */ true,
+                                   /* deferred= */ false);
+          !st.ok()) {
+        LOG(ERROR) << "Failed to unmount " << apex->GetPath() << " : "
+                   << st.error();
+      }
+    }
+    auto deferred_status =
+        ActivateApexPackages(deferred_apex, /* is_ota_chroot= */ false);
+    if (activate_status.ok()) {
+      activate_status = std::move(deferred_status);
+    }
+  }
+  // Packages failed for overrunning a deadline aren't in |activate_status|.
+  // Falling back to their pre-installed version is enough, there is no need
+  // to revert the sessions that staged them.
+  bool overrun_failed = false;
+  for (const auto& overrun : watchdog.GetOverruns()) {
+    LOG(ERROR) << "Activation of " << overrun.package << " overran the "
+               << overrun.deadline.count() << "ms deadline of stage "
+               << ActivationStageName(overrun.stage)
+               << (overrun.failed ? "" : ", kept as it has no fallback");
+    overrun_failed |= overrun.failed;
+  }
   if (!activate_status.ok()) {
     std::string error_message =
         StringPrintf("Failed to activate packages: %s",
@@ -2846,6 +3767,8 @@ void OnStart() {
     if (!revert_status.ok()) {
       LOG(ERROR) << "Failed to revert : " << revert_status.error();
     }
+  }
+  if (!activate_status.ok() || overrun_failed) {
     auto retry_status = ActivateMissingApexes(activation_list,
                                               /* is_ota_chroot= */ false);
     if (!retry_status.ok()) {
@@ -2883,6 +3806,11 @@ void OnAllPackagesActivated(bool is_bootstrap) {
     PLOG(ERROR) << "Failed to set " << gConfig->apex_status_sysprop << " to "
                 << kApexStatusActivated;
   }
+
+  // Persisting the database as each package is activated would rewrite it
+  // once per package, so it is written once here and kept up to date after.
+  gMountedApexes.PersistTo(
+      StringPrintf("%s/%s", kApexRoot, kMountDatabaseSnapshot));
 }
 
 void OnAllPackagesReady() {
@@ -2921,18 +3849,41 @@ Result<std::vector<ApexFile>> SubmitStagedSession(
     ids_to_scan = {session_id};
   }
 
+  auto cancelled = std::make_shared<std::atomic<bool>>(false);
+  {
+    std::lock_guard lock(gVerificationsMutex);
+    if (!gVerificationsInProgress.emplace(session_id, cancelled).second) {
+      return Error() << "Session " << session_id
+                     << " is already being verified";
+    }
+  }
+  auto unregister = android::base::make_scope_guard([session_id]() {
+    std::lock_guard lock(gVerificationsMutex);
+    gVerificationsInProgress.erase(session_id);
+  });
+  // Streamed APEXes only skip a read during this verification.
+  auto forget_streamed = android::base::make_scope_guard(
+      [&ids_to_scan]() { ForgetStreamedApexes(ids_to_scan); });
+
   std::vector<ApexFile> ret;
   auto guard = android::base::make_scope_guard([&ret]() {
     for (const auto& apex : ret) {
       apexd_private::UnmountTempMount(apex);
     }
   });
-  for (int id_to_scan : ids_to_scan) {
-    auto verified = VerifySessionDir(id_to_scan);
+  // Packages that were verified are kept, even when another one failed, so
+  // that |guard| unmounts them. The first failure in |ids_to_scan| order is
+  // reported, same as when verifying them one after another.
+  auto verified_apexes = VerifySessionDirs(ids_to_scan, cancelled);
+  for (auto& verified : verified_apexes) {
+    if (verified.ok()) {
+      ret.push_back(std::move(*verified));
+    }
+  }
+  for (const auto& verified : verified_apexes) {
     if (!verified.ok()) {
       return verified.error();
     }
-    ret.push_back(std::move(*verified));
   }
 
   // Run preinstall, if necessary.
@@ -2946,20 +3897,36 @@ Result<std::vector<ApexFile>> SubmitStagedSession(
                    << " rollback and enabled for rollback.";
   }
 
-  auto session = ApexSession::CreateSession(session_id);
-  if (!session.ok()) {
-    return session.error();
+  {
+    // Cancellation is checked, and the session unregistered once committed,
+    // under the same lock as AbortStagedSession takes. So an abort either
+    // cancels the verification here or finds the VERIFIED session and deletes
+    // it.
+    std::lock_guard lock(gVerificationsMutex);
+    if (cancelled->load()) {
+      return Error() << "Verification of session " << session_id
+                     << " was cancelled";
+    }
+    auto session = ApexSession::CreateSession(session_id);
+    if (!session.ok()) {
+      return session.error();
+    }
+    (*session).SetChildSessionIds(child_session_ids);
+    std::string build_fingerprint = GetProperty(kBuildFingerprintSysprop, "");
+    (*session).SetBuildFingerprint(build_fingerprint);
+    session->SetHasRollbackEnabled(has_rollback_enabled);
+    session->SetIsRollback(is_rollback);
+    session->SetRollbackId(rollback_id);
+    Result<void> commit_status =
+        (*session).UpdateStateAndCommit(SessionState::VERIFIED);
+    if (!commit_status.ok()) {
+      return commit_status.error();
+    }
+    gVerificationsInProgress.erase(session_id);
+    unregister.Disable();
   }
-  (*session).SetChildSessionIds(child_session_ids);
-  std::string build_fingerprint = GetProperty(kBuildFingerprintSysprop, "");
-  (*session).SetBuildFingerprint(build_fingerprint);
-  session->SetHasRollbackEnabled(has_rollback_enabled);
-  session->SetIsRollback(is_rollback);
-  session->SetRollbackId(rollback_id);
-  Result<void> commit_status =
-      (*session).UpdateStateAndCommit(SessionState::VERIFIED);
-  if (!commit_status.ok()) {
-    return commit_status.error();
+  if (gSessionVerifiedCallback) {
+    gSessionVerifiedCallback(session_id);
   }
 
   for (const auto& apex : ret) {
@@ -2970,6 +3937,110 @@ Result<std::vector<ApexFile>> SubmitStagedSession(
   return ret;
 }
 
+Result<void> StageApexFromFd(const int session_id, const int fd) {
+  std::string session_dir = StringPrintf(
+      "%s/session_%d", gConfig->staged_session_dir, session_id);
+  auto exists = PathExists(session_dir);
+  if (!exists.ok()) {
+    return exists.error();
+  }
+  if (!*exists) {
+    return Error() << "Session directory " << session_dir << " doesn't exist";
+  }
+  std::string path = session_dir + "/" + kStreamedApexFileName;
+  if (access(path.c_str(), F_OK) == 0) {
+    return Error() << path << " was already staged";
+  }
+  {
+    // Sessions abandoned before being submitted have their directory removed
+    // by the installer, without apexd knowing.
+    std::lock_guard lock(gStreamedApexesMutex);
+    std::erase_if(gStreamedApexes, [](const auto& entry) {
+      return access(entry.first.c_str(), F_OK) != 0;
+    });
+  }
+
+  // Written to a temporary file first, so that VerifySessionDir never sees a
+  // partial APEX.
+  std::string tmp_path = path + ".tmp";
+  unique_fd out_fd(TEMP_FAILURE_RETRY(
+      open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)));
+  if (out_fd.get() == -1) {
+    return ErrnoError() << "Failed to create " << tmp_path;
+  }
+  auto cleanup = android::base::make_scope_guard([&]() {
+    unlink(tmp_path.c_str());
+    unlink(path.c_str());
+  });
+  static constexpr size_t kBufSize = 1024 * 1024;
+  // ApexFile can't address payloads beyond 2GiB anyway.
+  static constexpr uint64_t kMaxStreamedApexSize =
+      std::numeric_limits<int32_t>::max();
+  std::vector<uint8_t> buffer(kBufSize);
+  uint64_t total_size = 0;
+  while (true) {
+    ssize_t n = TEMP_FAILURE_RETRY(read(fd, buffer.data(), buffer.size()));
+    if (n < 0) {
+      return ErrnoError() << "Failed to read APEX of session " << session_id;
+    }
+    if (n == 0) {
+      break;
+    }
+    total_size += n;
+    if (total_size > kMaxStreamedApexSize) {
+      return Error() << "APEX of session " << session_id << " is larger than "
+                     << kMaxStreamedApexSize << " bytes";
+    }
+    if (!android::base::WriteFully(out_fd.get(), buffer.data(), n)) {
+      return ErrnoError() << "Failed to write " << tmp_path;
+    }
+  }
+  if (fsync(out_fd.get()) != 0) {
+    return ErrnoError() << "Failed to sync " << tmp_path;
+  }
+  out_fd.reset();
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << tmp_path << " to " << path;
+  }
+
+  // The payload was just written, so it is read back from the page cache
+  // rather than from storage.
+  auto apex = ApexFile::Open(path);
+  if (!apex.ok()) {
+    return apex.error();
+  }
+  if (apex->IsCompressed()) {
+    return Error() << "Compressed APEX can't be staged from a file descriptor";
+  }
+  auto& repository = ApexFileRepository::GetInstance();
+  auto public_key = repository.GetPublicKey(apex->GetManifest().name());
+  if (!public_key.ok()) {
+    return public_key.error();
+  }
+  auto verity_data = apex->VerifyApexVerity(*public_key);
+  if (!verity_data.ok()) {
+    return verity_data.error();
+  }
+  // The hashtree is kept for the temp mount of SubmitStagedSession, which then
+  // doesn't need to read the payload to generate it.
+  auto hashtree_file = GetHashTreeFileName(*apex, /* is_new= */ true);
+  if (auto st = VerifyPayloadDigest(*apex, *verity_data, hashtree_file);
+      !st.ok()) {
+    return Error() << "Failed to verify " << path << " : " << st.error();
+  }
+  auto identity = GetFileIdentity(path);
+  if (!identity.ok()) {
+    return identity.error();
+  }
+  {
+    std::lock_guard lock(gStreamedApexesMutex);
+    gStreamedApexes[path] = *identity;
+  }
+  cleanup.Disable();
+  LOG(INFO) << "Staged and verified " << path;
+  return {};
+}
+
 Result<void> MarkStagedSessionReady(const int session_id) {
   auto session = ApexSession::GetSession(session_id);
   if (!session.ok()) {
@@ -3045,11 +4116,87 @@ void RemoveInactiveDataApex() {
       }
     }
   }
+
+  // An interrupted decompression is only worth resuming for a CAPEX that is
+  // still pre-installed.
+  std::unordered_set<std::string> capex_ids;
+  for (const ApexFile& apex :
+       ApexFileRepository::GetInstance().GetPreInstalledApexFiles()) {
+    if (apex.IsCompressed()) {
+      capex_ids.insert(GetPackageId(apex.GetManifest()));
+    }
+  }
+  Result<std::vector<std::string>> partial_files = FindFilesBySuffix(
+      gConfig->decompression_dir, {".partial", ".progress"});
+  if (!partial_files.ok()) {
+    LOG(ERROR) << "Failed to scan " << gConfig->decompression_dir << " : "
+               << partial_files.error();
+    return;
+  }
+  for (const auto& path : *partial_files) {
+    std::string id = std::filesystem::path(path).stem().string();
+    if ((ConsumeSuffix(&id, kDecompressedApexPackageSuffix) ||
+         ConsumeSuffix(&id, kOtaApexPackageSuffix)) &&
+        capex_ids.count(id) > 0) {
+      continue;
+    }
+    LOG(INFO) << "Removing stale partial decompression " << path;
+    RemoveFileIfExists(path);
+  }
+}
+
+namespace {
+
+std::future<void> gEnableFsVerityFuture;
+
+// Enables fs-verity on the active APEXes in /data/apex/active and records its
+// binding to their AVB root digest, so that later boots only need to measure
+// them, see ShouldUseFsVerity. This reads each APEX in full, so it is left
+// until boot has completed and is run in the background.
+void EnableFsVerityForActiveApexes() {
+  LowerThreadPriority();
+  std::vector<ApexFile> apexes;
+  gMountedApexes.ForallMountedApexes([&](const std::string& /*package*/,
+                                         const MountedApexData& data,
+                                         bool latest) {
+    if (!latest || !StartsWith(data.full_path, gConfig->active_apex_data_dir)) {
+      return;
+    }
+    if (auto apex = GetMountedApexFile(data); apex.ok()) {
+      apexes.push_back(std::move(*apex));
+    }
+  });
+  for (const ApexFile& apex : apexes) {
+    auto public_key = ApexFileRepository::GetInstance().GetPublicKey(
+        apex.GetManifest().name());
+    if (!public_key.ok()) {
+      LOG(WARNING) << public_key.error();
+      continue;
+    }
+    auto verity_data = apex.VerifyApexVerity(*public_key);
+    if (!verity_data.ok()) {
+      LOG(WARNING) << verity_data.error();
+      continue;
+    }
+    if (auto st = PrepareFsVerity(apex, *verity_data,
+                                  GetFsVerityDigestFileName(apex));
+        !st.ok()) {
+      LOG(WARNING) << "Failed to enable fs-verity on " << apex.GetPath()
+                   << ": " << st.error();
+    }
+  }
 }
 
+}  // namespace
+
 void BootCompletedCleanup() {
   RemoveInactiveDataApex();
   ApexSession::DeleteFinalizedSessions();
+  if (android::sysprop::ApexProperties::data_apex_fs_verity().value_or(
+          false)) {
+    gEnableFsVerityFuture =
+        std::async(std::launch::async, EnableFsVerityForActiveApexes);
+  }
 }
 
 int UnmountAll() {
@@ -3062,7 +4209,7 @@ int UnmountAll() {
                                          bool latest) {
     LOG(INFO) << "Unmounting " << data.full_path << " mounted on "
               << data.mount_point;
-    auto apex = ApexFile::Open(data.full_path);
+    auto apex = GetMountedApexFile(data);
     if (!apex.ok()) {
       LOG(ERROR) << "Failed to open " << data.full_path << " : "
                  << apex.error();
@@ -3199,17 +4346,11 @@ void CollectApexInfoList(std::ostream& os,
   com::android::apex::write(os, apex_info_list);
 }
 
-// Reserve |size| bytes in |dest_dir| by creating a zero-filled file.
-// Also, we always clean up ota_apex that has been processed as
-// part of pre-reboot decompression whenever we reserve space.
-Result<void> ReserveSpaceForCompressedApex(int64_t size,
-                                           const std::string& dest_dir) {
-  if (size < 0) {
-    return Error() << "Cannot reserve negative byte of space";
-  }
+namespace {
 
-  // Since we are reserving space, then we must be preparing for a new OTA.
-  // Clean up any processed ota_apex from previous OTA.
+// Since we are reserving space, then we must be preparing for a new OTA.
+// Clean up any processed ota_apex from previous OTA.
+Result<void> RemoveProcessedOtaApex() {
   auto ota_apex_files =
       FindFilesBySuffix(gConfig->decompression_dir, {kOtaApexPackageSuffix});
   if (!ota_apex_files.ok()) {
@@ -3218,6 +4359,47 @@ Result<void> ReserveSpaceForCompressedApex(int64_t size,
   for (const std::string& ota_apex : *ota_apex_files) {
     RemoveFileIfExists(ota_apex);
   }
+  return {};
+}
+
+// Makes |file_path| exactly |size| bytes long, with all of its blocks
+// allocated, so that writing to it later can't fail with ENOSPC.
+Result<void> PreallocateFile(const std::string& file_path, int64_t size) {
+  unique_fd dest_fd(
+      open(file_path.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT, 0644));
+  if (dest_fd.get() == -1) {
+    return ErrnoError() << "Failed to open file for reservation " << file_path;
+  }
+  // fallocate never shrinks a file, so set the size first.
+  if (ftruncate(dest_fd.get(), size) != 0) {
+    return ErrnoError() << "Failed to resize file " << file_path;
+  }
+  if (fallocate(dest_fd.get(), 0, 0, size) != 0) {
+    if (errno != EOPNOTSUPP) {
+      return ErrnoError() << "Failed to allocate " << size << " bytes for "
+                          << file_path;
+    }
+    LOG(WARNING) << "fallocate is not supported for " << file_path
+                 << ", reserved space is sparse";
+  }
+  return {};
+}
+
+}  // namespace
+
+// Reserve |size| bytes in |dest_dir| by preallocating a single file.
+// Also, we always clean up ota_apex that has been processed as
+// part of pre-reboot decompression whenever we reserve space.
+Result<void> ReserveSpaceForCompressedApex(int64_t size,
+                                           const std::string& dest_dir) {
+  if (size < 0) {
+    return Error() << "Cannot reserve negative byte of space";
+  }
+  std::lock_guard ota_apex_lock(gOtaApexMutex);
+  std::lock_guard reserved_space_lock(gReservedSpaceMutex);
+  if (auto ret = RemoveProcessedOtaApex(); !ret.ok()) {
+    return ret.error();
+  }
 
   auto file_path = StringPrintf("%s/full.tmp", dest_dir.c_str());
   if (size == 0) {
@@ -3228,25 +4410,64 @@ Result<void> ReserveSpaceForCompressedApex(int64_t size,
   }
 
   LOG(INFO) << "Reserving " << size << " bytes for compressed APEX";
-  unique_fd dest_fd(
-      open(file_path.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT, 0644));
-  if (dest_fd.get() == -1) {
-    return ErrnoError() << "Failed to open file for reservation "
-                        << file_path.c_str();
+  if (auto ret = PreallocateFile(file_path, size); !ret.ok()) {
+    RemoveFileIfExists(file_path);
+    return ret.error();
   }
+  return {};
+}
 
-  // Resize to required size
-  std::error_code ec;
-  std::filesystem::resize_file(file_path, size, ec);
-  if (ec) {
-    RemoveFileIfExists(file_path);
-    return ErrnoError() << "Failed to resize file " << file_path.c_str()
-                        << " : " << ec.message();
+Result<void> ReserveSpaceForCompressedApex(
+    const std::map<std::string, int64_t>& sizes, const std::string& dest_dir) {
+  for (const auto& [package_name, size] : sizes) {
+    if (size < 0) {
+      return Error() << "Cannot reserve negative byte of space for "
+                     << package_name;
+    }
+  }
+  std::lock_guard ota_apex_lock(gOtaApexMutex);
+  std::lock_guard reserved_space_lock(gReservedSpaceMutex);
+  if (auto ret = RemoveProcessedOtaApex(); !ret.ok()) {
+    return ret.error();
   }
 
+  // Release whatever is reserved for packages that are no longer part of the
+  // OTA, including an aggregate reservation.
+  auto reserved_files = ReadDir(dest_dir, [](auto _) { return true; });
+  if (!reserved_files.ok()) {
+    return reserved_files.error();
+  }
+  for (const auto& file_path : *reserved_files) {
+    std::string package_name = std::filesystem::path(file_path).filename();
+    if (!ConsumeSuffix(&package_name, kReservedSpaceSuffix) ||
+        sizes.count(package_name) == 0 || sizes.at(package_name) == 0) {
+      RemoveFileIfExists(file_path);
+    }
+  }
+
+  int64_t total_size = 0;
+  for (const auto& [package_name, size] : sizes) {
+    if (size == 0) {
+      continue;
+    }
+    auto file_path = GetReservedSpacePath(dest_dir, package_name);
+    if (auto ret = PreallocateFile(file_path, size); !ret.ok()) {
+      RemoveFileIfExists(file_path);
+      return ret.error();
+    }
+    LOG(INFO) << "Reserved " << size << " bytes for " << package_name;
+    total_size += size;
+  }
+  LOG(INFO) << "Reserved " << total_size << " bytes for compressed APEX";
   return {};
 }
 
+std::string GetReservedSpacePath(const std::string& dest_dir,
+                                 const std::string& package_name) {
+  return StringPrintf("%s/%s%s", dest_dir.c_str(), package_name.c_str(),
+                      kReservedSpaceSuffix);
+}
+
 int OnOtaChrootBootstrap() {
   auto& instance = ApexFileRepository::GetInstance();
   if (auto status = instance.AddPreInstalledApex(gConfig->apex_built_in_dirs);
@@ -3435,6 +4656,20 @@ int OnOtaChrootBootstrapFlattenedApex() {
   return 0;
 }
 
+void SetSessionVerifiedCallbackForTesting(std::function<void(int)> callback) {
+  gSessionVerifiedCallback = std::move(callback);
+}
+
+void SetPreRebootDecompressionCallbackForTesting(
+    std::function<void(const std::string&)> callback) {
+  gPreRebootDecompressionCallback = std::move(callback);
+}
+
+void SetActivationDeadlinesForTesting(
+    std::optional<ActivationDeadlines> deadlines) {
+  gActivationDeadlinesForTesting = std::move(deadlines);
+}
+
 android::apex::MountedApexDatabase& GetApexDatabaseForTesting() {
   return gMountedApexes;
 }
@@ -3617,7 +4852,7 @@ Result<ApexFile> InstallPackage(const std::string& package_path) {
     return Error() << "No active version found for package " << module_name;
   }
 
-  auto cur_apex = ApexFile::Open(cur_mounted_data->full_path);
+  auto cur_apex = GetMountedApexFile(*cur_mounted_data);
   if (!cur_apex.ok()) {
     return cur_apex.error();
   }
@@ -17,6 +17,9 @@
 #ifndef ANDROID_APEXD_APEXD_H_
 #define ANDROID_APEXD_APEXD_H_
 
+#include <functional>
+#include <map>
+#include <optional>
 #include <ostream>
 #include <string>
 #include <vector>
@@ -28,6 +31,7 @@
 #include "apex_database.h"
 #include "apex_file.h"
 #include "apex_file_repository.h"
+#include "apexd_activation_watchdog.h"
 #include "apexd_session.h"
 
 namespace android {
@@ -79,6 +83,11 @@ android::base::Result<std::vector<ApexFile>> SubmitStagedSession(
     const int session_id, const std::vector<int>& child_session_ids,
     const bool has_rollback_enabled, const bool is_rollback,
     const int rollback_id) WARN_UNUSED;
+// Copies the APEX read from |fd| until EOF into the directory of |session_id|,
+// and verifies its payload while it is still in the page cache. Temp mounting
+// it during SubmitStagedSession then doesn't read the payload again.
+android::base::Result<void> StageApexFromFd(const int session_id,
+                                            const int fd) WARN_UNUSED;
 android::base::Result<void> MarkStagedSessionReady(const int session_id)
     WARN_UNUSED;
 android::base::Result<void> MarkStagedSessionSuccessful(const int session_id)
@@ -141,8 +150,11 @@ void OnStart();
 std::vector<ApexFileRef> SelectApexForActivation(
     const std::unordered_map<std::string, std::vector<ApexFileRef>>& all_apex,
     const ApexFileRepository& instance);
+// If given, |on_decompressed| is called from the decompressing thread as soon
+// as each APEX is ready.
 std::vector<ApexFile> ProcessCompressedApex(
-    const std::vector<ApexFileRef>& compressed_apex, bool is_ota_chroot);
+    const std::vector<ApexFileRef>& compressed_apex, bool is_ota_chroot,
+    const std::function<void(const ApexFile&)>& on_decompressed = nullptr);
 // Validate |apex| is same as |capex|
 android::base::Result<void> ValidateDecompressedApex(const ApexFile& capex,
                                                      const ApexFile& apex);
@@ -180,10 +192,41 @@ void CollectApexInfoList(std::ostream& os,
                          const std::vector<ApexFile>& active_apexs,
                          const std::vector<ApexFile>& inactive_apexs);
 
-// Reserve |size| bytes in |dest_dir| by creating a zero-filled file
+// Reserve |size| bytes in |dest_dir| by preallocating a single file
 android::base::Result<void> ReserveSpaceForCompressedApex(
     int64_t size, const std::string& dest_dir);
 
+// Reserve space in |dest_dir| for decompressing each package of |sizes|, keyed
+// by package name, by preallocating one file per package. Reservations of
+// packages missing from |sizes| are released.
+android::base::Result<void> ReserveSpaceForCompressedApex(
+    const std::map<std::string, int64_t>& sizes, const std::string& dest_dir);
+
+// Returns the path of the file reserving space for |package_name| in
+// |dest_dir|.
+std::string GetReservedSpacePath(const std::string& dest_dir,
+                                 const std::string& package_name);
+
+struct PreRebootDecompressionStatus {
+  size_t total_count = 0;
+  size_t completed_count = 0;
+  size_t failed_count = 0;
+  bool is_running = false;
+  bool is_cancelled = false;
+  // CAPEX being decompressed, empty if none.
+  std::string current_capex_path;
+};
+
+// Decompresses |capex_paths| into ota_apex files on a background thread with
+// low CPU and I/O priority, so that they can be reused on next boot.
+android::base::Result<void> StartPreRebootDecompression(
+    std::vector<std::string> capex_paths);
+PreRebootDecompressionStatus GetPreRebootDecompressionStatus();
+// Stops the pre-reboot decompression after the CAPEX being decompressed.
+void CancelPreRebootDecompression();
+// Blocks until the pre-reboot decompression, if any, is finished.
+void WaitForPreRebootDecompression();
+
 // Activates apexes in otapreot_chroot environment.
 // TODO(b/172911822): support compressed apexes.
 int OnOtaChrootBootstrap();
@@ -193,6 +236,20 @@ int OnOtaChrootBootstrapFlattenedApex();
 
 android::apex::MountedApexDatabase& GetApexDatabaseForTesting();
 
+// Sets a callback that SubmitStagedSession calls right after committing a
+// session as VERIFIED.
+void SetSessionVerifiedCallbackForTesting(std::function<void(int)> callback);
+
+// Sets a callback that the pre-reboot decompression calls on its thread once
+// it is done with each CAPEX.
+void SetPreRebootDecompressionCallbackForTesting(
+    std::function<void(const std::string&)> callback);
+
+// Overrides the deadlines of the stages of activation in OnStart, or restores
+// the default ones if |deadlines| is empty.
+void SetActivationDeadlinesForTesting(
+    std::optional<ActivationDeadlines> deadlines);
+
 // Performs a non-staged install of an APEX specified by |package_path|.
 // TODO(ioffe): add more documentation.
 android::base::Result<ApexFile> InstallPackage(const std::string& package_path);
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "apexd"
+
+#include "apexd_activation_watchdog.h"
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+using android::base::Error;
+using android::base::Result;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+thread_local ScopedActivationDeadline* tCurrentActivation = nullptr;
+
+}  // namespace
+
+const char* ActivationStageName(ActivationStage stage) {
+  switch (stage) {
+    case ActivationStage::kVerifyPayload:
+      return "verify_payload";
+    case ActivationStage::kLoopDevice:
+      return "loop_device";
+    case ActivationStage::kDmVerity:
+      return "dm_verity";
+    case ActivationStage::kReadVerity:
+      return "read_verity";
+    case ActivationStage::kMount:
+      return "mount";
+  }
+  return "unknown";
+}
+
+ActivationWatchdog::ActivationWatchdog(ActivationDeadlines deadlines)
+    : deadlines_(std::move(deadlines)) {
+  thread_ = std::thread([this]() { Run(); });
+}
+
+ActivationWatchdog::~ActivationWatchdog() {
+  {
+    std::lock_guard lock(mutex_);
+    stopped_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+std::vector<ActivationOverrun> ActivationWatchdog::GetOverruns() const {
+  std::lock_guard lock(mutex_);
+  return overruns_;
+}
+
+void ActivationWatchdog::CheckLocked(
+    Activation& activation, std::chrono::steady_clock::time_point now) {
+  if (activation.overrun) {
+    return;
+  }
+  auto deadline = deadlines_.find(activation.stage);
+  if (deadline == deadlines_.end() ||
+      now - activation.stage_started <= deadline->second) {
+    return;
+  }
+  activation.overrun = true;
+  LOG(ERROR) << "Activation of " << activation.package
+             << " spent more than " << deadline->second.count()
+             << "ms in stage " << ActivationStageName(activation.stage);
+  overruns_.push_back({.package = activation.package,
+                       .stage = activation.stage,
+                       .deadline = deadline->second,
+                       .failed = activation.can_fail});
+}
+
+void ActivationWatchdog::Run() {
+  std::unique_lock lock(mutex_);
+  while (!stopped_) {
+    auto now = std::chrono::steady_clock::now();
+    auto next_deadline = std::chrono::steady_clock::time_point::max();
+    for (auto& activation : activations_) {
+      CheckLocked(activation, now);
+      auto deadline = deadlines_.find(activation.stage);
+      if (!activation.overrun && deadline != deadlines_.end()) {
+        next_deadline = std::min(next_deadline,
+                                 activation.stage_started + deadline->second);
+      }
+    }
+    // Woken up early whenever an activation starts or changes stage.
+    if (next_deadline == std::chrono::steady_clock::time_point::max()) {
+      cv_.wait(lock);
+    } else {
+      cv_.wait_until(lock, next_deadline + std::chrono::milliseconds(1));
+    }
+  }
+}
+
+ScopedActivationDeadline::ScopedActivationDeadline(
+    ActivationWatchdog* watchdog, const std::string& package, bool can_fail)
+    : watchdog_(watchdog), previous_(tCurrentActivation) {
+  if (watchdog_ == nullptr) {
+    return;
+  }
+  {
+    std::lock_guard lock(watchdog_->mutex_);
+    activation_ = watchdog_->activations_.insert(
+        watchdog_->activations_.end(),
+        {.package = package,
+         .stage = ActivationStage::kVerifyPayload,
+         .stage_started = std::chrono::steady_clock::now(),
+         .can_fail = can_fail});
+  }
+  watchdog_->cv_.notify_all();
+  tCurrentActivation = this;
+}
+
+ScopedActivationDeadline::~ScopedActivationDeadline() {
+  if (watchdog_ == nullptr) {
+    return;
+  }
+  tCurrentActivation = previous_;
+  std::lock_guard lock(watchdog_->mutex_);
+  watchdog_->activations_.erase(activation_);
+}
+
+Result<void> EnterActivationStage(ActivationStage stage) {
+  if (auto st = CheckActivationDeadline(); !st.ok()) {
+    return st;
+  }
+  ScopedActivationDeadline* current = tCurrentActivation;
+  if (current == nullptr) {
+    return {};
+  }
+  ActivationWatchdog* watchdog = current->watchdog_;
+  {
+    std::lock_guard lock(watchdog->mutex_);
+    current->activation_->stage = stage;
+    current->activation_->stage_started = std::chrono::steady_clock::now();
+    // Only an activation that can't fail gets here after an overrun.
+    current->activation_->overrun = false;
+  }
+  watchdog->cv_.notify_all();
+  return {};
+}
+
+Result<void> CheckActivationDeadline() {
+  ScopedActivationDeadline* current = tCurrentActivation;
+  if (current == nullptr) {
+    return {};
+  }
+  ActivationWatchdog* watchdog = current->watchdog_;
+  std::lock_guard lock(watchdog->mutex_);
+  ActivationWatchdog::Activation& activation = *current->activation_;
+  watchdog->CheckLocked(activation, std::chrono::steady_clock::now());
+  if (activation.overrun && activation.can_fail) {
+    return Error() << "Activation of " << activation.package
+                   << " overran the deadline of stage "
+                   << ActivationStageName(activation.stage);
+  }
+  return {};
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/result.h>
+
+namespace android {
+namespace apex {
+
+// Stages that the activation of a package goes through, in order.
+enum class ActivationStage {
+  kVerifyPayload,
+  kLoopDevice,
+  kDmVerity,
+  kReadVerity,
+  kMount,
+};
+
+const char* ActivationStageName(ActivationStage stage);
+
+// How long an activation may spend in each stage. Stages without an entry are
+// not bounded.
+using ActivationDeadlines =
+    std::unordered_map<ActivationStage, std::chrono::milliseconds>;
+
+// A package that spent longer than the deadline of |stage| in it.
+struct ActivationOverrun {
+  std::string package;
+  ActivationStage stage;
+  std::chrono::milliseconds deadline;
+  // Whether its activation was failed because of it.
+  bool failed;
+};
+
+// Keeps track of the activations registered with ScopedActivationDeadline. A
+// thread of its own records overruns as they happen, so that a package stuck
+// in a blocking call is still reported.
+class ActivationWatchdog {
+ public:
+  explicit ActivationWatchdog(ActivationDeadlines deadlines);
+  ~ActivationWatchdog();
+
+  ActivationWatchdog(const ActivationWatchdog&) = delete;
+  ActivationWatchdog& operator=(const ActivationWatchdog&) = delete;
+
+  std::vector<ActivationOverrun> GetOverruns() const;
+
+ private:
+  friend class ScopedActivationDeadline;
+  friend android::base::Result<void> EnterActivationStage(
+      ActivationStage stage);
+  friend android::base::Result<void> CheckActivationDeadline();
+
+  struct Activation {
+    std::string package;
+    ActivationStage stage;
+    std::chrono::steady_clock::time_point stage_started;
+    bool can_fail;
+    bool overrun = false;
+  };
+
+  void Run();
+  // Records |activation| as overrun if it is past its deadline at |now|.
+  // Must be called with |mutex_| held.
+  void CheckLocked(Activation& activation,
+                   std::chrono::steady_clock::time_point now);
+
+  const ActivationDeadlines deadlines_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  // Guarded by mutex_.
+  std::list<Activation> activations_;
+  // Guarded by mutex_.
+  std::vector<ActivationOverrun> overruns_;
+  // Guarded by mutex_.
+  bool stopped_ = false;
+  std::thread thread_;
+};
+
+// Registers the activation of |package| on the calling thread with |watchdog|
+// for as long as it lives, starting in the first stage. Does nothing if
+// |watchdog| is null. Unless |can_fail|, e.g. for a package without a fallback,
+// overruns are only recorded and the activation carries on.
+class ScopedActivationDeadline {
+ public:
+  ScopedActivationDeadline(ActivationWatchdog* watchdog,
+                           const std::string& package, bool can_fail = true);
+  ~ScopedActivationDeadline();
+
+  ScopedActivationDeadline(const ScopedActivationDeadline&) = delete;
+  ScopedActivationDeadline& operator=(const ScopedActivationDeadline&) =
+      delete;
+
+ private:
+  friend android::base::Result<void> EnterActivationStage(
+      ActivationStage stage);
+  friend android::base::Result<void> CheckActivationDeadline();
+
+  ActivationWatchdog* const watchdog_;
+  std::list<ActivationWatchdog::Activation>::iterator activation_;
+  ScopedActivationDeadline* previous_;
+};
+
+// Moves the activation running on the calling thread to |stage|. Fails,
+// without moving it, if it overran the deadline of the stage it was in. Does
+// nothing outside of a ScopedActivationDeadline.
+android::base::Result<void> EnterActivationStage(ActivationStage stage);
+
+// Fails if the activation running on the calling thread overran the deadline
+// of its current stage and can fail. Meant for loops that can wait for a long
+// time.
+android::base::Result<void> CheckActivationDeadline();
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "apexd_activation_watchdog.h"
+#include "apexd_test_utils.h"
+
+namespace android {
+namespace apex {
+
+using namespace std::literals;
+
+using android::apex::testing::IsOk;
+
+TEST(ApexdActivationWatchdogTest, NoOpOutsideOfScope) {
+  ASSERT_TRUE(IsOk(EnterActivationStage(ActivationStage::kMount)));
+  ASSERT_TRUE(IsOk(CheckActivationDeadline()));
+}
+
+TEST(ApexdActivationWatchdogTest, NoOpWithoutWatchdog) {
+  ScopedActivationDeadline deadline(nullptr, "com.android.foo");
+  ASSERT_TRUE(IsOk(EnterActivationStage(ActivationStage::kMount)));
+  ASSERT_TRUE(IsOk(CheckActivationDeadline()));
+}
+
+TEST(ApexdActivationWatchdogTest, StagesWithinDeadlines) {
+  ActivationWatchdog watchdog({{ActivationStage::kLoopDevice, 10s}});
+  {
+    ScopedActivationDeadline deadline(&watchdog, "com.android.foo");
+    ASSERT_TRUE(IsOk(EnterActivationStage(ActivationStage::kLoopDevice)));
+    ASSERT_TRUE(IsOk(CheckActivationDeadline()));
+    ASSERT_TRUE(IsOk(EnterActivationStage(ActivationStage::kMount)));
+  }
+  ASSERT_TRUE(watchdog.GetOverruns().empty());
+}
+
+TEST(ApexdActivationWatchdogTest, FailsOnceStageOverran) {
+  ActivationWatchdog watchdog({{ActivationStage::kLoopDevice, 50ms}});
+  ScopedActivationDeadline deadline(&watchdog, "com.android.foo");
+  // Stages without a deadline are not bounded.
+  std::this_thread::sleep_for(100ms);
+  ASSERT_TRUE(IsOk(EnterActivationStage(ActivationStage::kLoopDevice)));
+  std::this_thread::sleep_for(100ms);
+  ASSERT_FALSE(IsOk(CheckActivationDeadline()));
+  ASSERT_FALSE(IsOk(EnterActivationStage(ActivationStage::kMount)));
+
+  auto overruns = watchdog.GetOverruns();
+  ASSERT_EQ(1u, overruns.size());
+  ASSERT_EQ("com.android.foo", overruns[0].package);
+  ASSERT_EQ(ActivationStage::kLoopDevice, overruns[0].stage);
+  ASSERT_TRUE(overruns[0].failed);
+}
+
+TEST(ApexdActivationWatchdogTest, OnlyRecordsOverrunIfCannotFail) {
+  ActivationWatchdog watchdog({{ActivationStage::kLoopDevice, 50ms},
+                               {ActivationStage::kMount, 50ms}});
+  ScopedActivationDeadline deadline(&watchdog, "com.android.foo",
+                                    /* can_fail= */ false);
+  ASSERT_TRUE(IsOk(EnterActivationStage(ActivationStage::kLoopDevice)));
+  std::this_thread::sleep_for(100ms);
+  ASSERT_TRUE(IsOk(CheckActivationDeadline()));
+  ASSERT_TRUE(IsOk(EnterActivationStage(ActivationStage::kMount)));
+  std::this_thread::sleep_for(100ms);
+  ASSERT_TRUE(IsOk(CheckActivationDeadline()));
+
+  auto overruns = watchdog.GetOverruns();
+  ASSERT_EQ(2u, overruns.size());
+  ASSERT_EQ(ActivationStage::kLoopDevice, overruns[0].stage);
+  ASSERT_FALSE(overruns[0].failed);
+  ASSERT_EQ(ActivationStage::kMount, overruns[1].stage);
+  ASSERT_FALSE(overruns[1].failed);
+}
+
+TEST(ApexdActivationWatchdogTest, RecordsOverrunOfBlockedActivation) {
+  ActivationWatchdog watchdog({{ActivationStage::kVerifyPayload, 50ms}});
+  ScopedActivationDeadline deadline(&watchdog, "com.android.foo");
+  // Nothing is called on this thread in the meantime, so the watchdog thread
+  // has to notice on its own.
+  auto start = std::chrono::steady_clock::now();
+  while (watchdog.GetOverruns().empty()) {
+    ASSERT_LT(std::chrono::steady_clock::now() - start, 5s);
+    std::this_thread::sleep_for(10ms);
+  }
+  ASSERT_EQ(ActivationStage::kVerifyPayload, watchdog.GetOverruns()[0].stage);
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "apexd"
+
+#include "apexd_hashtree_image.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <optional>
+#include <set>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+
+#include "apexd_loop.h"
+#include "apexd_utils.h"
+#include "mount_database.pb.h"
+
+using android::base::Dirname;
+using android::base::ErrnoError;
+using android::base::Error;
+using android::base::ReadFileToString;
+using android::base::Result;
+using android::base::unique_fd;
+using android::base::WriteFully;
+using android::base::WriteStringToFd;
+using ::apex::proto::HashTreeImageIndex;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+uint64_t AlignUp(uint64_t value, uint32_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+}  // namespace
+
+Result<void> HashTreeImage::OpenLocked() {
+  if (auto st = CreateDirIfNeeded(Dirname(path_), 0700); !st.ok()) {
+    return st.error();
+  }
+  std::set<std::string> mounted(mounted_package_ids_.begin(),
+                                mounted_package_ids_.end());
+  image_fd_.reset(TEMP_FAILURE_RETRY(open(path_.c_str(), O_RDWR | O_CLOEXEC)));
+  struct stat image_stat = {};
+  bool has_image =
+      image_fd_.get() != -1 && fstat(image_fd_.get(), &image_stat) == 0;
+  uint64_t image_size = image_stat.st_size;
+
+  std::string content;
+  HashTreeImageIndex index;
+  bool has_index = has_image && ReadFileToString(index_path_, &content) &&
+                   index.ParseFromString(content);
+  slots_.clear();
+  for (const auto& slot : index.slots()) {
+    slots_.push_back(Slot{slot.package_id(), slot.root_digest(), slot.offset(),
+                          slot.size(), mounted.count(slot.package_id()) > 0});
+  }
+  std::sort(slots_.begin(), slots_.end(),
+            [](const Slot& a, const Slot& b) { return a.offset < b.offset; });
+  uint64_t end = 0;
+  for (const Slot& slot : slots_) {
+    if (slot.offset < end || slot.offset + slot.size > image_size) {
+      LOG(WARNING) << "Ignoring " << index_path_ << " with invalid slots";
+      has_index = false;
+      slots_.clear();
+      break;
+    }
+    end = slot.offset + slot.size;
+  }
+  bool in_use = std::any_of(slots_.begin(), slots_.end(),
+                            [](const Slot& slot) { return slot.in_use; });
+
+  if (has_index && (image_size == size_ || in_use)) {
+    image_size_ = image_size;
+    if (image_size_ != size_) {
+      LOG(WARNING) << "Keeping " << path_ << " at " << image_size_
+                   << " bytes while its slots are in use";
+    }
+  } else if (has_image && !has_index && !mounted.empty()) {
+    // A previous apexd may have left dm-verity devices referencing the image.
+    return Error() << "Can't tell which slots of " << path_
+                   << " are in use without " << index_path_;
+  } else if (auto st = CreateLocked(); !st.ok()) {
+    return st.error();
+  }
+
+  auto loop = loop::CreateLoopDevice(path_, 0, 0);
+  if (!loop.ok()) {
+    return loop.error();
+  }
+  loop_name_ = loop->name;
+  loop_fd_ = std::move(loop->device_fd);
+  LOG(INFO) << "Opened hashtree image " << path_ << " with " << slots_.size()
+            << " slots on " << loop_name_;
+  return {};
+}
+
+Result<void> HashTreeImage::CreateLocked() {
+  // None of the slots are in use, so no dm-verity device references the old
+  // image anymore.
+  slots_.clear();
+  if (unlink(path_.c_str()) != 0 && errno != ENOENT) {
+    return ErrnoError() << "Failed to unlink " << path_;
+  }
+  image_fd_.reset(TEMP_FAILURE_RETRY(
+      open(path_.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)));
+  if (image_fd_.get() == -1) {
+    return ErrnoError() << "Failed to create " << path_;
+  }
+  if (fallocate(image_fd_.get(), 0, 0, size_) != 0) {
+    return ErrnoError() << "Failed to allocate " << size_ << " bytes for "
+                        << path_;
+  }
+  image_size_ = size_;
+  LOG(INFO) << "Created hashtree image " << path_;
+  return WriteIndexLocked();
+}
+
+Result<void> HashTreeImage::WriteIndexLocked() {
+  HashTreeImageIndex index;
+  for (const Slot& slot : slots_) {
+    auto* entry = index.add_slots();
+    entry->set_package_id(slot.package_id);
+    entry->set_root_digest(slot.root_digest);
+    entry->set_offset(slot.offset);
+    entry->set_size(slot.size);
+  }
+  // Synced before and after the rename, so that a power loss leaves either
+  // the previous index or this one.
+  std::string tmp_path = index_path_ + ".tmp";
+  unique_fd fd(TEMP_FAILURE_RETRY(open(
+      tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)));
+  if (fd.get() == -1 || !WriteStringToFd(index.SerializeAsString(), fd.get()) ||
+      fsync(fd.get()) != 0) {
+    return ErrnoError() << "Failed to write " << tmp_path;
+  }
+  if (rename(tmp_path.c_str(), index_path_.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << tmp_path << " to "
+                        << index_path_;
+  }
+  std::string dir = Dirname(index_path_);
+  unique_fd dir_fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (dir_fd.get() == -1 || fsync(dir_fd.get()) != 0) {
+    return ErrnoError() << "Failed to sync " << dir;
+  }
+  return {};
+}
+
+Result<HashTreeSlot> HashTreeImage::GetHashTree(const std::string& package_id,
+                                                const std::string& root_digest,
+                                                uint32_t hash_block_size) {
+  std::lock_guard lock(mutex_);
+  if (!opened_) {
+    if (auto st = OpenLocked(); !st.ok()) {
+      return st.error();
+    }
+    opened_ = true;
+  }
+
+  for (Slot& slot : slots_) {
+    if (slot.package_id == package_id && slot.root_digest == root_digest &&
+        slot.offset % hash_block_size == 0) {
+      slot.in_use = true;
+      return HashTreeSlot{loop_name_,
+                          static_cast<uint32_t>(slot.offset / hash_block_size)};
+    }
+  }
+  return Error() << path_ << " has no hashtree of " << package_id;
+}
+
+Result<HashTreeSlot> HashTreeImage::AddHashTree(
+    const std::string& package_id, const std::string& root_digest,
+    const std::string& hashtree_file, uint32_t hash_block_size) {
+  std::lock_guard lock(mutex_);
+  if (!opened_) {
+    if (auto st = OpenLocked(); !st.ok()) {
+      return st.error();
+    }
+    opened_ = true;
+  }
+
+  std::string hashtree;
+  if (!ReadFileToString(hashtree_file, &hashtree)) {
+    return ErrnoError() << "Failed to read " << hashtree_file;
+  }
+
+  // A package has a single dm-verity device, so older hashtrees of it are no
+  // longer needed, unless that device still references one.
+  size_t slot_count = slots_.size();
+  for (auto it = slots_.begin(); it != slots_.end();) {
+    if (it->package_id != package_id) {
+      ++it;
+    } else if (it->in_use) {
+      return Error() << package_id << " still uses another slot of " << path_;
+    } else {
+      it = slots_.erase(it);
+    }
+  }
+
+  // First fit between the slots, which are sorted by offset.
+  auto find_offset = [&]() -> std::optional<uint64_t> {
+    uint64_t end = 0;
+    for (const Slot& slot : slots_) {
+      if (AlignUp(end, hash_block_size) + hashtree.size() <= slot.offset) {
+        break;
+      }
+      end = slot.offset + slot.size;
+    }
+    uint64_t offset = AlignUp(end, hash_block_size);
+    if (offset + hashtree.size() > image_size_) {
+      return std::nullopt;
+    }
+    return offset;
+  };
+  std::optional<uint64_t> offset = find_offset();
+  if (!offset) {
+    // Make room by dropping the hashtrees kept for packages not mounted.
+    slots_.erase(std::remove_if(slots_.begin(), slots_.end(),
+                                [](const Slot& slot) { return !slot.in_use; }),
+                 slots_.end());
+    offset = find_offset();
+  }
+  if (slots_.size() != slot_count) {
+    if (auto st = WriteIndexLocked(); !st.ok()) {
+      return st.error();
+    }
+  }
+  if (!offset) {
+    return Error() << "Not enough space left in " << path_ << " for "
+                   << hashtree_file;
+  }
+
+  if (lseek(image_fd_.get(), *offset, SEEK_SET) == -1) {
+    return ErrnoError() << "Failed to seek in " << path_;
+  }
+  if (!WriteFully(image_fd_.get(), hashtree.data(), hashtree.size())) {
+    return ErrnoError() << "Failed to write " << hashtree_file << " to "
+                        << path_;
+  }
+  // The loop device reads the image with direct I/O.
+  if (fdatasync(image_fd_.get()) != 0) {
+    return ErrnoError() << "Failed to sync " << path_;
+  }
+  Slot slot{package_id, root_digest, *offset, hashtree.size(),
+            /* in_use= */ true};
+  slots_.insert(std::upper_bound(slots_.begin(), slots_.end(), slot,
+                                 [](const Slot& a, const Slot& b) {
+                                   return a.offset < b.offset;
+                                 }),
+                slot);
+  // The slot is still usable by this apexd, it just won't be reused after the
+  // next boot.
+  if (auto st = WriteIndexLocked(); !st.ok()) {
+    LOG(WARNING) << st.error();
+  }
+  return HashTreeSlot{loop_name_,
+                      static_cast<uint32_t>(*offset / hash_block_size)};
+}
+
+void HashTreeImage::ReleaseHashTree(const std::string& package_id) {
+  std::lock_guard lock(mutex_);
+  for (Slot& slot : slots_) {
+    if (slot.package_id == package_id) {
+      slot.in_use = false;
+    }
+  }
+}
+
+}  // namespace apex
+}  // namespace android
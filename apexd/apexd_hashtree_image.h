@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/result.h>
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+
+namespace android {
+namespace apex {
+
+// Location of a hashtree inside the HashTreeImage.
+struct HashTreeSlot {
+  // Loop device exposing the whole image.
+  std::string loop_name;
+  // Offset of the hashtree inside the image, in hash blocks.
+  uint32_t hash_start_block;
+};
+
+// A single preallocated image holding the generated hashtrees of all data
+// APEXes. The image is exposed through one loop device, and each dm-verity
+// table references its hashtree by hash_start_block, instead of every
+// hashtree file getting a loop device of its own.
+//
+// The image and an index of its slots, keyed by package id and root digest,
+// are kept across boots, so that a hashtree is only copied into the image once.
+// A slot is in use while a dm-verity device of its package may reference it,
+// and is otherwise reclaimed when space is needed. Temp mounts don't use the
+// image, since they are unmounted right away.
+class HashTreeImage {
+ public:
+  // |mounted_package_ids| are the packages whose dm-verity devices may already
+  // reference the image, e.g. because they were mounted before apexd
+  // restarted. Their slots are not reclaimed until they are released.
+  HashTreeImage(const std::string& path, uint64_t size,
+                std::vector<std::string> mounted_package_ids = {})
+      : path_(path),
+        index_path_(path + ".index"),
+        size_(size),
+        mounted_package_ids_(std::move(mounted_package_ids)) {}
+
+  // Returns the slot already holding the hashtree of |package_id| with
+  // |root_digest|, and marks it in use.
+  android::base::Result<HashTreeSlot> GetHashTree(
+      const std::string& package_id, const std::string& root_digest,
+      uint32_t hash_block_size) REQUIRES(!mutex_);
+
+  // Copies |hashtree_file|, whose root digest is |root_digest|, into a free
+  // slot of the image and marks it in use by |package_id|.
+  android::base::Result<HashTreeSlot> AddHashTree(
+      const std::string& package_id, const std::string& root_digest,
+      const std::string& hashtree_file, uint32_t hash_block_size)
+      REQUIRES(!mutex_);
+
+  // Allows the slot of |package_id| to be reclaimed, once no dm-verity device
+  // references it anymore. The hashtree is kept until then.
+  void ReleaseHashTree(const std::string& package_id) REQUIRES(!mutex_);
+
+ private:
+  struct Slot {
+    std::string package_id;
+    std::string root_digest;
+    // Location of the hashtree in the image, in bytes.
+    uint64_t offset;
+    uint64_t size;
+    bool in_use;
+  };
+
+  android::base::Result<void> OpenLocked() REQUIRES(mutex_);
+  android::base::Result<void> CreateLocked() REQUIRES(mutex_);
+  // Persists |slots_|. A slot is dropped from the index before its space is
+  // reused, and only added once its hashtree is synced.
+  android::base::Result<void> WriteIndexLocked() REQUIRES(mutex_);
+
+  const std::string path_;
+  const std::string index_path_;
+  const uint64_t size_;
+  const std::vector<std::string> mounted_package_ids_;
+
+  std::mutex mutex_;
+  bool opened_ GUARDED_BY(mutex_) = false;
+  // The size of the image, which is |size_| unless an image of another size
+  // was still in use.
+  uint64_t image_size_ GUARDED_BY(mutex_) = 0;
+  // Sorted by offset.
+  std::vector<Slot> slots_ GUARDED_BY(mutex_);
+  android::base::unique_fd image_fd_ GUARDED_BY(mutex_);
+  // Kept open for the lifetime of apexd, otherwise the autoclear loop device
+  // would be released before any dm-verity device references it.
+  android::base::unique_fd loop_fd_ GUARDED_BY(mutex_);
+  std::string loop_name_ GUARDED_BY(mutex_);
+};
+
+}  // namespace apex
+}  // namespace android
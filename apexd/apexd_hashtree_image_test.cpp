@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "apexd_hashtree_image.h"
+#include "apexd_test_utils.h"
+
+namespace android {
+namespace apex {
+
+using android::apex::testing::IsOk;
+using android::base::ReadFullyAtOffset;
+using android::base::StringPrintf;
+using android::base::unique_fd;
+using android::base::WriteStringToFile;
+
+static constexpr uint32_t kBlockSize = 4096;
+
+TEST(ApexdHashTreeImageTest, AddsHashTreesToSeparateSlots) {
+  TemporaryDir td;
+  HashTreeImage image(StringPrintf("%s/hashtrees.img", td.path),
+                      4 * kBlockSize);
+
+  auto first_file = StringPrintf("%s/first", td.path);
+  ASSERT_TRUE(WriteStringToFile(std::string(kBlockSize + 1, 'a'), first_file));
+  auto second_file = StringPrintf("%s/second", td.path);
+  ASSERT_TRUE(WriteStringToFile(std::string(kBlockSize, 'b'), second_file));
+
+  auto first = image.AddHashTree("first@1", "aa", first_file, kBlockSize);
+  ASSERT_TRUE(IsOk(first));
+  auto second = image.AddHashTree("second@1", "bb", second_file, kBlockSize);
+  ASSERT_TRUE(IsOk(second));
+
+  // Both hashtrees are exposed through the same loop device, each one starting
+  // at a block boundary.
+  ASSERT_EQ(first->loop_name, second->loop_name);
+  ASSERT_EQ(0u, first->hash_start_block);
+  ASSERT_EQ(2u, second->hash_start_block);
+
+  unique_fd fd(open(second->loop_name.c_str(), O_RDONLY | O_CLOEXEC));
+  ASSERT_NE(-1, fd.get());
+  std::string content(kBlockSize, '\0');
+  ASSERT_TRUE(ReadFullyAtOffset(fd.get(), content.data(), kBlockSize,
+                                second->hash_start_block * kBlockSize));
+  ASSERT_EQ(std::string(kBlockSize, 'b'), content);
+}
+
+TEST(ApexdHashTreeImageTest, FailsWhenImageIsFull) {
+  TemporaryDir td;
+  HashTreeImage image(StringPrintf("%s/hashtrees.img", td.path), kBlockSize);
+
+  auto hashtree_file = StringPrintf("%s/hashtree", td.path);
+  ASSERT_TRUE(WriteStringToFile(std::string(kBlockSize, 'a'), hashtree_file));
+
+  ASSERT_TRUE(IsOk(image.AddHashTree("first@1", "aa", hashtree_file,
+                                     kBlockSize)));
+  auto result =
+      image.AddHashTree("second@1", "bb", hashtree_file, kBlockSize);
+  ASSERT_FALSE(IsOk(result));
+  ASSERT_THAT(result.error().message(),
+              ::testing::HasSubstr("Not enough space left"));
+}
+
+TEST(ApexdHashTreeImageTest, ReusesHashTreesAcrossInstances) {
+  TemporaryDir td;
+  auto path = StringPrintf("%s/hashtrees.img", td.path);
+  auto hashtree_file = StringPrintf("%s/hashtree", td.path);
+  ASSERT_TRUE(WriteStringToFile(std::string(kBlockSize, 'a'), hashtree_file));
+  {
+    HashTreeImage image(path, 4 * kBlockSize);
+    ASSERT_FALSE(IsOk(image.GetHashTree("package@1", "aa", kBlockSize)));
+    ASSERT_TRUE(IsOk(
+        image.AddHashTree("package@1", "aa", hashtree_file, kBlockSize)));
+  }
+
+  // Only a hashtree with the same root digest is reused.
+  HashTreeImage image(path, 4 * kBlockSize);
+  ASSERT_FALSE(IsOk(image.GetHashTree("package@1", "bb", kBlockSize)));
+  auto slot = image.GetHashTree("package@1", "aa", kBlockSize);
+  ASSERT_TRUE(IsOk(slot));
+  ASSERT_EQ(0u, slot->hash_start_block);
+
+  unique_fd fd(open(slot->loop_name.c_str(), O_RDONLY | O_CLOEXEC));
+  ASSERT_NE(-1, fd.get());
+  std::string content(kBlockSize, '\0');
+  ASSERT_TRUE(ReadFullyAtOffset(fd.get(), content.data(), kBlockSize, 0));
+  ASSERT_EQ(std::string(kBlockSize, 'a'), content);
+}
+
+TEST(ApexdHashTreeImageTest, ReclaimsSlotsNotInUse) {
+  TemporaryDir td;
+  auto path = StringPrintf("%s/hashtrees.img", td.path);
+  auto hashtree_file = StringPrintf("%s/hashtree", td.path);
+  ASSERT_TRUE(WriteStringToFile(std::string(kBlockSize, 'a'), hashtree_file));
+  {
+    HashTreeImage image(path, 2 * kBlockSize);
+    ASSERT_TRUE(IsOk(
+        image.AddHashTree("first@1", "aa", hashtree_file, kBlockSize)));
+    ASSERT_TRUE(IsOk(
+        image.AddHashTree("second@1", "bb", hashtree_file, kBlockSize)));
+  }
+
+  // Slots of mounted packages are kept, the others are reclaimed when space
+  // is needed.
+  HashTreeImage image(path, 2 * kBlockSize, {"first@1"});
+  auto third = image.AddHashTree("third@1", "cc", hashtree_file, kBlockSize);
+  ASSERT_TRUE(IsOk(third));
+  ASSERT_EQ(1u, third->hash_start_block);
+  ASSERT_TRUE(IsOk(image.GetHashTree("first@1", "aa", kBlockSize)));
+  ASSERT_FALSE(IsOk(image.GetHashTree("second@1", "bb", kBlockSize)));
+
+  ASSERT_FALSE(
+      IsOk(image.AddHashTree("fourth@1", "dd", hashtree_file, kBlockSize)));
+  image.ReleaseHashTree("first@1");
+  auto fourth = image.AddHashTree("fourth@1", "dd", hashtree_file, kBlockSize);
+  ASSERT_TRUE(IsOk(fourth));
+  ASSERT_EQ(0u, fourth->hash_start_block);
+}
+
+}  // namespace apex
+}  // namespace android
@@ -37,6 +37,7 @@
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
+#include "apexd_activation_watchdog.h"
 #include "apexd_utils.h"
 #include "string_log.h"
 
@@ -281,6 +282,11 @@ Result<LoopbackDeviceUniqueFd> WaitForDevice(int num) {
   unique_fd sysfs_fd;
   bool cold_boot_done = GetBoolProperty("ro.cold_boot_done", false);
   for (size_t i = 0; i != kLoopDeviceRetryAttempts; ++i) {
+    // Don't let a package stuck here hold up the others for the whole boot.
+    if (auto st = CheckActivationDeadline(); !st.ok()) {
+      return Error() << "Gave up waiting for loopback device " << num << ": "
+                     << st.error();
+    }
     if (!cold_boot_done) {
       cold_boot_done = GetBoolProperty("ro.cold_boot_done", false);
     }
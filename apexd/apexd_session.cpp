@@ -21,19 +21,32 @@
 
 #include "session_state.pb.h"
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <filesystem>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <optional>
+#include <set>
 #include <utility>
 
+using android::base::ErrnoError;
 using android::base::Error;
 using android::base::Result;
+using android::base::unique_fd;
+using android::base::WriteStringToFd;
 using android::base::StringPrintf;
+using apex::proto::SessionJournalRecord;
 using apex::proto::SessionState;
 
 namespace android {
@@ -50,6 +63,227 @@ static constexpr const char* kNewApexSessionsDir = "/metadata/apex/sessions";
 
 static constexpr const char* kStateFileName = "state";
 
+// Session changes are appended to this file in the sessions directory, and
+// only written to the state files of the sessions once it gets long enough.
+static constexpr const char* kJournalFileName = "journal";
+static constexpr size_t kMaxJournalRecords = 64;
+
+// Committed state of all sessions, so that queries don't have to read and
+// parse every state file.
+struct SessionIndex {
+  std::mutex mutex;
+  bool loaded = false;
+  // Sessions directory as of the last time it was loaded or changed by us.
+  // Sessions are directories, so creating or deleting one behind our back
+  // changes at least one of these, and committing one grows the journal.
+  ino_t dir_ino = 0;
+  timespec dir_mtime = {};
+  nlink_t dir_nlink = 0;
+  off_t journal_size = 0;
+  std::map<int, SessionState> sessions;
+  // Records in the journal, and the sessions whose state file is outdated.
+  size_t journal_records = 0;
+  std::set<int> dirty_sessions;
+};
+
+SessionIndex& GetSessionIndex() {
+  static SessionIndex index;
+  return index;
+}
+
+std::string GetJournalPath(const std::string& sessions_dir) {
+  return sessions_dir + "/" + kJournalFileName;
+}
+
+off_t GetJournalSize(const std::string& dir) {
+  struct stat st;
+  return stat(GetJournalPath(dir).c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// Records the current state of the sessions directory, after changing it.
+void UpdateDirStatLocked(SessionIndex& index, const std::string& dir) {
+  struct stat st;
+  if (stat(dir.c_str(), &st) != 0) {
+    index.loaded = false;
+    return;
+  }
+  index.dir_ino = st.st_ino;
+  index.dir_mtime = st.st_mtim;
+  index.dir_nlink = st.st_nlink;
+  index.journal_size = GetJournalSize(dir);
+}
+
+bool IsIndexUpToDateLocked(const SessionIndex& index, const std::string& dir) {
+  struct stat st;
+  if (!index.loaded || stat(dir.c_str(), &st) != 0) {
+    return false;
+  }
+  return st.st_ino == index.dir_ino &&
+         st.st_mtim.tv_sec == index.dir_mtime.tv_sec &&
+         st.st_mtim.tv_nsec == index.dir_mtime.tv_nsec &&
+         st.st_nlink == index.dir_nlink &&
+         GetJournalSize(dir) == index.journal_size;
+}
+
+// Writes |content| to |path| so that either the old or the new content
+// survives a crash.
+Result<void> WriteFileAtomically(const std::string& path,
+                                 const std::string& content) {
+  std::string tmp_path = path + ".tmp";
+  unique_fd fd(open(tmp_path.c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << tmp_path;
+  }
+  if (!WriteStringToFd(content, fd) || fsync(fd.get()) != 0) {
+    return ErrnoError() << "Failed to write " << tmp_path;
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << tmp_path << " to " << path;
+  }
+  std::string dir = std::filesystem::path(path).parent_path();
+  unique_fd dir_fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (dir_fd.get() == -1 || fsync(dir_fd.get()) != 0) {
+    return ErrnoError() << "Failed to sync " << dir;
+  }
+  return {};
+}
+
+// Appends |record| to the journal in a single write, as its size followed by
+// its content.
+Result<void> AppendToJournal(const std::string& sessions_dir,
+                             const SessionJournalRecord& record) {
+  std::string content;
+  if (!record.SerializeToString(&content)) {
+    return Error() << "Failed to serialize journal record";
+  }
+  uint32_t size = content.size();
+  content.insert(0, reinterpret_cast<const char*>(&size), sizeof(size));
+
+  std::string path = GetJournalPath(sessions_dir);
+  unique_fd fd(open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC));
+  bool created = false;
+  if (fd.get() == -1 && errno == ENOENT) {
+    fd.reset(open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                  0600));
+    created = true;
+  }
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << path;
+  }
+  if (!WriteStringToFd(content, fd) || fdatasync(fd.get()) != 0) {
+    return ErrnoError() << "Failed to append to " << path;
+  }
+  if (created) {
+    unique_fd dir_fd(
+        open(sessions_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (dir_fd.get() == -1 || fsync(dir_fd.get()) != 0) {
+      return ErrnoError() << "Failed to sync " << sessions_dir;
+    }
+  }
+  return {};
+}
+
+// Applies the records of the journal to |index|, ignoring sessions whose
+// directory no longer exists. A record cut short by a crash, and anything
+// after it, is dropped.
+void ReplayJournalLocked(SessionIndex& index, const std::string& sessions_dir,
+                         const std::set<int>& session_dirs) {
+  std::string path = GetJournalPath(sessions_dir);
+  std::string content;
+  if (!android::base::ReadFileToString(path, &content)) {
+    return;
+  }
+  size_t offset = 0;
+  while (content.size() - offset >= sizeof(uint32_t)) {
+    uint32_t size;
+    memcpy(&size, content.data() + offset, sizeof(size));
+    SessionJournalRecord record;
+    if (content.size() - offset - sizeof(size) < size ||
+        !record.ParseFromArray(content.data() + offset + sizeof(size), size)) {
+      break;
+    }
+    offset += sizeof(size) + size;
+    for (const auto& state : record.sessions()) {
+      if (session_dirs.count(state.id()) > 0) {
+        index.sessions[state.id()] = state;
+        index.dirty_sessions.insert(state.id());
+      }
+    }
+    for (int id : record.deleted_session_ids()) {
+      index.sessions.erase(id);
+      index.dirty_sessions.erase(id);
+    }
+    index.journal_records++;
+  }
+  if (offset != content.size()) {
+    LOG(WARNING) << "Dropping " << content.size() - offset
+                 << " bytes of incomplete records from " << path;
+    if (truncate(path.c_str(), offset) != 0) {
+      PLOG(ERROR) << "Failed to truncate " << path;
+    }
+    UpdateDirStatLocked(index, sessions_dir);
+  }
+}
+
+// Writes the state of every session changed since the last compaction to its
+// state file, and empties the journal.
+Result<void> CompactJournalLocked(SessionIndex& index,
+                                  const std::string& sessions_dir) {
+  for (int id : index.dirty_sessions) {
+    auto it = index.sessions.find(id);
+    if (it == index.sessions.end()) {
+      continue;
+    }
+    std::string content;
+    if (!it->second.SerializeToString(&content)) {
+      return Error() << "Failed to serialize state of session " << id;
+    }
+    auto path = StringPrintf("%s/%d/%s", sessions_dir.c_str(), id,
+                             kStateFileName);
+    if (auto st = WriteFileAtomically(path, content); !st.ok()) {
+      return st.error();
+    }
+  }
+  std::string path = GetJournalPath(sessions_dir);
+  unique_fd fd(open(path.c_str(), O_WRONLY | O_CLOEXEC));
+  if (fd.get() != -1 && (ftruncate(fd.get(), 0) != 0 || fsync(fd.get()) != 0)) {
+    return ErrnoError() << "Failed to truncate " << path;
+  }
+  index.dirty_sessions.clear();
+  index.journal_records = 0;
+  return {};
+}
+
+// Makes |record| durable and applies it to |index|.
+Result<void> CommitLocked(SessionIndex& index, const std::string& sessions_dir,
+                          const SessionJournalRecord& record) {
+  for (const auto& state : record.sessions()) {
+    auto dir = StringPrintf("%s/%d", sessions_dir.c_str(), state.id());
+    if (access(dir.c_str(), F_OK) != 0) {
+      return ErrnoError() << "Can't access " << dir;
+    }
+  }
+  if (auto st = AppendToJournal(sessions_dir, record); !st.ok()) {
+    return st;
+  }
+  for (const auto& state : record.sessions()) {
+    index.sessions[state.id()] = state;
+    index.dirty_sessions.insert(state.id());
+  }
+  for (int id : record.deleted_session_ids()) {
+    index.sessions.erase(id);
+    index.dirty_sessions.erase(id);
+  }
+  if (++index.journal_records >= kMaxJournalRecords) {
+    if (auto st = CompactJournalLocked(index, sessions_dir); !st.ok()) {
+      LOG(WARNING) << "Failed to compact sessions journal: " << st.error();
+    }
+  }
+  UpdateDirStatLocked(index, sessions_dir);
+  return {};
+}
+
 }  // namespace
 
 ApexSession::ApexSession(SessionState state) : state_(std::move(state)) {}
@@ -81,6 +315,11 @@ Result<ApexSession> ApexSession::CreateSession(int session_id) {
   }
   state.set_id(session_id);
 
+  auto& index = GetSessionIndex();
+  std::lock_guard lock(index.mutex);
+  if (index.loaded) {
+    UpdateDirStatLocked(index, GetSessionsDir());
+  }
   return ApexSession(state);
 }
 
@@ -99,33 +338,73 @@ Result<ApexSession> ApexSession::GetSessionFromFile(const std::string& path) {
 }
 
 Result<ApexSession> ApexSession::GetSession(int session_id) {
-  auto path = StringPrintf("%s/%d/%s", GetSessionsDir().c_str(), session_id,
-                           kStateFileName);
-
-  return GetSessionFromFile(path);
+  auto& index = GetSessionIndex();
+  std::lock_guard lock(index.mutex);
+  LoadIndexIfNeededLocked();
+  auto it = index.sessions.find(session_id);
+  if (it == index.sessions.end()) {
+    return Error() << "Failed to find session " << session_id << " in "
+                   << GetSessionsDir();
+  }
+  return ApexSession(it->second);
 }
 
-std::vector<ApexSession> ApexSession::GetSessions() {
-  std::vector<ApexSession> sessions;
+void ApexSession::LoadIndexIfNeededLocked() {
+  auto& index = GetSessionIndex();
+  const std::string& sessions_dir = GetSessionsDir();
+  if (IsIndexUpToDateLocked(index, sessions_dir)) {
+    return;
+  }
+  index.sessions.clear();
+  index.dirty_sessions.clear();
+  index.journal_records = 0;
+  UpdateDirStatLocked(index, sessions_dir);
+  index.loaded = true;
 
   Result<std::vector<std::string>> session_paths = ReadDir(
-      GetSessionsDir(), [](const std::filesystem::directory_entry& entry) {
+      sessions_dir, [](const std::filesystem::directory_entry& entry) {
         std::error_code ec;
         return entry.is_directory(ec);
       });
 
   if (!session_paths.ok()) {
-    return sessions;
+    return;
   }
 
+  std::set<int> session_dirs;
   for (const std::string& session_dir_path : *session_paths) {
+    int id;
+    if (android::base::ParseInt(
+            std::filesystem::path(session_dir_path).filename().string(),
+            &id)) {
+      session_dirs.insert(id);
+    }
+    // Sessions committed since the last compaction only have a state file if
+    // they had one before.
+    std::string state_path = session_dir_path + "/" + kStateFileName;
+    if (access(state_path.c_str(), F_OK) != 0) {
+      continue;
+    }
     // Try to read session state
-    auto session = GetSessionFromFile(session_dir_path + "/" + kStateFileName);
+    auto session = GetSessionFromFile(state_path);
     if (!session.ok()) {
       LOG(WARNING) << session.error();
       continue;
     }
-    sessions.push_back(std::move(*session));
+    index.sessions.emplace(session->GetId(), std::move(session->state_));
+  }
+  ReplayJournalLocked(index, sessions_dir, session_dirs);
+}
+
+std::vector<ApexSession> ApexSession::GetSessions() {
+  std::vector<ApexSession> sessions;
+
+  auto& index = GetSessionIndex();
+  std::lock_guard lock(index.mutex);
+  LoadIndexIfNeededLocked();
+  sessions.reserve(index.sessions.size());
+  for (const auto& [id, state] : index.sessions) {
+    sessions.push_back(ApexSession(state));
   }
 
   return sessions;
@@ -238,13 +517,33 @@ Result<void> ApexSession::UpdateStateAndCommit(
     const SessionState::State& session_state) {
   state_.set_state(session_state);
 
-  auto state_file_path = StringPrintf("%s/%d/%s", GetSessionsDir().c_str(),
-                                      state_.id(), kStateFileName);
+  SessionJournalRecord record;
+  *record.add_sessions() = state_;
+  auto& index = GetSessionIndex();
+  std::lock_guard lock(index.mutex);
+  LoadIndexIfNeededLocked();
+  if (auto st = CommitLocked(index, GetSessionsDir(), record); !st.ok()) {
+    return Error() << "Failed to commit state of session " << state_.id()
+                   << ": " << st.error();
+  }
 
-  std::fstream state_file(state_file_path,
-                          std::ios::out | std::ios::trunc | std::ios::binary);
-  if (!state_.SerializeToOstream(&state_file)) {
-    return Error() << "Failed to write state file " << state_file_path;
+  return {};
+}
+
+Result<void> ApexSession::UpdateStateAndCommitAll(
+    std::vector<ApexSession>& sessions,
+    const SessionState::State& session_state) {
+  SessionJournalRecord record;
+  for (auto& session : sessions) {
+    session.state_.set_state(session_state);
+    *record.add_sessions() = session.state_;
+  }
+  auto& index = GetSessionIndex();
+  std::lock_guard lock(index.mutex);
+  LoadIndexIfNeededLocked();
+  if (auto st = CommitLocked(index, GetSessionsDir(), record); !st.ok()) {
+    return Error() << "Failed to commit state of " << sessions.size()
+                   << " sessions: " << st.error();
   }
 
   return {};
@@ -255,8 +554,34 @@ Result<void> ApexSession::DeleteSession() const {
   LOG(INFO) << "Deleting " << session_dir;
   auto path = std::filesystem::path(session_dir);
   std::error_code error_code;
+  auto& index = GetSessionIndex();
+  std::lock_guard lock(index.mutex);
+  // Deletions are journaled too, so that a session with the same id created
+  // later doesn't inherit older records.
+  LoadIndexIfNeededLocked();
+  // The state file goes first, so that the session can't come back from it
+  // once the journal is compacted, even if the rest of its directory can't be
+  // removed.
+  std::string state_path = session_dir + "/" + kStateFileName;
+  if (unlink(state_path.c_str()) != 0 && errno != ENOENT) {
+    return ErrnoError() << "Failed to delete " << state_path;
+  }
+  unique_fd dir_fd(
+      open(session_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (dir_fd.get() != -1 && fsync(dir_fd.get()) != 0) {
+    return ErrnoError() << "Failed to sync " << session_dir;
+  }
+  SessionJournalRecord record;
+  record.add_deleted_session_ids(GetId());
+  if (auto st = CommitLocked(index, GetSessionsDir(), record); !st.ok()) {
+    return Error() << "Failed to delete " << session_dir << " : "
+                   << st.error();
+  }
   std::filesystem::remove_all(path, error_code);
+  UpdateDirStatLocked(index, GetSessionsDir());
   if (error_code) {
+    // Part of the session might be left, find out on the next query.
+    index.loaded = false;
     return Error() << "Failed to delete " << session_dir << " : "
                    << error_code.message();
   }
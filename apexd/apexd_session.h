@@ -72,6 +72,10 @@ class ApexSession {
 
   android::base::Result<void> UpdateStateAndCommit(
       const ::apex::proto::SessionState::State& state);
+  // Like UpdateStateAndCommit, but for all |sessions| in a single write.
+  static android::base::Result<void> UpdateStateAndCommitAll(
+      std::vector<ApexSession>& sessions,
+      const ::apex::proto::SessionState::State& state);
 
   android::base::Result<void> DeleteSession() const;
   static void DeleteFinalizedSessions();
@@ -82,6 +86,9 @@ class ApexSession {
 
   static android::base::Result<ApexSession> GetSessionFromFile(
       const std::string& path);
+  // Loads the state of all sessions, unless it's already loaded and the
+  // sessions directory wasn't changed since. Requires the index lock.
+  static void LoadIndexIfNeededLocked();
 };
 
 std::ostream& operator<<(std::ostream& out, const ApexSession& session);
@@ -19,12 +19,16 @@
 #include <string>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 
 #include <android-base/file.h>
 #include <android-base/result.h>
 #include <android-base/scopeguard.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
 
 #include "apexd_session.h"
@@ -121,6 +125,123 @@ TEST(ApexdSessionTest, MigrateToMetadataSessionsDir) {
   ASSERT_EQ(SessionState::ACTIVATION_FAILED, migrated_session_2->GetState());
 }
 
+TEST(ApexdSessionTest, CommittedStateIsVisibleWithoutRereading) {
+  namespace fs = std::filesystem;
+
+  std::string session_dir = ApexSession::GetSessionsDir() + "/4242";
+  auto deleter = make_scope_guard([&]() { fs::remove_all(session_dir); });
+
+  auto session = ApexSession::CreateSession(4242);
+  ASSERT_TRUE(IsOk(session));
+  ASSERT_TRUE(IsOk(session->UpdateStateAndCommit(SessionState::STAGED)));
+  ASSERT_TRUE(IsOk(session->UpdateStateAndCommit(SessionState::ACTIVATED)));
+  // Commits go to the journal, nothing else is left behind.
+  ASSERT_FALSE(fs::exists(session_dir + "/state.tmp"));
+
+  auto committed = ApexSession::GetSession(4242);
+  ASSERT_TRUE(IsOk(committed));
+  ASSERT_EQ(SessionState::ACTIVATED, committed->GetState());
+
+  // Sessions removed behind apexd's back are noticed too.
+  fs::remove_all(session_dir);
+  ASSERT_FALSE(IsOk(ApexSession::GetSession(4242)));
+  for (const auto& s : ApexSession::GetSessions()) {
+    ASSERT_NE(4242, s.GetId());
+  }
+}
+
+TEST(ApexdSessionTest, JournalIsCompactedAndSurvivesTornRecords) {
+  namespace fs = std::filesystem;
+
+  std::string sessions_dir = ApexSession::GetSessionsDir();
+  auto deleter = make_scope_guard([&]() {
+    fs::remove_all(sessions_dir + "/4243");
+    fs::remove_all(sessions_dir + "/4244");
+  });
+
+  auto session_1 = ApexSession::CreateSession(4243);
+  ASSERT_TRUE(IsOk(session_1));
+  auto session_2 = ApexSession::CreateSession(4244);
+  ASSERT_TRUE(IsOk(session_2));
+  std::vector<ApexSession> sessions = {*session_1, *session_2};
+  // Enough commits to fill the journal more than once.
+  for (int i = 0; i < 100; i++) {
+    auto state = i % 2 == 0 ? SessionState::STAGED : SessionState::ACTIVATED;
+    ASSERT_TRUE(IsOk(ApexSession::UpdateStateAndCommitAll(sessions, state)));
+  }
+  ASSERT_TRUE(IsOk(session_1->UpdateStateAndCommit(SessionState::SUCCESS)));
+  // Compaction wrote the state files at least once.
+  ASSERT_TRUE(fs::exists(sessions_dir + "/4243/state"));
+  ASSERT_TRUE(fs::exists(sessions_dir + "/4244/state"));
+
+  // A record cut short by a crash is dropped when the journal is read again.
+  std::string garbage("\xff\xff\x00\x00torn", 8);
+  std::ofstream journal(sessions_dir + "/journal",
+                        std::ios::binary | std::ios::app);
+  journal << garbage;
+  journal.close();
+
+  auto committed_1 = ApexSession::GetSession(4243);
+  ASSERT_TRUE(IsOk(committed_1));
+  ASSERT_EQ(SessionState::SUCCESS, committed_1->GetState());
+  auto committed_2 = ApexSession::GetSession(4244);
+  ASSERT_TRUE(IsOk(committed_2));
+  ASSERT_EQ(SessionState::ACTIVATED, committed_2->GetState());
+}
+
+// Sets or clears FS_IMMUTABLE_FL, which even root can't unlink past.
+bool SetImmutable(const std::string& path, bool immutable) {
+  android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  int flags;
+  if (fd.get() == -1 || ioctl(fd.get(), FS_IOC_GETFLAGS, &flags) != 0) {
+    return false;
+  }
+  flags = immutable ? flags | FS_IMMUTABLE_FL : flags & ~FS_IMMUTABLE_FL;
+  return ioctl(fd.get(), FS_IOC_SETFLAGS, &flags) == 0;
+}
+
+TEST(ApexdSessionTest, DeletedSessionIsNotResurrectedByCompaction) {
+  namespace fs = std::filesystem;
+
+  std::string sessions_dir = ApexSession::GetSessionsDir();
+  std::string leftover = sessions_dir + "/4245/leftover";
+  auto deleter = make_scope_guard([&]() {
+    SetImmutable(leftover, false);
+    fs::remove_all(sessions_dir + "/4245");
+    fs::remove_all(sessions_dir + "/4246");
+  });
+
+  auto deleted = ApexSession::CreateSession(4245);
+  ASSERT_TRUE(IsOk(deleted));
+  auto other = ApexSession::CreateSession(4246);
+  ASSERT_TRUE(IsOk(other));
+  std::vector<ApexSession> sessions = {*deleted, *other};
+  for (int i = 0; i < 100; i++) {
+    auto state = i % 2 == 0 ? SessionState::STAGED : SessionState::ACTIVATED;
+    ASSERT_TRUE(IsOk(ApexSession::UpdateStateAndCommitAll(sessions, state)));
+  }
+  ASSERT_TRUE(fs::exists(sessions_dir + "/4245/state"));
+
+  // Part of the session directory can't be removed.
+  ASSERT_TRUE(android::base::WriteStringToFile("", leftover));
+  if (!SetImmutable(leftover, true)) {
+    GTEST_SKIP() << "Immutable files are not supported on " << sessions_dir;
+  }
+  ASSERT_FALSE(IsOk(deleted->DeleteSession()));
+  ASSERT_FALSE(fs::exists(sessions_dir + "/4245/state"));
+
+  // Compacting the journal drops the deletion record.
+  for (int i = 0; i < 100; i++) {
+    auto state = i % 2 == 0 ? SessionState::STAGED : SessionState::ACTIVATED;
+    ASSERT_TRUE(IsOk(other->UpdateStateAndCommit(state)));
+  }
+
+  ASSERT_FALSE(IsOk(ApexSession::GetSession(4245)));
+  auto committed = ApexSession::GetSession(4246);
+  ASSERT_TRUE(IsOk(committed));
+  ASSERT_EQ(SessionState::ACTIVATED, committed->GetState());
+}
+
 }  // namespace
 }  // namespace apex
 }  // namespace android
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <sys/stat.h>
+
 #include <string>
 #include <vector>
 
@@ -35,6 +37,7 @@
 #include "apex_manifest.pb.h"
 #include "com_android_apex.h"
 #include "gmock/gmock-matchers.h"
+#include "session_state.pb.h"
 
 namespace android {
 namespace apex {
@@ -44,6 +47,7 @@ namespace fs = std::filesystem;
 using MountedApexData = MountedApexDatabase::MountedApexData;
 using android::apex::testing::ApexFileEq;
 using android::apex::testing::IsOk;
+using android::base::EndsWith;
 using android::base::GetExecutableDirectory;
 using android::base::GetProperty;
 using android::base::make_scope_guard;
@@ -360,6 +364,137 @@ TEST_F(ApexdUnitTest, ProcessCompressedApex) {
               UnorderedElementsAre(ApexFileEq(ByRef(*decompressed_apex))));
 }
 
+TEST_F(ApexdUnitTest, ProcessCompressedApexUsesReservedSpace) {
+  auto compressed_apex = ApexFile::Open(
+      AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
+  ASSERT_TRUE(IsOk(ReserveSpaceForCompressedApex(
+      {{"com.android.apex.compressed", 10 * 1024 * 1024}, {"other", 100}},
+      GetOtaReservedDir())));
+
+  std::vector<ApexFileRef> compressed_apex_list;
+  compressed_apex_list.emplace_back(std::cref(*compressed_apex));
+  auto return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+  ASSERT_EQ(return_value.size(), 1u);
+
+  // The reservation was consumed, leaving the other package's alone
+  auto files = ReadDir(GetOtaReservedDir(), [](auto _) { return true; });
+  ASSERT_TRUE(IsOk(files));
+  ASSERT_THAT(*files, UnorderedElementsAre(GetReservedSpacePath(
+                          GetOtaReservedDir(), "other")));
+
+  // Decompressed APEX is the same as original apex, despite the larger
+  // reservation
+  std::string decompressed_file_path = StringPrintf(
+      "%s/com.android.apex.compressed@1%s", GetDecompressionDir().c_str(),
+      kDecompressedApexPackageSuffix);
+  auto comparison_result = CompareFiles(
+      GetTestFile("com.android.apex.compressed.v1_original.apex"),
+      decompressed_file_path);
+  ASSERT_TRUE(IsOk(comparison_result));
+  ASSERT_TRUE(*comparison_result);
+}
+
+TEST_F(ApexdUnitTest, ProcessCompressedApexKeepsOtherReservationsInParallel) {
+  // v1 and v2 have different package ids, so they are decompressed in
+  // parallel, but only one of them can claim the package's reservation.
+  auto capex_v1 = ApexFile::Open(
+      AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
+  auto capex_v2 =
+      ApexFile::Open(GetTestFile("com.android.apex.compressed.v2.capex"));
+  ASSERT_TRUE(IsOk(ReserveSpaceForCompressedApex(
+      {{"com.android.apex.compressed", 10 * 1024 * 1024},
+       {"other", 100},
+       {"another", 100}},
+      GetOtaReservedDir())));
+  // Aggregate reservation left behind by an older caller
+  ASSERT_TRUE(IsOk(ReserveSpaceForCompressedApex(100, GetOtaReservedDir())));
+
+  std::vector<ApexFileRef> compressed_apex_list;
+  compressed_apex_list.emplace_back(std::cref(*capex_v1));
+  compressed_apex_list.emplace_back(std::cref(*capex_v2));
+  auto return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+  ASSERT_EQ(return_value.size(), 2u);
+
+  // Only the claimed reservation and the aggregate one are gone
+  auto files = ReadDir(GetOtaReservedDir(), [](auto _) { return true; });
+  ASSERT_TRUE(IsOk(files));
+  ASSERT_THAT(*files,
+              UnorderedElementsAre(
+                  GetReservedSpacePath(GetOtaReservedDir(), "other"),
+                  GetReservedSpacePath(GetOtaReservedDir(), "another")));
+}
+
+TEST_F(ApexdUnitTest, PreRebootDecompression) {
+  auto capex_path = AddPreInstalledApex("com.android.apex.compressed.v1.capex");
+  ASSERT_TRUE(IsOk(StartPreRebootDecompression(
+      {capex_path, GetTestFile("apex.apexd_test.apex")})));
+  WaitForPreRebootDecompression();
+
+  auto status = GetPreRebootDecompressionStatus();
+  EXPECT_FALSE(status.is_running);
+  EXPECT_FALSE(status.is_cancelled);
+  EXPECT_EQ(status.total_count, 2u);
+  EXPECT_EQ(status.completed_count, 1u);
+  // Uncompressed APEX can't be decompressed
+  EXPECT_EQ(status.failed_count, 1u);
+  EXPECT_EQ(status.current_capex_path, "");
+
+  std::string ota_apex_path =
+      StringPrintf("%s/com.android.apex.compressed@1%s",
+                   GetDecompressionDir().c_str(), kOtaApexPackageSuffix);
+  auto comparison_result = CompareFiles(
+      GetTestFile("com.android.apex.compressed.v1_original.apex"),
+      ota_apex_path);
+  ASSERT_TRUE(IsOk(comparison_result));
+  ASSERT_TRUE(*comparison_result);
+}
+
+TEST_F(ApexdUnitTest, PreRebootDecompressionCancelled) {
+  auto capex_path = AddPreInstalledApex("com.android.apex.compressed.v1.capex");
+  // Cancelling only affects the decompression already started.
+  CancelPreRebootDecompression();
+  ASSERT_TRUE(IsOk(StartPreRebootDecompression({capex_path})));
+  WaitForPreRebootDecompression();
+  EXPECT_EQ(GetPreRebootDecompressionStatus().completed_count, 1u);
+  EXPECT_FALSE(GetPreRebootDecompressionStatus().is_cancelled);
+
+  // Cancel once the second CAPEX is done
+  size_t processed_count = 0;
+  SetPreRebootDecompressionCallbackForTesting([&](const std::string&) {
+    if (++processed_count == 2) {
+      CancelPreRebootDecompression();
+    }
+  });
+  auto reset_callback = make_scope_guard(
+      []() { SetPreRebootDecompressionCallbackForTesting(nullptr); });
+  std::vector<std::string> capex_paths(5, capex_path);
+  ASSERT_TRUE(IsOk(StartPreRebootDecompression(capex_paths)));
+  WaitForPreRebootDecompression();
+  auto status = GetPreRebootDecompressionStatus();
+  EXPECT_FALSE(status.is_running);
+  EXPECT_TRUE(status.is_cancelled);
+  EXPECT_EQ(status.total_count, 5u);
+  EXPECT_EQ(status.completed_count, 2u);
+  EXPECT_EQ(status.failed_count, 0u);
+  EXPECT_EQ(processed_count, 2u);
+}
+
+TEST_F(ApexdUnitTest, PreRebootDecompressionCancelledAfterLastCapex) {
+  auto capex_path = AddPreInstalledApex("com.android.apex.compressed.v1.capex");
+  // Nothing is left to skip, so the decompression isn't reported as cancelled
+  SetPreRebootDecompressionCallbackForTesting(
+      [](const std::string&) { CancelPreRebootDecompression(); });
+  auto reset_callback = make_scope_guard(
+      []() { SetPreRebootDecompressionCallbackForTesting(nullptr); });
+  ASSERT_TRUE(IsOk(StartPreRebootDecompression({capex_path})));
+  WaitForPreRebootDecompression();
+  auto status = GetPreRebootDecompressionStatus();
+  EXPECT_FALSE(status.is_cancelled);
+  EXPECT_EQ(status.completed_count, 1u);
+}
+
 TEST_F(ApexdUnitTest, ProcessCompressedApexRunsVerification) {
   auto compressed_apex_mismatch_key = ApexFile::Open(AddPreInstalledApex(
       "com.android.apex.compressed_key_mismatch_with_original.capex"));
@@ -416,6 +551,29 @@ TEST_F(ApexdUnitTest, ValidateDecompressedApex) {
       HasSubstr("Public key of compressed APEX is different than original"));
 }
 
+TEST_F(ApexdUnitTest, ProcessCompressedApexSkipsFailedOnes) {
+  auto not_decompressible = ApexFile::Open(AddPreInstalledApex(
+      "com.android.apex.compressed.v1_not_decompressible.capex"));
+  auto compressed_apex = ApexFile::Open(
+      AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
+
+  std::vector<ApexFileRef> compressed_apex_list;
+  compressed_apex_list.emplace_back(std::cref(*not_decompressible));
+  compressed_apex_list.emplace_back(std::cref(*compressed_apex));
+  auto return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+
+  // Both share a decompression path, so they are processed one after the
+  // other, and the failure doesn't affect the valid CAPEX.
+  std::string decompressed_file_path = StringPrintf(
+      "%s/com.android.apex.compressed@1%s", GetDecompressionDir().c_str(),
+      kDecompressedApexPackageSuffix);
+  auto decompressed_apex = ApexFile::Open(decompressed_file_path);
+  ASSERT_TRUE(IsOk(decompressed_apex));
+  ASSERT_THAT(return_value,
+              UnorderedElementsAre(ApexFileEq(ByRef(*decompressed_apex))));
+}
+
 TEST_F(ApexdUnitTest, ProcessCompressedApexCanBeCalledMultipleTimes) {
   auto compressed_apex = ApexFile::Open(
       AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
@@ -724,6 +882,51 @@ TEST_F(ApexdUnitTest, ReserveSpaceForCapexCleansOtaApex) {
   ASSERT_FALSE(*path_exists);
 }
 
+TEST_F(ApexdUnitTest, ReserveSpaceForCompressedApexAllocatesBlocks) {
+  TemporaryDir dest_dir;
+  constexpr int64_t kSize = 1024 * 1024;
+
+  ASSERT_TRUE(IsOk(ReserveSpaceForCompressedApex(kSize, dest_dir.path)));
+  auto files = ReadDir(dest_dir.path, [](auto _) { return true; });
+  ASSERT_TRUE(IsOk(files));
+  ASSERT_EQ(files->size(), 1u);
+  struct stat st;
+  ASSERT_EQ(stat((*files)[0].c_str(), &st), 0);
+  EXPECT_EQ(st.st_size, kSize);
+  // Blocks are really allocated, the file isn't sparse
+  EXPECT_GE(st.st_blocks * 512, kSize);
+}
+
+TEST_F(ApexdUnitTest, ReserveSpaceForCompressedApexPerPackage) {
+  TemporaryDir dest_dir;
+  const std::string reserved_a = GetReservedSpacePath(dest_dir.path, "a");
+  const std::string reserved_b = GetReservedSpacePath(dest_dir.path, "b");
+
+  ASSERT_TRUE(IsOk(
+      ReserveSpaceForCompressedApex({{"a", 100}, {"b", 200}}, dest_dir.path)));
+  auto files = ReadDir(dest_dir.path, [](auto _) { return true; });
+  ASSERT_TRUE(IsOk(files));
+  ASSERT_THAT(*files, UnorderedElementsAre(reserved_a, reserved_b));
+  EXPECT_EQ(fs::file_size(reserved_a), 100u);
+  EXPECT_EQ(fs::file_size(reserved_b), 200u);
+
+  // Packages no longer in the list lose their reservation
+  ASSERT_TRUE(IsOk(ReserveSpaceForCompressedApex({{"b", 50}}, dest_dir.path)));
+  files = ReadDir(dest_dir.path, [](auto _) { return true; });
+  ASSERT_TRUE(IsOk(files));
+  ASSERT_THAT(*files, UnorderedElementsAre(reserved_b));
+  EXPECT_EQ(fs::file_size(reserved_b), 50u);
+
+  // Negative sizes are rejected without touching existing reservations
+  ASSERT_FALSE(IsOk(ReserveSpaceForCompressedApex({{"b", -1}}, dest_dir.path)));
+  EXPECT_EQ(fs::file_size(reserved_b), 50u);
+
+  ASSERT_TRUE(IsOk(ReserveSpaceForCompressedApex({}, dest_dir.path)));
+  files = ReadDir(dest_dir.path, [](auto _) { return true; });
+  ASSERT_TRUE(IsOk(files));
+  ASSERT_EQ(files->size(), 0u);
+}
+
 TEST_F(ApexdUnitTest, ReserveSpaceForCompressedApexErrorForNegativeValue) {
   TemporaryDir dest_dir;
   // Should return error if negative value is passed
@@ -992,6 +1195,30 @@ TEST_F(ApexdMountTest, InstallPackagePreInstallVersionActive) {
       });
 }
 
+TEST_F(ApexdMountTest, InstallPackageIgnoresCheckpointOfAnotherFile) {
+  std::string file_path = AddPreInstalledApex("test.rebootless_apex_v1.apex");
+  ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
+
+  ASSERT_TRUE(IsOk(ActivatePackage(file_path)));
+  UnmountOnTearDown(file_path);
+
+  // Claims that the whole payload was read already, but for another file.
+  ::apex::proto::VerificationCheckpoint checkpoint;
+  checkpoint.set_ino(1);
+  checkpoint.set_verified_bytes(1024 * 1024 * 1024);
+  std::string checkpoint_path =
+      GetHashTreeDir() + "/test.apex.rebootless@2.progress";
+  ASSERT_TRUE(
+      WriteStringToFile(checkpoint.SerializeAsString(), checkpoint_path));
+
+  auto ret = InstallPackage(GetTestFile("test.rebootless_apex_v2.apex"));
+  ASSERT_TRUE(IsOk(ret));
+  UnmountOnTearDown(ret->GetPath());
+
+  // The checkpoint is gone once the payload was read in full.
+  ASSERT_NE(0, access(checkpoint_path.c_str(), F_OK));
+}
+
 TEST_F(ApexdMountTest, InstallPackagePreInstallVersionActiveSamegrade) {
   std::string file_path = AddPreInstalledApex("test.rebootless_apex_v1.apex");
   ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
@@ -1416,6 +1643,34 @@ TEST_F(ApexdMountTest, RemoveInactiveDataApex) {
   ASSERT_FALSE(*PathExists(data_apex));
 }
 
+TEST_F(ApexdUnitTest, RemoveInactiveDataApexRemovesStalePartialDecompressions) {
+  AddPreInstalledApex("com.android.apex.compressed.v2.capex");
+  ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
+
+  auto partial_path = [&](const std::string& id, const char* suffix) {
+    return StringPrintf("%s/%s%s%s", GetDecompressionDir().c_str(),
+                        id.c_str(), kDecompressedApexPackageSuffix, suffix);
+  };
+  // Left by the decompression of a CAPEX that is no longer pre-installed
+  auto stale_partial =
+      partial_path("com.android.apex.compressed@1", ".partial");
+  auto stale_progress =
+      partial_path("com.android.apex.compressed@1", ".progress");
+  // Can still be resumed
+  auto partial = partial_path("com.android.apex.compressed@2", ".partial");
+  auto progress = partial_path("com.android.apex.compressed@2", ".progress");
+  for (const auto& path : {stale_partial, stale_progress, partial, progress}) {
+    ASSERT_TRUE(WriteStringToFile("", path));
+  }
+
+  RemoveInactiveDataApex();
+
+  ASSERT_FALSE(*PathExists(stale_partial));
+  ASSERT_FALSE(*PathExists(stale_progress));
+  ASSERT_TRUE(*PathExists(partial));
+  ASSERT_TRUE(*PathExists(progress));
+}
+
 TEST_F(ApexdMountTest, OnOtaChrootBootstrapOnlyPreInstalledApexes) {
   std::string apex_path_1 = AddPreInstalledApex("apex.apexd_test.apex");
   std::string apex_path_2 =
@@ -2660,6 +2915,36 @@ TEST_F(ApexdMountTest, OnStartDataHasHigherVersion) {
                                    "/apex/com.android.apex.test_package_2@1"));
 }
 
+TEST_F(ApexdMountTest, OnStartMisnamedDataApexWinsOverEarlyActivation) {
+  MockCheckpointInterface checkpoint_interface;
+  // Need to call InitializeVold before calling OnStart
+  InitializeVold(&checkpoint_interface);
+
+  AddPreInstalledApex("apex.apexd_test.apex");
+  std::string apex_path_2 =
+      AddPreInstalledApex("apex.apexd_test_different_app.apex");
+  // Named after the other package, so that com.android.apex.test_package is
+  // activated early and has to be replaced.
+  std::string apex_path_3 = AddDataApex(
+      "apex.apexd_test_v2.apex", "com.android.apex.test_package_2@1.apex");
+
+  ASSERT_RESULT_OK(
+      ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()}));
+
+  OnStart();
+
+  UnmountOnTearDown(apex_path_2);
+  UnmountOnTearDown(apex_path_3);
+
+  ASSERT_EQ(GetProperty(kTestApexdStatusSysprop, ""), "starting");
+  auto apex_mounts = GetApexMounts();
+  ASSERT_THAT(apex_mounts,
+              UnorderedElementsAre("/apex/com.android.apex.test_package",
+                                   "/apex/com.android.apex.test_package@2",
+                                   "/apex/com.android.apex.test_package_2",
+                                   "/apex/com.android.apex.test_package_2@1"));
+}
+
 TEST_F(ApexdMountTest, OnStartDataHasWrongSHA) {
   MockCheckpointInterface checkpoint_interface;
   // Need to call InitializeVold before calling OnStart
@@ -2786,6 +3071,45 @@ TEST_F(ApexdMountTest, OnStartFailsToActivateApexOnDataFallsBackToBuiltIn) {
                          });
 }
 
+TEST_F(ApexdMountTest, OnStartOverrunningDataApexFallsBackWithoutRevert) {
+  MockCheckpointInterface checkpoint_interface;
+  // Need to call InitializeVold before calling OnStart
+  InitializeVold(&checkpoint_interface);
+
+  std::string apex_path = AddPreInstalledApex("apex.apexd_test.apex");
+  ASSERT_RESULT_OK(
+      ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()}));
+  auto apex_session = CreateStagedSession("apex.apexd_test_v2.apex", 123);
+  ASSERT_RESULT_OK(apex_session);
+  ASSERT_RESULT_OK(apex_session->UpdateStateAndCommit(SessionState::STAGED));
+
+  // Every stage overruns, so the data apex is failed.
+  ActivationDeadlines deadlines;
+  for (auto stage : {ActivationStage::kVerifyPayload,
+                     ActivationStage::kLoopDevice, ActivationStage::kDmVerity,
+                     ActivationStage::kReadVerity, ActivationStage::kMount}) {
+    deadlines[stage] = std::chrono::milliseconds(0);
+  }
+  SetActivationDeadlinesForTesting(deadlines);
+  auto reset_deadlines = make_scope_guard(
+      []() { SetActivationDeadlinesForTesting(std::nullopt); });
+
+  OnStart();
+
+  UnmountOnTearDown(apex_path);
+
+  // The pre-installed apex is activated instead, and the session is kept.
+  auto& db = GetApexDatabaseForTesting();
+  db.ForallMountedApexes("com.android.apex.test_package",
+                         [&](const MountedApexData& data, bool latest) {
+                           ASSERT_TRUE(latest);
+                           ASSERT_EQ(data.full_path, apex_path);
+                         });
+  apex_session = ApexSession::GetSession(123);
+  ASSERT_RESULT_OK(apex_session);
+  ASSERT_EQ(apex_session->GetState(), SessionState::ACTIVATED);
+}
+
 TEST_F(ApexdMountTest, OnStartApexOnDataHasWrongKeyFallsBackToBuiltIn) {
   MockCheckpointInterface checkpoint_interface;
   // Need to call InitializeVold before calling OnStart
@@ -3473,6 +3797,66 @@ TEST_F(ApexdMountTest, UnmountAllSharedLibsApex) {
   ASSERT_EQ(new_apex_mounts.size(), 0u);
 }
 
+TEST_F(ApexdMountTest, AbortStagedSessionAfterVerifiedCommit) {
+  AddPreInstalledApex("apex.apexd_test.apex");
+  ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
+  CreateDirIfNeeded(GetStagedDir(239), 0755);
+  fs::copy(GetTestFile("apex.apexd_test_v2.apex"), GetStagedDir(239));
+
+  // Abort once the session is committed, before SubmitStagedSession returns
+  std::optional<Result<void>> abort_status;
+  SetSessionVerifiedCallbackForTesting(
+      [&](int session_id) { abort_status = AbortStagedSession(session_id); });
+  auto reset_callback = make_scope_guard(
+      []() { SetSessionVerifiedCallbackForTesting(nullptr); });
+
+  ASSERT_RESULT_OK(SubmitStagedSession(239, {}, false, false, 0));
+  ASSERT_TRUE(abort_status.has_value());
+  ASSERT_RESULT_OK(*abort_status);
+  // The abort wasn't lost on the committed session
+  ASSERT_FALSE(IsOk(ApexSession::GetSession(239)));
+}
+
+TEST_F(ApexdMountTest, AbortStagedSessionRemovesVerificationCheckpoint) {
+  AddPreInstalledApex("apex.apexd_test.apex");
+  ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
+  auto session = CreateStagedSession("apex.apexd_test_v2.apex", 239);
+  ASSERT_TRUE(IsOk(session));
+  ASSERT_TRUE(IsOk(session->UpdateStateAndCommit(SessionState::STAGED)));
+  // Left by a verification that was interrupted.
+  std::string checkpoint_path =
+      GetHashTreeDir() + "/com.android.apex.test_package@2.progress";
+  ASSERT_TRUE(WriteStringToFile("", checkpoint_path));
+
+  ASSERT_RESULT_OK(AbortStagedSession(239));
+  ASSERT_NE(0, access(checkpoint_path.c_str(), F_OK));
+}
+
+TEST_F(ApexdMountTest, SubmitStagedSessionReportsFirstFailedChild) {
+  AddPreInstalledApex("apex.apexd_test.apex");
+  ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
+  // The first child verifies, the other two fail in different ways.
+  CreateDirIfNeeded(GetStagedDir(240), 0755);
+  fs::copy(GetTestFile("apex.apexd_test_v2.apex"), GetStagedDir(240));
+  CreateDirIfNeeded(GetStagedDir(241), 0755);
+  fs::copy(GetTestFile("apex.apexd_test_v2.apex"), GetStagedDir(241));
+  fs::copy(GetTestFile("apex.apexd_test.apex"), GetStagedDir(241));
+  CreateDirIfNeeded(GetStagedDir(242), 0755);
+  fs::copy(GetTestFile("com.android.apex.compressed.v1_original.apex"),
+           GetStagedDir(242));
+
+  auto status = SubmitStagedSession(239, {240, 241, 242}, false, false, 0);
+  ASSERT_FALSE(IsOk(status));
+  // Same error as when the children are verified one after another.
+  ASSERT_THAT(status.error().message(),
+              HasSubstr("More than one APEX package found"));
+  ASSERT_FALSE(IsOk(ApexSession::GetSession(239)));
+  // The package that was verified isn't left temp mounted.
+  for (const auto& mount : GetApexMounts()) {
+    ASSERT_FALSE(EndsWith(mount, ".tmp")) << mount;
+  }
+}
+
 class ApexActivationFailureTests : public ApexdMountTest {};
 
 TEST_F(ApexActivationFailureTests, BuildFingerprintDifferent) {
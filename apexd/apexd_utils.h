@@ -364,6 +364,31 @@ inline android::base::Result<uintmax_t> GetFileSize(
   return value;
 }
 
+// Decodes |hex|, e.g. a salt or root digest as stored in APEX metadata.
+inline android::base::Result<std::vector<uint8_t>> HexToBin(
+    const std::string& hex) {
+  auto nibble = [](char c) -> int {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  };
+  if (hex.size() % 2 != 0) {
+    return android::base::Error() << "Odd length hex string " << hex;
+  }
+  std::vector<uint8_t> bin;
+  bin.reserve(hex.size() / 2);
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    int high = nibble(hex[i]);
+    int low = nibble(hex[i + 1]);
+    if (high < 0 || low < 0) {
+      return android::base::Error() << "Invalid hex string " << hex;
+    }
+    bin.push_back(static_cast<uint8_t>((high << 4) | low));
+  }
+  return bin;
+}
+
 inline android::base::Result<void> RestoreconPath(const std::string& path) {
   unsigned int seflags = SELINUX_ANDROID_RESTORECON_RECURSE;
   if (selinux_android_restorecon(path.c_str(), seflags) < 0) {
@@ -222,6 +222,15 @@ TEST(ApexdUtilTest, FindFilesBySuffix) {
                                             fourth_filename));
 }
 
+TEST(ApexdUtilTest, HexToBin) {
+  auto bin = HexToBin("00a1FF");
+  ASSERT_TRUE(IsOk(bin));
+  ASSERT_EQ(*bin, (std::vector<uint8_t>{0x00, 0xa1, 0xff}));
+  ASSERT_TRUE(IsOk(HexToBin("")));
+  ASSERT_FALSE(IsOk(HexToBin("abc")));
+  ASSERT_FALSE(IsOk(HexToBin("0g")));
+}
+
 TEST(ApexdTestUtilsTest, MountNamespaceRestorer) {
   auto original_namespace = GetCurrentMountNamespace();
   ASSERT_RESULT_OK(original_namespace);
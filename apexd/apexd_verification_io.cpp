@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "apexd"
+
+#include "apexd_verification_io.h"
+
+#include <linux/ioprio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <android-base/logging.h>
+
+using android::base::Error;
+using android::base::Result;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+// Both apply to the calling thread only.
+int GetIoprio() { return syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0); }
+
+int SetIoprio(int ioprio) {
+  return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio);
+}
+
+thread_local ScopedVerificationIo* tCurrentVerificationIo = nullptr;
+
+}  // namespace
+
+ScopedVerificationIo::ScopedVerificationIo(const VerificationIoConfig& config,
+                                           VerificationCancelFlag cancelled)
+    : config_(config),
+      cancelled_(std::move(cancelled)),
+      start_(std::chrono::steady_clock::now()),
+      previous_(tCurrentVerificationIo) {
+  saved_ioprio_ = GetIoprio();
+  static constexpr int kLowestBestEffortLevel = 7;
+  int ioprio = config_.idle
+                   ? IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)
+                   : IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, kLowestBestEffortLevel);
+  if (saved_ioprio_ == -1 || SetIoprio(ioprio) != 0) {
+    PLOG(WARNING) << "Failed to lower I/O priority of verification";
+    saved_ioprio_ = -1;
+  }
+  tCurrentVerificationIo = this;
+}
+
+ScopedVerificationIo::~ScopedVerificationIo() {
+  tCurrentVerificationIo = previous_;
+  if (saved_ioprio_ != -1 && SetIoprio(saved_ioprio_) != 0) {
+    PLOG(ERROR) << "Failed to restore I/O priority";
+  }
+}
+
+Result<void> OnVerificationRead(size_t bytes) {
+  ScopedVerificationIo* io = tCurrentVerificationIo;
+  if (io == nullptr) {
+    return {};
+  }
+  auto is_cancelled = [&]() {
+    return io->cancelled_ != nullptr && io->cancelled_->load();
+  };
+  if (is_cancelled()) {
+    return Error() << "Verification was cancelled";
+  }
+  if (io->config_.max_bytes_per_sec == 0) {
+    return {};
+  }
+  // Sleep until the bytes read so far fit under the limit, in short slices so
+  // that cancellation isn't delayed.
+  static constexpr auto kMaxSleep = std::chrono::milliseconds(10);
+  auto allowed_at =
+      io->start_ + std::chrono::microseconds(io->bytes_read_ * 1000000 /
+                                             io->config_.max_bytes_per_sec);
+  for (auto now = std::chrono::steady_clock::now(); now < allowed_at;
+       now = std::chrono::steady_clock::now()) {
+    std::this_thread::sleep_until(std::min(allowed_at, now + kMaxSleep));
+    if (is_cancelled()) {
+      return Error() << "Verification was cancelled";
+    }
+  }
+  io->bytes_read_ += bytes;
+  return {};
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include <android-base/result.h>
+
+namespace android {
+namespace apex {
+
+// Set to request that the verification reading a package stops.
+using VerificationCancelFlag = std::shared_ptr<std::atomic<bool>>;
+
+struct VerificationIoConfig {
+  // Read using the idle I/O scheduling class, instead of the lowest priority
+  // of the best-effort class.
+  bool idle = false;
+  // Upper bound on the read throughput of the calling thread, 0 if unbounded.
+  uint64_t max_bytes_per_sec = 0;
+};
+
+// For as long as it lives, lowers the I/O priority of the calling thread and
+// makes OnVerificationRead on that thread honour |config| and |cancelled|.
+// The previous I/O priority is restored on destruction, as verification runs
+// on binder threads that are reused for other calls.
+class ScopedVerificationIo {
+ public:
+  ScopedVerificationIo(const VerificationIoConfig& config,
+                       VerificationCancelFlag cancelled);
+  ~ScopedVerificationIo();
+
+  ScopedVerificationIo(const ScopedVerificationIo&) = delete;
+  ScopedVerificationIo& operator=(const ScopedVerificationIo&) = delete;
+
+ private:
+  friend android::base::Result<void> OnVerificationRead(size_t bytes);
+
+  const VerificationIoConfig config_;
+  const VerificationCancelFlag cancelled_;
+  int saved_ioprio_ = -1;
+  std::chrono::steady_clock::time_point start_;
+  uint64_t bytes_read_ = 0;
+  ScopedVerificationIo* previous_;
+};
+
+// Must be called before each read of a package being verified. Fails once the
+// verification running on this thread has been cancelled, and otherwise
+// sleeps as long as needed to stay under the bandwidth limit. Does nothing
+// outside of a ScopedVerificationIo.
+android::base::Result<void> OnVerificationRead(size_t bytes);
+
+}  // namespace apex
+}  // namespace android
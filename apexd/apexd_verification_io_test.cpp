@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/ioprio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "apexd_test_utils.h"
+#include "apexd_verification_io.h"
+
+namespace android {
+namespace apex {
+
+using android::apex::testing::IsOk;
+
+TEST(ApexdVerificationIoTest, NoOpOutsideOfScope) {
+  ASSERT_TRUE(IsOk(OnVerificationRead(1024 * 1024)));
+}
+
+TEST(ApexdVerificationIoTest, RestoresIoPriority) {
+  int before = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+  {
+    ScopedVerificationIo scoped_io({}, nullptr);
+    ASSERT_TRUE(IsOk(OnVerificationRead(4096)));
+  }
+  ASSERT_EQ(before, syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0));
+}
+
+TEST(ApexdVerificationIoTest, StopsOnceCancelled) {
+  auto cancelled = std::make_shared<std::atomic<bool>>(false);
+  ScopedVerificationIo scoped_io({}, cancelled);
+  ASSERT_TRUE(IsOk(OnVerificationRead(4096)));
+  cancelled->store(true);
+  ASSERT_FALSE(IsOk(OnVerificationRead(4096)));
+}
+
+TEST(ApexdVerificationIoTest, CancellationInterruptsThrottling) {
+  auto cancelled = std::make_shared<std::atomic<bool>>(false);
+  // 1 KiB/s, so that the second read would otherwise wait for 1000 seconds.
+  ScopedVerificationIo scoped_io({.max_bytes_per_sec = 1024}, cancelled);
+  ASSERT_TRUE(IsOk(OnVerificationRead(1024 * 1000)));
+
+  std::thread canceller([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    cancelled->store(true);
+  });
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_FALSE(IsOk(OnVerificationRead(4096)));
+  canceller.join();
+  ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+}
+
+TEST(ApexdVerificationIoTest, PacesReads) {
+  // Reading 3 chunks at 10 chunks per second needs at least 200ms, as the
+  // first chunk isn't delayed.
+  static constexpr size_t kChunk = 4096;
+  ScopedVerificationIo scoped_io({.max_bytes_per_sec = 10 * kChunk}, nullptr);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(IsOk(OnVerificationRead(kChunk)));
+  }
+  ASSERT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(200));
+}
+
+}  // namespace apex
+}  // namespace android
@@ -17,6 +17,9 @@
 
 #include "apexd_verity.h"
 
+#include <linux/fsverity.h>
+#include <sys/ioctl.h>
+
 #include <filesystem>
 #include <vector>
 
@@ -28,38 +31,28 @@
 #include "apex_constants.h"
 #include "apex_file.h"
 #include "apexd_utils.h"
+#include "apexd_verification_io.h"
 
 using android::base::Dirname;
 using android::base::ErrnoError;
 using android::base::Error;
+using android::base::ReadFileToString;
 using android::base::ReadFully;
 using android::base::Result;
 using android::base::unique_fd;
+using android::base::WriteStringToFile;
 
 namespace android {
 namespace apex {
 
 namespace {
 
-uint8_t HexToBin(char h) {
-  if (h >= 'A' && h <= 'H') return h - 'A' + 10;
-  if (h >= 'a' && h <= 'h') return h - 'a' + 10;
-  return h - '0';
-}
-
-std::vector<uint8_t> HexToBin(const std::string& hex) {
-  std::vector<uint8_t> bin;
-  bin.reserve(hex.size() / 2);
-  for (size_t i = 0; i + 1 < hex.size(); i += 2) {
-    uint8_t c = (HexToBin(hex[i]) << 4) + HexToBin(hex[i + 1]);
-    bin.push_back(c);
-  }
-  return bin;
-}
+constexpr uint32_t kFsVerityBlockSize = 4096;
 
-Result<void> GenerateHashTree(const ApexFile& apex,
-                              const ApexVerityData& verity_data,
-                              const std::string& hashtree_file) {
+// Hashes the payload of |apex| and checks that the resulting root digest
+// matches |verity_data.root_digest|.
+Result<std::unique_ptr<HashTreeBuilder>> BuildVerifiedHashTree(
+    const ApexFile& apex, const ApexVerityData& verity_data) {
   unique_fd fd(
       TEMP_FAILURE_RETRY(open(apex.GetPath().c_str(), O_RDONLY | O_CLOEXEC)));
   if (fd.get() == -1) {
@@ -75,8 +68,12 @@ Result<void> GenerateHashTree(const ApexFile& apex,
                    << verity_data.hash_algorithm;
   }
 
+  auto salt = HexToBin(verity_data.salt);
+  if (!salt.ok()) {
+    return salt.error();
+  }
   auto builder = std::make_unique<HashTreeBuilder>(block_size, hash_fn);
-  if (!builder->Initialize(image_size, HexToBin(verity_data.salt))) {
+  if (!builder->Initialize(image_size, *salt)) {
     return Error() << "Invalid image size " << image_size;
   }
 
@@ -90,6 +87,9 @@ Result<void> GenerateHashTree(const ApexFile& apex,
   auto block_count = image_size / block_size;
   auto buf = std::vector<uint8_t>(block_size);
   while (block_count-- > 0) {
+    if (auto st = OnVerificationRead(block_size); !st.ok()) {
+      return st.error();
+    }
     if (!ReadFully(fd, buf.data(), block_size)) {
       return Error() << "Failed to read";
     }
@@ -102,22 +102,39 @@ Result<void> GenerateHashTree(const ApexFile& apex,
   }
 
   auto golden_digest = HexToBin(verity_data.root_digest);
+  if (!golden_digest.ok()) {
+    return golden_digest.error();
+  }
   auto digest = builder->root_hash();
   // This returns zero-padded digest.
   // resize() it to compare with golden digest,
-  digest.resize(golden_digest.size());
-  if (digest != golden_digest) {
+  digest.resize(golden_digest->size());
+  if (digest != *golden_digest) {
     return Error() << "Failed to build hashtree: root digest mismatch";
   }
+  return builder;
+}
 
+Result<void> WriteHashTree(const HashTreeBuilder& builder,
+                           const std::string& hashtree_file) {
   unique_fd out_fd(TEMP_FAILURE_RETRY(open(
       hashtree_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)));
-  if (!builder->WriteHashTreeToFd(out_fd, 0)) {
+  if (!builder.WriteHashTreeToFd(out_fd, 0)) {
     return Error() << "Failed to write hashtree to " << hashtree_file;
   }
   return {};
 }
 
+Result<void> GenerateHashTree(const ApexFile& apex,
+                              const ApexVerityData& verity_data,
+                              const std::string& hashtree_file) {
+  auto builder = BuildVerifiedHashTree(apex, verity_data);
+  if (!builder.ok()) {
+    return builder.error();
+  }
+  return WriteHashTree(**builder, hashtree_file);
+}
+
 Result<std::string> CalculateRootDigest(const std::string& hashtree_file,
                                         const ApexVerityData& verity_data) {
   unique_fd fd(
@@ -137,8 +154,12 @@ Result<std::string> CalculateRootDigest(const std::string& hashtree_file,
     return Error() << "Unsupported hash algorithm "
                    << verity_data.hash_algorithm;
   }
+  auto salt = HexToBin(verity_data.salt);
+  if (!salt.ok()) {
+    return salt.error();
+  }
   auto builder = std::make_unique<HashTreeBuilder>(block_size, hash_fn);
-  if (!builder->Initialize(image_size, HexToBin(verity_data.salt))) {
+  if (!builder->Initialize(image_size, *salt)) {
     return Error() << "Invalid image size " << image_size;
   }
   std::vector<unsigned char> root_digest;
@@ -150,6 +171,21 @@ Result<std::string> CalculateRootDigest(const std::string& hashtree_file,
   return result;
 }
 
+// Returns the hex encoded fs-verity digest of |path|, opened as |fd|.
+Result<std::string> MeasureFsVerity(int fd, const std::string& path) {
+  struct {
+    struct fsverity_digest header;
+    uint8_t digest[FS_VERITY_MAX_DIGEST_SIZE];
+  } d = {};
+  d.header.digest_size = sizeof(d.digest);
+  if (ioctl(fd, FS_IOC_MEASURE_VERITY, &d) != 0) {
+    return ErrnoError() << "Failed to measure fs-verity digest of " << path;
+  }
+  std::vector<unsigned char> digest(d.digest,
+                                    d.digest + d.header.digest_size);
+  return HashTreeBuilder::BytesArrayToString(digest);
+}
+
 }  // namespace
 
 Result<PrepareHashTreeResult> PrepareHashTree(
@@ -195,6 +231,99 @@ Result<PrepareHashTreeResult> PrepareHashTree(
   return kReuse;
 }
 
+Result<std::string> EnableAndMeasureFsVerity(const std::string& path) {
+  unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << path;
+  }
+
+  struct fsverity_enable_arg arg = {};
+  arg.version = 1;
+  arg.hash_algorithm = FS_VERITY_HASH_ALG_SHA256;
+  arg.block_size = kFsVerityBlockSize;
+  if (ioctl(fd.get(), FS_IOC_ENABLE_VERITY, &arg) != 0 && errno != EEXIST) {
+    return ErrnoError() << "Failed to enable fs-verity on " << path;
+  }
+
+  return MeasureFsVerity(fd.get(), path);
+}
+
+Result<PrepareHashTreeResult> PrepareFsVerity(const ApexFile& apex,
+                                              const ApexVerityData& verity_data,
+                                              const std::string& digest_file) {
+  if (apex.IsCompressed()) {
+    return Error() << "Cannot enable fs-verity on compressed APEX";
+  }
+  if (auto st = CreateDirIfNeeded(Dirname(digest_file), 0700); !st.ok()) {
+    return st.error();
+  }
+
+  auto fs_verity_digest = EnableAndMeasureFsVerity(apex.GetPath());
+  if (!fs_verity_digest.ok()) {
+    return fs_verity_digest.error();
+  }
+  // Once fs-verity is enabled the file can't be modified anymore, so it's
+  // enough to check its payload against the AVB root digest only once.
+  const std::string binding = *fs_verity_digest + " " + verity_data.root_digest;
+
+  std::string cached_binding;
+  if (ReadFileToString(digest_file, &cached_binding) &&
+      cached_binding == binding) {
+    LOG(INFO) << "fs-verity: reuse " << digest_file;
+    return kReuse;
+  }
+
+  auto builder = BuildVerifiedHashTree(apex, verity_data);
+  if (!builder.ok()) {
+    return builder.error();
+  }
+  if (!WriteStringToFile(binding, digest_file, 0600, getuid(), getgid())) {
+    return ErrnoError() << "Failed to write " << digest_file;
+  }
+  LOG(INFO) << "fs-verity: verified " << apex.GetPath() << " against "
+            << verity_data.root_digest;
+  return KRegenerate;
+}
+
+Result<void> CheckFsVerity(const ApexFile& apex,
+                           const ApexVerityData& verity_data,
+                           const std::string& digest_file) {
+  std::string binding;
+  if (!ReadFileToString(digest_file, &binding)) {
+    return ErrnoError() << "Failed to read " << digest_file;
+  }
+  unique_fd fd(TEMP_FAILURE_RETRY(
+      open(apex.GetPath().c_str(), O_RDONLY | O_CLOEXEC)));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << apex.GetPath();
+  }
+  auto fs_verity_digest = MeasureFsVerity(fd.get(), apex.GetPath());
+  if (!fs_verity_digest.ok()) {
+    return fs_verity_digest.error();
+  }
+  if (binding != *fs_verity_digest + " " + verity_data.root_digest) {
+    return Error() << "fs-verity digest of " << apex.GetPath()
+                   << " is not the one recorded in " << digest_file;
+  }
+  return {};
+}
+
+Result<void> VerifyPayloadDigest(const ApexFile& apex,
+                                 const ApexVerityData& verity_data,
+                                 const std::string& hashtree_file) {
+  auto builder = BuildVerifiedHashTree(apex, verity_data);
+  if (!builder.ok()) {
+    return builder.error();
+  }
+  if (hashtree_file.empty() || verity_data.desc->tree_size != 0) {
+    return {};
+  }
+  if (auto st = CreateDirIfNeeded(Dirname(hashtree_file), 0700); !st.ok()) {
+    return st.error();
+  }
+  return WriteHashTree(**builder, hashtree_file);
+}
+
 void RemoveObsoleteHashTrees() {
   // TODO(b/120058143): on boot complete, remove unused hashtree files
 }
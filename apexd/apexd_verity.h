@@ -35,6 +35,32 @@ android::base::Result<PrepareHashTreeResult> PrepareHashTree(
     const ApexFile& apex, const ApexVerityData& verity_data,
     const std::string& hashtree_file);
 
+// Enables fs-verity on |path| unless it is already enabled, and returns the
+// hex encoded fs-verity digest of the file.
+android::base::Result<std::string> EnableAndMeasureFsVerity(
+    const std::string& path);
+
+// Protects |apex| with fs-verity and checks that its payload matches
+// |verity_data.root_digest|. The pair of digests is recorded in |digest_file|,
+// so that the payload is only hashed again if either of them changes.
+android::base::Result<PrepareHashTreeResult> PrepareFsVerity(
+    const ApexFile& apex, const ApexVerityData& verity_data,
+    const std::string& digest_file);
+
+// Checks that |apex| already has fs-verity enabled, and that |digest_file|
+// binds its fs-verity digest to |verity_data.root_digest|. Unlike
+// PrepareFsVerity, never reads the payload.
+android::base::Result<void> CheckFsVerity(const ApexFile& apex,
+                                          const ApexVerityData& verity_data,
+                                          const std::string& digest_file);
+
+// Hashes the payload of |apex| and checks that the root digest of the resulting
+// hashtree matches |verity_data.root_digest|. Unless |apex| embeds its
+// hashtree, the hashtree is then written to |hashtree_file|, if given.
+android::base::Result<void> VerifyPayloadDigest(
+    const ApexFile& apex, const ApexVerityData& verity_data,
+    const std::string& hashtree_file = "");
+
 void RemoveObsoleteHashTrees();
 
 }  // namespace apex
@@ -37,6 +37,7 @@ using android::apex::testing::IsOk;
 using android::base::GetExecutableDirectory;
 using android::base::ReadFileToString;
 using android::base::StringPrintf;
+using android::base::WriteStringToFile;
 
 static std::string GetTestDataDir() { return GetExecutableDirectory(); }
 static std::string GetTestFile(const std::string& name) {
@@ -127,5 +128,36 @@ TEST(ApexdVerityTest, CannotPrepareHashTreeForCompressedApex) {
       ::testing::HasSubstr("Cannot prepare HashTree of compressed APEX"));
 }
 
+TEST(ApexdVerityTest, PrepareFsVerityReusesBinding) {
+  TemporaryDir td;
+
+  // Enabling fs-verity makes the file immutable, so work on a copy.
+  auto apex_path = StringPrintf("%s/apex.apexd_test.apex", td.path);
+  std::string content;
+  ASSERT_TRUE(ReadFileToString(GetTestFile("apex.apexd_test.apex"), &content));
+  ASSERT_TRUE(WriteStringToFile(content, apex_path));
+
+  auto apex = ApexFile::Open(apex_path);
+  ASSERT_TRUE(IsOk(apex));
+  auto verity_data = apex->VerifyApexVerity(apex->GetBundledPublicKey());
+  ASSERT_TRUE(IsOk(verity_data));
+
+  auto digest_file = StringPrintf("%s/apex.apexd_test.fsverity", td.path);
+  ASSERT_FALSE(IsOk(CheckFsVerity(*apex, *verity_data, digest_file)));
+  auto status = PrepareFsVerity(*apex, *verity_data, digest_file);
+  if (!status.ok() && (status.error().code() == EOPNOTSUPP ||
+                       status.error().code() == ENOTTY)) {
+    GTEST_SKIP() << "fs-verity is not supported: " << status.error();
+  }
+  ASSERT_TRUE(IsOk(status));
+  ASSERT_EQ(KRegenerate, *status);
+
+  // Payload was already checked against the root digest, binding is reused.
+  status = PrepareFsVerity(*apex, *verity_data, digest_file);
+  ASSERT_TRUE(IsOk(status));
+  ASSERT_EQ(kReuse, *status);
+  ASSERT_TRUE(IsOk(CheckFsVerity(*apex, *verity_data, digest_file)));
+}
+
 }  // namespace apex
 }  // namespace android
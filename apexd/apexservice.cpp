@@ -74,6 +74,9 @@ class ApexService : public BnApexService {
   BinderStatus unstagePackages(const std::vector<std::string>& paths) override;
   BinderStatus submitStagedSession(const ApexSessionParams& params,
                                    ApexInfoList* apex_info_list) override;
+  BinderStatus stageApexFromFd(
+      int session_id, const ::android::os::ParcelFileDescriptor& apex_fd)
+      override;
   BinderStatus markStagedSessionReady(int session_id) override;
   BinderStatus markStagedSessionSuccessful(int session_id) override;
   BinderStatus getSessions(std::vector<ApexSessionInfo>* aidl_return) override;
@@ -111,6 +114,11 @@ class ApexService : public BnApexService {
       int64_t* required_size) override;
   BinderStatus reserveSpaceForCompressedApex(
       const CompressedApexInfoList& compressed_apex_info_list) override;
+  BinderStatus startPreRebootDecompression(
+      const std::vector<std::string>& capex_paths) override;
+  BinderStatus getPreRebootDecompressionInfo(
+      PreRebootDecompressionInfo* aidl_return) override;
+  BinderStatus cancelPreRebootDecompression() override;
   BinderStatus installAndActivatePackage(const std::string& package_path,
                                          ApexInfo* aidl_return) override;
 
@@ -194,6 +202,22 @@ BinderStatus ApexService::submitStagedSession(const ApexSessionParams& params,
   return BinderStatus::ok();
 }
 
+BinderStatus ApexService::stageApexFromFd(
+    int session_id, const ::android::os::ParcelFileDescriptor& apex_fd) {
+  LOG(DEBUG) << "stageApexFromFd() received by ApexService, session id "
+             << session_id;
+  Result<void> res =
+      ::android::apex::StageApexFromFd(session_id, apex_fd.get().get());
+  if (!res.ok()) {
+    LOG(ERROR) << "Failed to stage APEX of session id " << session_id << ": "
+               << res.error();
+    return BinderStatus::fromExceptionCode(
+        BinderStatus::EX_SERVICE_SPECIFIC,
+        String8(res.error().message().c_str()));
+  }
+  return BinderStatus::ok();
+}
+
 BinderStatus ApexService::markStagedSessionReady(int session_id) {
   LOG(DEBUG) << "markStagedSessionReady() received by ApexService, session id "
              << session_id;
@@ -245,13 +269,18 @@ BinderStatus ApexService::calculateSizeForCompressedApex(
 
 BinderStatus ApexService::reserveSpaceForCompressedApex(
     const CompressedApexInfoList& compressed_apex_info_list) {
-  int64_t required_size;
-  if (auto res = calculateSizeForCompressedApex(compressed_apex_info_list,
-                                                &required_size);
-      !res.isOk()) {
-    return res;
+  // Reserve space for each package separately, so that it can be decompressed
+  // into its own reservation.
+  std::map<std::string, int64_t> required_sizes;
+  const auto& instance = ApexFileRepository::GetInstance();
+  for (const auto& apex_info : compressed_apex_info_list.apexInfos) {
+    auto should_allocate_space = ShouldAllocateSpaceForDecompression(
+        apex_info.moduleName, apex_info.versionCode, instance);
+    if (!should_allocate_space.ok() || *should_allocate_space) {
+      required_sizes[apex_info.moduleName] += apex_info.decompressedSize;
+    }
   }
-  if (auto res = ReserveSpaceForCompressedApex(required_size, kOtaReservedDir);
+  if (auto res = ReserveSpaceForCompressedApex(required_sizes, kOtaReservedDir);
       !res.ok()) {
     return BinderStatus::fromExceptionCode(
         BinderStatus::EX_SERVICE_SPECIFIC,
@@ -260,6 +289,36 @@ BinderStatus ApexService::reserveSpaceForCompressedApex(
   return BinderStatus::ok();
 }
 
+BinderStatus ApexService::startPreRebootDecompression(
+    const std::vector<std::string>& capex_paths) {
+  LOG(DEBUG) << "startPreRebootDecompression() received by ApexService, paths "
+             << Join(capex_paths, ',');
+  if (auto res = StartPreRebootDecompression(capex_paths); !res.ok()) {
+    return BinderStatus::fromExceptionCode(
+        BinderStatus::EX_SERVICE_SPECIFIC,
+        String8(res.error().message().c_str()));
+  }
+  return BinderStatus::ok();
+}
+
+BinderStatus ApexService::getPreRebootDecompressionInfo(
+    PreRebootDecompressionInfo* aidl_return) {
+  auto status = GetPreRebootDecompressionStatus();
+  aidl_return->totalCount = status.total_count;
+  aidl_return->completedCount = status.completed_count;
+  aidl_return->failedCount = status.failed_count;
+  aidl_return->isRunning = status.is_running;
+  aidl_return->isCancelled = status.is_cancelled;
+  aidl_return->currentCapexPath = status.current_capex_path;
+  return BinderStatus::ok();
+}
+
+BinderStatus ApexService::cancelPreRebootDecompression() {
+  LOG(DEBUG) << "cancelPreRebootDecompression() received by ApexService";
+  CancelPreRebootDecompression();
+  return BinderStatus::ok();
+}
+
 static void ClearSessionInfo(ApexSessionInfo* session_info) {
   session_info->sessionId = -1;
   session_info->isUnknown = false;
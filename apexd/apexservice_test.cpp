@@ -689,6 +689,35 @@ TEST_F(ApexServiceTest, SubmitStagedSessionStoresBuildFingerprint) {
   ASSERT_FALSE(session->GetBuildFingerprint().empty());
 }
 
+TEST_F(ApexServiceTest, StageApexFromFdThenSubmitStagedSession) {
+  static constexpr const char* kSessionDir = "/data/app-staging/session_1553";
+  ASSERT_EQ(0, mkdir(kSessionDir, 0777)) << strerror(errno);
+  auto deleter = android::base::make_scope_guard(
+      []() { std::filesystem::remove_all(kSessionDir); });
+  int rc = setfilecon(kSessionDir, "u:object_r:staging_data_file:s0");
+  ASSERT_TRUE(0 == rc || !HaveSelinux()) << strerror(errno);
+
+  unique_fd fd(open(GetTestFile("apex.apexd_test.apex").c_str(),
+                    O_RDONLY | O_CLOEXEC));
+  ASSERT_NE(-1, fd.get()) << strerror(errno);
+  ASSERT_TRUE(IsOk(service_->stageApexFromFd(
+      1553, android::os::ParcelFileDescriptor(std::move(fd)))));
+  std::string staged = std::string(kSessionDir) + "/" + kStreamedApexFileName;
+  ASSERT_TRUE(RegularFileExists(staged));
+  // A second APEX can't be streamed into the same session.
+  fd.reset(open(GetTestFile("apex.apexd_test.apex").c_str(),
+                O_RDONLY | O_CLOEXEC));
+  ASSERT_FALSE(IsOk(service_->stageApexFromFd(
+      1553, android::os::ParcelFileDescriptor(std::move(fd)))));
+
+  ApexInfoList list;
+  ApexSessionParams params;
+  params.sessionId = 1553;
+  ASSERT_TRUE(IsOk(service_->submitStagedSession(params, &list)));
+  ASSERT_EQ(1u, list.apexInfos.size());
+  ASSERT_EQ(staged, list.apexInfos[0].modulePath);
+}
+
 TEST_F(ApexServiceTest, SubmitStagedSessionFailDoesNotLeakTempVerityDevices) {
   PrepareTestApexForInstall installer(
       GetTestFile("apex.apexd_test_manifest_mismatch.apex"),
@@ -3128,8 +3157,16 @@ TEST_F(ApexServiceTestForCompressedApex, ReserveSpaceForCompressedApex) {
     ASSERT_TRUE(IsOk(service_->reserveSpaceForCompressedApex(non_empty_list)));
     auto files = ReadDir(kOtaReservedDir, [](auto _) { return true; });
     ASSERT_TRUE(IsOk(files));
-    ASSERT_EQ(files->size(), 1u);
-    EXPECT_EQ((int64_t)fs::file_size((*files)[0]), required_size);
+    // One reservation per package that needs space
+    ASSERT_EQ(files->size(), 3u);
+    int64_t reserved_size = 0;
+    for (const auto& file : *files) {
+      reserved_size += fs::file_size(file);
+    }
+    EXPECT_EQ(reserved_size, required_size);
+    EXPECT_EQ((int64_t)fs::file_size(GetReservedSpacePath(
+                  kOtaReservedDir, "com.android.apex.compressed")),
+              8);
   }
 
   // Sending empty list should delete reserved file
@@ -106,8 +106,16 @@ def ParseArgs(argv):
       metavar='FS_TYPE',
       required=False,
       default='ext4',
-      choices=['ext4', 'f2fs'],
-      help='type of filesystem being used for payload image "ext4" or "f2fs"')
+      choices=['ext4', 'f2fs', 'erofs'],
+      help='type of filesystem being used for payload image "ext4", "f2fs" or "erofs"')
+  parser.add_argument(
+      '--payload_fs_compression',
+      metavar='COMPRESSION',
+      required=False,
+      default='lz4hc',
+      choices=['none', 'lz4', 'lz4hc'],
+      help='compression algorithm used for "erofs" payload image. Ignored for other '
+      'filesystem types.')
   parser.add_argument(
       '--override_apk_package_name',
       required=False,
@@ -388,6 +396,8 @@ def GenerateBuildInfo(args):
 
   if args.payload_type == 'image':
     build_info.payload_fs_type = args.payload_fs_type
+    if args.payload_fs_type == 'erofs':
+      build_info.payload_fs_compression = args.payload_fs_compression
 
   return build_info
 
@@ -590,6 +600,29 @@ def CreateApex(args, work_dir):
 
       # TODO(b/158453869): resize the image file to save space
 
+    elif args.payload_fs_type == 'erofs':
+      # mkfs.erofs takes a single source directory, so merge the manifests
+      # into a copy of the input directory.
+      erofs_src_dir = os.path.join(work_dir, 'erofs_src')
+      shutil.copytree(args.input_dir, erofs_src_dir, symlinks=True)
+      for f in os.listdir(manifests_dir):
+        copyfile(os.path.join(manifests_dir, f), os.path.join(erofs_src_dir, f))
+
+      # mkfs.erofs sizes the image to fit its content, no margin is needed.
+      cmd = ['mkfs.erofs']
+      if args.payload_fs_compression != 'none':
+        cmd.append('-z' + args.payload_fs_compression)
+      cmd.extend(['-b', str(BLOCK_SIZE)])
+      uu = str(uuid.uuid5(uuid.NAMESPACE_URL, 'www.android.com'))
+      cmd.extend(['-U', uu])
+      cmd.extend(['-T', '0'])  # time is set to epoch
+      cmd.extend(['--file-contexts', args.file_contexts])
+      cmd.extend(['--fs-config-file', args.canned_fs_config])
+      cmd.append('--mount-point=/')
+      cmd.append(img_file)
+      cmd.append(erofs_src_dir)
+      RunCommand(cmd, args.verbose)
+
     if args.unsigned_payload_only:
       shutil.copyfile(img_file, args.output)
       if (args.verbose):
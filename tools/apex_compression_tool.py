@@ -24,7 +24,9 @@ Example:
 from __future__ import print_function
 
 import argparse
+import hashlib
 import os
+import re
 import shutil
 import subprocess
 import sys
@@ -71,7 +73,12 @@ def RunCompress(args, work_dir):
   """RunCompress takes an uncompressed APEX and compresses into compressed APEX
 
   Compressed apex will contain the following items:
-      - original_apex: The original uncompressed APEX
+      - original_apex: The original uncompressed APEX, deflated by the zip.
+        With --compression=zstd it is stored as original_apex.zst instead,
+        zstd compressed and stored in the zip without further compression.
+        With --chunk_size, original_apex is split into chunks which are
+        compressed independently, and the compressed size and digest of
+        every chunk are recorded in the capexMetadata of apex_manifest.pb.
       - Duplicates of various meta files inside the input APEX, e.g
         AndroidManifest.xml, public_key
 
@@ -85,6 +92,12 @@ def RunCompress(args, work_dir):
   global tool_path_list
   tool_path_list = args.apex_compression_tool_path
 
+  if args.chunk_size and (args.compression != 'zstd' or
+                          args.chunk_size % 4096 != 0):
+    print('--chunk_size must be a multiple of 4096 and needs '
+          '--compression=zstd')
+    return False
+
   cmd = ['soong_zip']
   cmd.extend(['-o', args.output])
 
@@ -94,7 +107,23 @@ def RunCompress(args, work_dir):
   original_apex = os.path.join(work_dir, 'original_apex')
   os.link(args.input, original_apex)
   cmd.extend(['-C', work_dir])
-  cmd.extend(['-f', original_apex])
+  chunk_compressed_sizes = []
+  chunk_digests = []
+  if args.compression == 'zstd':
+    zstd_dir = os.path.join(work_dir, 'zstd')
+    os.mkdir(zstd_dir)
+    original_apex_zst = os.path.join(zstd_dir, 'original_apex.zst')
+    if args.chunk_size:
+      chunk_compressed_sizes, chunk_digests = CompressChunks(
+          original_apex, original_apex_zst, args.chunk_size, work_dir)
+    else:
+      RunCommand(['zstd', '-q', '-19', '--long=27', original_apex, '-o',
+                  original_apex_zst])
+    cmd.extend(['-C', zstd_dir])
+    cmd.extend(['-f', original_apex_zst])
+    cmd.extend(['-s', 'original_apex.zst'])
+  else:
+    cmd.extend(['-f', original_apex])
 
   # We also need to extract some files from inside of original_apex and zip
   # together with compressed apex
@@ -115,7 +144,10 @@ def RunCompress(args, work_dir):
 
   # Set digest of original_apex to apex_manifest.pb
   apex_manifest_path = os.path.join(extract_dir, 'apex_manifest.pb')
-  assert AddOriginalApexDigestToManifest(apex_manifest_path, image_path)
+  assert AddOriginalApexDigestToManifest(apex_manifest_path, image_path,
+                                         args.chunk_size,
+                                         chunk_compressed_sizes,
+                                         chunk_digests)
 
   # Don't forget to compress
   cmd.extend(['-L', '9'])
@@ -125,7 +157,39 @@ def RunCompress(args, work_dir):
   return True
 
 
-def AddOriginalApexDigestToManifest(capex_manifest_path, apex_image_path):
+def CompressChunks(input_path, output_path, chunk_size, work_dir):
+  """Compresses every chunk_size bytes of input_path into its own zstd frame
+
+  The frames are concatenated into output_path, which is still a valid zstd
+  stream as a whole.
+
+  Returns:
+      The lists of compressed sizes of the frames and of SHA-256 digests of
+      the chunks, in order
+  """
+  chunk_path = os.path.join(work_dir, 'chunk')
+  chunk_zst_path = os.path.join(work_dir, 'chunk.zst')
+  compressed_sizes = []
+  digests = []
+  with open(input_path, 'rb') as input_file, open(output_path, 'wb') as output:
+    while True:
+      chunk = input_file.read(chunk_size)
+      if not chunk:
+        break
+      digests.append(hashlib.sha256(chunk).digest())
+      with open(chunk_path, 'wb') as f:
+        f.write(chunk)
+      RunCommand(['zstd', '-q', '-f', '-19', chunk_path, '-o', chunk_zst_path])
+      with open(chunk_zst_path, 'rb') as f:
+        compressed_chunk = f.read()
+      output.write(compressed_chunk)
+      compressed_sizes.append(len(compressed_chunk))
+  return compressed_sizes, digests
+
+
+def AddOriginalApexDigestToManifest(capex_manifest_path, apex_image_path,
+                                    chunk_size=0, chunk_compressed_sizes=None,
+                                    chunk_digests=None):
   # Retrieve the root digest of the image
   avbtool_cmd = [
         'avbtool',
@@ -133,6 +197,10 @@ def AddOriginalApexDigestToManifest(capex_manifest_path, apex_image_path):
         apex_image_path]
   # avbtool_cmd output has format "<name>: <value>"
   root_digest = RunCommand(avbtool_cmd, True)[0].decode().split(': ')[1].strip()
+  # Retrieve the salt of the hashtree descriptor
+  avbtool_cmd = ['avbtool', 'info_image', '--image', apex_image_path]
+  info = RunCommand(avbtool_cmd, True)[0].decode()
+  salt = re.search(r'Salt:\s*([0-9a-fA-F]*)', info).group(1)
   # Update the manifest proto file
   with open(capex_manifest_path, 'rb') as f:
     pb = apex_manifest_pb2.ApexManifest()
@@ -140,6 +208,11 @@ def AddOriginalApexDigestToManifest(capex_manifest_path, apex_image_path):
   # Populate CompressedApexMetadata
   capex_metadata = apex_manifest_pb2.ApexManifest().CompressedApexMetadata()
   capex_metadata.originalApexDigest = root_digest
+  capex_metadata.originalApexSalt = salt
+  if chunk_compressed_sizes:
+    capex_metadata.chunkSize = chunk_size
+    capex_metadata.chunkCompressedSizes.extend(chunk_compressed_sizes)
+    capex_metadata.chunkDigests.extend(chunk_digests)
   # Set updated value to protobuf
   pb.capexMetadata.CopyFrom(capex_metadata)
   with open(capex_manifest_path, 'wb') as f:
@@ -170,6 +243,14 @@ def ParseArgs(argv):
       help="""A list of directories containing all the tools used by
         apex_compression_tool (e.g. soong_zip etc.) separated by ':'. Can also
         be set using the APEX_COMPRESSION_TOOL_PATH environment variable""")
+  parser_compress.add_argument('--compression', type=str, default='deflate',
+                               choices=['deflate', 'zstd'],
+                               help='algorithm used to compress original_apex')
+  parser_compress.add_argument('--chunk_size', type=int, default=0,
+                               help='with --compression=zstd, compresses '
+                                    'original_apex in independent chunks of '
+                                    'this many bytes, which must be a '
+                                    'multiple of 4096')
   parser_compress.set_defaults(func=RunCompress)
 
   return parser.parse_args(argv)